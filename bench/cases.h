@@ -0,0 +1,40 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Microbenchmark cases run by host.c.
+ *
+ */
+
+#ifndef __CASES__HH__
+#define __CASES__HH__
+
+#include "flash_config.h"
+
+#ifdef ENABLE_XL_DUAL_BANK
+#define BENCH_PAGE_SIZE 2048
+#else
+#define BENCH_PAGE_SIZE 1024
+#endif
+
+enum bench_kernel { K_CHECKSUM, K_PAGE_ERASED, K_COPY_TO_PM, K_COPY_FROM_PM, K_MEMCPY, K_STRING_DESC };
+
+struct bench_case {
+	const char *name;
+	enum bench_kernel kernel;
+	unsigned arg;        // Bytes, or string descriptor index for K_STRING_DESC
+};
+
+static const struct bench_case bench_cases[] = {
+	{ "checksum-1k",    K_CHECKSUM,     1024 },
+	{ "checksum-32k",   K_CHECKSUM,     32 * 1024 },
+	{ "page-erased",    K_PAGE_ERASED,  BENCH_PAGE_SIZE },
+	{ "copy-to-pm",     K_COPY_TO_PM,   64 },
+	{ "copy-from-pm",   K_COPY_FROM_PM, 64 },
+	{ "memcpy-64",      K_MEMCPY,       64 },
+	{ "memcpy-1k",      K_MEMCPY,       1024 },
+	{ "strdesc-product", K_STRING_DESC, 2 },
+	{ "strdesc-layout", K_STRING_DESC,  4 },
+};
+
+#define BENCH_NUM_CASES (sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+#endif
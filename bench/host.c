@@ -0,0 +1,154 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Host microbenchmark: times the bootloader hot loops (built from main.c
+ * and usb.c, see kernels.h) and reports ns/byte.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "kernels.h"
+#include "cases.h"
+
+#define ARENA_SIZE (256 * 1024)
+
+// main.c jumps through this under HOST_SIM, never called here
+void sim_start_image(uint32_t addr) {
+	abort();
+}
+
+// The blank check takes a 32 bit address
+static uint8_t *arena, *src, *dst, *pm, *blank;
+
+static volatile unsigned sink;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run(const struct bench_case *c, unsigned iters) {
+	for (unsigned i = 0; i < iters; i++) {
+		switch (c->kernel) {
+		case K_CHECKSUM:
+			sink += bench_checksum((uint32_t*)src, c->arg / 4);
+			break;
+		case K_PAGE_ERASED:
+			sink += bench_page_erased((uint32_t)(uintptr_t)blank);
+			break;
+		case K_COPY_TO_PM:
+			bench_copy_to_pm(pm, src, c->arg);
+			break;
+		case K_COPY_FROM_PM:
+			bench_copy_from_pm(dst, pm, c->arg);
+			break;
+		case K_MEMCPY:
+			bench_memcpy(dst, src, c->arg);
+			break;
+		case K_STRING_DESC:
+			sink += bench_string_desc(c->arg);
+			break;
+		}
+	}
+}
+
+// Best of a few rounds of at least min_ms each, in ns per call
+static double time_case(const struct bench_case *c, unsigned min_ms, unsigned rounds) {
+	unsigned iters = 1;
+	for (;;) {
+		uint64_t t = now_ns();
+		run(c, iters);
+		t = now_ns() - t;
+		if (t >= min_ms * 1000000ULL || iters >= (1U << 30))
+			break;
+		iters *= 2;
+	}
+
+	double best = 0;
+	for (unsigned r = 0; r < rounds; r++) {
+		uint64_t t = now_ns();
+		run(c, iters);
+		double ns = (double)(now_ns() - t) / iters;
+		if (!r || ns < best)
+			best = ns;
+	}
+	return best;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [options]\n", prog);
+	fprintf(stderr, "  -t ms       Minimum time per round (default 20)\n");
+	fprintf(stderr, "  -r n        Rounds, the best one is reported (default 5)\n");
+	fprintf(stderr, "  -k list     Cases (default all):");
+	for (unsigned i = 0; i < BENCH_NUM_CASES; i++)
+		fprintf(stderr, " %s", bench_cases[i].name);
+	fprintf(stderr, "\n  -c          CSV output\n");
+}
+
+static int in_list(const char *list, const char *name) {
+	if (!list)
+		return 1;
+	size_t len = strlen(name);
+	for (const char *p = list; p; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL)
+		if (!strncmp(p, name, len) && (p[len] == ',' || !p[len]))
+			return 1;
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	unsigned min_ms = 20, rounds = 5;
+	const char *kls = NULL;
+	int csv = 0, opt;
+
+	while ((opt = getopt(argc, argv, "ht:r:k:c")) != -1) {
+		switch (opt) {
+		case 't': min_ms = atoi(optarg); break;
+		case 'r': rounds = atoi(optarg); break;
+		case 'k': kls = optarg; break;
+		case 'c': csv = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!rounds)
+		rounds = 1;
+
+	arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	if (arena == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	// Image data, packet memory (2 bytes per halfword) and a blank page
+	src = arena;
+	dst = arena + 64 * 1024;
+	pm = arena + 128 * 1024;
+	blank = arena + 192 * 1024;
+	srand(1);
+	for (unsigned i = 0; i < 64 * 1024; i++)
+		src[i] = rand();
+	memset(blank, 0xff, BENCH_PAGE_SIZE);
+
+	printf("# Build %s: host %s\n", VERSION, __VERSION__);
+	if (csv)
+		printf("case,bytes,ns_call,ns_byte\n");
+	else
+		printf("%-16s %6s %10s %8s\n", "Case", "Bytes", "ns/call", "ns/byte");
+
+	for (unsigned i = 0; i < BENCH_NUM_CASES; i++) {
+		const struct bench_case *c = &bench_cases[i];
+		if (!in_list(kls, c->name))
+			continue;
+		unsigned bytes = c->kernel == K_STRING_DESC ? bench_string_len(c->arg) : c->arg;
+		double ns = time_case(c, min_ms, rounds);
+		printf(csv ? "%s,%u,%.2f,%.3f\n" : "%-16s %6u %10.2f %8.3f\n", c->name, bytes, ns, bytes ? ns / bytes : 0);
+	}
+	return 0;
+}
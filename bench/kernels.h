@@ -0,0 +1,28 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Entry points to the bootloader hot loops, built from the real main.c and
+ * usb.c (see kernels_main.c and kernels_usb.c), for host.c.
+ *
+ */
+
+#ifndef __KERNELS__HH__
+#define __KERNELS__HH__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Image checksum over nwords words (validate_checksum)
+int bench_checksum(const uint32_t *image, unsigned nwords);
+// Blank check of the flash page at addr (_flash_page_is_erased)
+int bench_page_erased(uint32_t addr);
+// Packet memory copies (st_usbfs_copy_to_pm/from_pm), pm has 2 bytes per halfword
+void bench_copy_to_pm(volatile void *pm, const void *buf, unsigned len);
+void bench_copy_from_pm(void *buf, const volatile void *pm, unsigned len);
+// The bootloader memcpy
+void *bench_memcpy(void *dst, const void *src, size_t count);
+// String descriptor idx (strlen and UTF-16 expansion), returns its length
+unsigned bench_string_desc(unsigned idx);
+// Characters in string descriptor idx (0 if there's none)
+unsigned bench_string_len(unsigned idx);
+
+#endif
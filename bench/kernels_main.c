@@ -0,0 +1,45 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Pulls main.c in, so its hot loops can be called on their own (see
+ * kernels.h). memcpy, strlen and main are renamed to stay out of the way of
+ * the host libc; the code is otherwise built as in the firmware.
+ *
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+void *fw_memcpy(void *dst, const void *src, size_t count);
+size_t fw_strlen(const char *s);
+
+#define main fw_main
+#define memcpy fw_memcpy
+#define strlen fw_strlen
+#include "../main.c"
+#undef main
+#undef memcpy
+#undef strlen
+
+#include "kernels.h"
+
+__attribute__((noinline, used))
+int bench_checksum(const uint32_t *image, unsigned nwords) {
+	return validate_checksum(image, nwords);
+}
+
+__attribute__((noinline, used))
+int bench_page_erased(uint32_t addr) {
+	return _flash_page_is_erased(addr);
+}
+
+__attribute__((noinline, used))
+void *bench_memcpy(void *dst, const void *src, size_t count) {
+	return fw_memcpy(dst, src, count);
+}
+
+__attribute__((noinline, used))
+unsigned bench_string_len(unsigned idx) {
+	if (!idx || idx > USB_NUM_STRINGS)
+		return 0;
+	return fw_strlen(_usb_strings[idx - 1]);
+}
@@ -0,0 +1,39 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Pulls usb.c in, so its hot loops can be called on their own (see
+ * kernels.h and kernels_main.c).
+ *
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+void *fw_memcpy(void *dst, const void *src, size_t count);
+size_t fw_strlen(const char *s);
+
+#define memcpy fw_memcpy
+#define strlen fw_strlen
+#include "../usb.c"
+#undef memcpy
+#undef strlen
+
+#include "kernels.h"
+
+__attribute__((noinline, used))
+void bench_copy_to_pm(volatile void *pm, const void *buf, unsigned len) {
+	st_usbfs_copy_to_pm(pm, buf, len);
+}
+
+__attribute__((noinline, used))
+void bench_copy_from_pm(void *buf, const volatile void *pm, unsigned len) {
+	st_usbfs_copy_from_pm(buf, pm, len);
+}
+
+__attribute__((noinline, used))
+unsigned bench_string_desc(unsigned idx) {
+	usb_req.wValue = (USB_DT_STRING << 8) | idx;
+	usb_req.wIndex = USB_LANGID_ENGLISH_US;
+	if (usb_standard_get_descriptor() != USBD_REQ_HANDLED)
+		return 0;
+	return datasize;
+}
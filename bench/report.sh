@@ -0,0 +1,24 @@
+#!/bin/sh
+# Prints the host microbenchmark results as a CSV table tagged with the git
+# version, and appends it to the given history file if any (so kernel
+# changes can be compared commit by commit). Run from the top level
+# directory after make microbench.
+
+version=$(git describe --abbrev=8 --dirty --always --tags)
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+./bench/host.exe -c | grep -v '^#' > "$tmp/host" || exit 1
+
+awk -F, -v ver="$version" '
+	FNR == 1 { next }
+	{ print ver "," $1 "," $2 "," $4 }
+' "$tmp/host" > "$tmp/report"
+
+header="version,case,bytes,host_ns_byte"
+echo "$header"
+cat "$tmp/report"
+if [ -n "$1" ]; then
+	[ -s "$1" ] || echo "$header" > "$1"
+	cat "$tmp/report" >> "$1"
+fi
@@ -0,0 +1,83 @@
+
+#ifndef __BOOT_HANDOFF__HH__
+#define __BOOT_HANDOFF__HH__
+
+#include <stdint.h>
+
+// Bootloader to app handoff block, built with ENABLE_BOOT_HANDOFF.
+// The bootloader fills it right before jumping to the app. It lives right
+// below the reboot flags (last 8 bytes of RAM), so apps should reserve
+// the last 40 bytes of RAM (or read it before their stack grows into it).
+
+#define BOOT_HANDOFF_ADDR     (0x20005000U - 8 - 32)
+#define BOOT_HANDOFF_MAGIC    0xB007DA7AU
+#define BOOT_HANDOFF_VERSION  1
+
+// boot_reason bits
+#define BOOT_REASON_COLD      0x01  // Power-on or low-power reset
+#define BOOT_REASON_PIN       0x02  // NRST pin reset
+#define BOOT_REASON_SOFTWARE  0x04  // Software reset (app reboot or end of a DFU session)
+#define BOOT_REASON_WATCHDOG  0x08  // Independent or window watchdog reset
+#define BOOT_REASON_UPDATER   0x10  // Rebooted using reboot_into_updater()
+
+// flags bits
+#define BOOT_HANDOFF_IMAGE_VALID   0x01  // Image checksum was verified
+#define BOOT_HANDOFF_CLOCK_72MHZ   0x02  // SYSCLK already runs at 72MHz from HSE PLL (2WS flash)
+
+struct boot_handoff {
+	uint32_t magic;
+	uint8_t  version;
+	uint8_t  size;           // sizeof(struct boot_handoff)
+	uint8_t  boot_reason;    // BOOT_REASON_* bits
+	uint8_t  flags;          // BOOT_HANDOFF_* bits
+	uint32_t reset_cause;    // RCC_CSR as found by the bootloader (it clears it)
+	uint32_t image_size;     // Image size in words (offset 0x20), if checked
+	uint32_t image_check;    // Image checksum word (offset 0x1C)
+	uint32_t bl_product;     // Address of the bootloader USB product string (includes its version)
+	uint8_t  slot;           // Booted slot (ENABLE_DUAL_SLOT), always 0 otherwise
+	uint8_t  trial_boots;    // Unconfirmed boots of this slot so far (0 = confirmed)
+	uint16_t reserved0;
+	uint32_t reserved1;
+};
+
+_Static_assert(sizeof(struct boot_handoff) == 32, "Handoff block must be 32 bytes");
+
+// Dual slot (A/B) images, see README. The bootloader counts boots of a new
+// image in this backup register until the app confirms it is healthy.
+#define BOOT_SLOT_TRIAL_REG       (*(volatile uint16_t*)0x40006C0CU)  // BKP_DR3
+#define BOOT_SLOT_TRIAL_PENDING   0x8000
+#define BOOT_SLOT_TRIAL_SLOT_B    0x0100
+#define BOOT_SLOT_TRIAL_COUNT     0x00FF
+
+// Reads the slot trial register (enables the backup domain clocks)
+static inline uint16_t boot_slot_trial_read() {
+	*(volatile uint32_t*)0x4002101CU |= (1 << 28) | (1 << 27);  // RCC_APB1ENR PWR/BKP
+	return BOOT_SLOT_TRIAL_REG;
+}
+
+// Writes the slot trial register (enables backup domain write access)
+static inline void boot_slot_trial_write(uint16_t val) {
+	*(volatile uint32_t*)0x4002101CU |= (1 << 28) | (1 << 27);  // RCC_APB1ENR PWR/BKP
+	*(volatile uint32_t*)0x40007000U |= (1 << 8);               // PWR_CR DBP
+	BOOT_SLOT_TRIAL_REG = val;
+	*(volatile uint32_t*)0x40007000U &= ~(1 << 8);
+}
+
+// Apps call this once they are up and healthy, otherwise the bootloader
+// falls back to the previous image after a few resets.
+static inline void boot_slot_confirm() {
+	if (boot_slot_trial_read() & BOOT_SLOT_TRIAL_PENDING)
+		boot_slot_trial_write(0);
+}
+
+// Returns the handoff block left by the bootloader, or NULL if there's none.
+// Consume it early during app startup, it is not preserved.
+static inline const struct boot_handoff *boot_handoff_get() {
+	const struct boot_handoff *h = (const struct boot_handoff*)BOOT_HANDOFF_ADDR;
+	if (h->magic != BOOT_HANDOFF_MAGIC || h->version != BOOT_HANDOFF_VERSION)
+		return 0;
+	return h;
+}
+
+#endif
+
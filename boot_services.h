@@ -0,0 +1,54 @@
+
+#ifndef __BOOT_SERVICES__HH__
+#define __BOOT_SERVICES__HH__
+
+#include <stdint.h>
+
+// Bootloader service table, built with ENABLE_BOOT_SERVICES.
+// It sits right after the bootloader vector table and lets apps reuse the
+// bootloader flash driver (including the CH32F103 fast programming path)
+// instead of carrying their own. Only the app area (after the bootloader)
+// can be erased or programmed through it.
+//
+// All functions unlock the flash controller and lock it again on return.
+// They can be called with interrupts enabled, but code running from flash
+// will stall while an erase/program is in progress.
+
+#define BOOT_SERVICES_ADDR     0x08000040U
+#define BOOT_SERVICES_MAGIC    0x53564342U  // "BCVS"
+#define BOOT_SERVICES_VERSION  1
+
+// Return codes
+#define BOOT_SVC_OK            0
+#define BOOT_SVC_ERR_ADDRESS  -1  // Out of the app area or misaligned
+#define BOOT_SVC_ERR_FLASH    -2  // Flash controller flagged an error or read back mismatch
+
+struct boot_services {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size;        // sizeof(struct boot_services) in the bootloader
+	uint32_t page_size;   // Flash page (erase unit) size in bytes
+	uint32_t app_start;   // First address that can be erased/programmed
+	uint32_t app_end;     // One past the last address
+
+	// Erases the page at addr (must be page aligned)
+	int (*erase_page)(uint32_t addr);
+	// Programs len bytes (even) at addr, which must be erased first.
+	// On CH32F103 builds addr must also be 128 byte aligned.
+	int (*program)(uint32_t addr, const void *data, unsigned len);
+	// Returns 1 if the page at addr is erased (all 0xFF)
+	int (*page_is_erased)(uint32_t addr);
+	// Hardware CRC-32/MPEG-2 (see crc.h) over nwords words
+	uint32_t (*crc32)(const uint32_t *data, unsigned nwords);
+};
+
+// Returns the bootloader service table or NULL if not available
+static inline const struct boot_services *boot_services_get() {
+	const struct boot_services *s = (const struct boot_services*)BOOT_SERVICES_ADDR;
+	if (s->magic != BOOT_SERVICES_MAGIC || s->version != BOOT_SERVICES_VERSION)
+		return 0;
+	return s;
+}
+
+#endif
+
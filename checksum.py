@@ -2,6 +2,8 @@
 # Patches a firmware binary to hold the right checksum
 # Checksum is a 32bit filed at offset 0x1C, whereas
 # firmware size is stored at 0x20 (little endian, words)
+# An optional sequence number (for A/B slot images) is stored at 0x24
+# Usage: checksum.py firmware.bin [size|0] [sequence]
 
 import sys, struct
 
@@ -13,7 +15,7 @@ while len(fwbin) % 4 != 0:
 	fwbin += b"\x00"
 print("Firmware size after padding", len(fwbin))
 
-if len(sys.argv) > 2:
+if len(sys.argv) > 2 and int(sys.argv[2]):
 	fwlen = int(sys.argv[2])
 	assert fwlen & 3 == 0
 else:
@@ -25,6 +27,11 @@ print("Firmware size for checksum purposes", fwlen)
 sizestr = struct.pack("<I", fwlen // 4)
 fwbin = fwbin[:0x1C] + b"\x00\x00\x00\x00" + sizestr + fwbin[0x24:]
 
+if len(sys.argv) > 3:
+	seqstr = struct.pack("<I", int(sys.argv[3], 0) & 0xFFFFFFFF)
+	fwbin = fwbin[:0x24] + seqstr + fwbin[0x28:]
+	print("Sequence number", int(sys.argv[3], 0))
+
 # Calculate the checksum, whole file with padding
 xorv = 0xB4DC0FEE
 for i in range(0, fwlen, 4):
@@ -0,0 +1,24 @@
+
+#ifndef __CRC__HH__
+#define __CRC__HH__
+
+// Hardware CRC unit (same on CH32F103). It computes the CRC-32/MPEG-2
+// flavour: poly 0x04C11DB7, init 0xFFFFFFFF, no reflection, no final xor,
+// fed one 32 bit word at a time.
+
+#define RCC_AHBENR   (*(volatile uint32_t*)0x40021014U)
+#define RCC_CRCEN    (1 << 6)
+#define CRC_DR       (*(volatile uint32_t*)0x40023000U)
+#define CRC_CR       (*(volatile uint32_t*)0x40023008U)
+#define CRC_CR_RESET (1 << 0)
+
+static inline uint32_t crc32_words(const uint32_t *data, unsigned nwords) {
+	RCC_AHBENR |= RCC_CRCEN;
+	CRC_CR = CRC_CR_RESET;
+	while (nwords--)
+		CRC_DR = *data++;
+	return CRC_DR;
+}
+
+#endif
+
@@ -1,6 +1,17 @@
 
 // Flashing routines //
 
+#ifdef ENABLE_XL_DUAL_BANK
+// XL-density parts (768KB/1MB): 2KB pages and two flash banks, each with its
+// own controller (bank 2 registers sit 0x40 above bank 1 ones).
+#define FLASH_PAGE_SIZE 2048
+#define FLASH_BANK2_ADDR 0x08080000U
+#define flash_bank(addr) ((addr) >= FLASH_BANK2_ADDR)
+#else
+#define FLASH_PAGE_SIZE 1024
+#define flash_bank(addr) 0
+#endif
+
 #define FLASH_CR_OPTWRE (1 << 9)
 #define FLASH_CR_LOCK   (1 << 7)
 #define FLASH_CR_STRT   (1 << 6)
@@ -11,11 +22,28 @@
 #define FLASH_SR_BSY    (1 << 0)
 #define FLASH_SR_PGERR  (1 << 2)
 #define FLASH_SR_WPERR  (1 << 4)
+#define FLASH_SR_EOP    (1 << 5)
+#define FLASH_SR_ERRORS (FLASH_SR_PGERR | FLASH_SR_WPERR)
 #define FLASH_KEYR    (*(volatile uint32_t*)0x40022004U)
 #define FLASH_OPTKEYR (*(volatile uint32_t*)0x40022008U)
 #define FLASH_SR      (*(volatile uint32_t*)0x4002200CU)
 #define FLASH_CR      (*(volatile uint32_t*)0x40022010U)
 #define FLASH_AR      (*(volatile uint32_t*)0x40022014U)
+#define FLASH_OBR     (*(volatile uint32_t*)0x4002201CU)
+#define FLASH_WRPR    (*(volatile uint32_t*)0x40022020U)
+#define FLASH_OBR_RDPRT (1 << 1)
+
+// Option bytes: 8 halfwords (data byte + complement)
+#define FLASH_OPT_BYTES ((volatile uint16_t*)0x1FFFF800U)
+#define WORD_RDP        0
+#define WORD_WRP0       4
+#define OPT_RDP_KEY     0xA5   // RDP byte value that disables read protection
+
+// Per bank registers (bank 0 are the ones above)
+#define FLASH_KEYR_B(b) (*(volatile uint32_t*)(0x40022004U + (b) * 0x40))
+#define FLASH_SR_B(b)   (*(volatile uint32_t*)(0x4002200CU + (b) * 0x40))
+#define FLASH_CR_B(b)   (*(volatile uint32_t*)(0x40022010U + (b) * 0x40))
+#define FLASH_AR_B(b)   (*(volatile uint32_t*)(0x40022014U + (b) * 0x40))
 
 #ifdef ENABLE_CH32F103
 #define FLASH_CR_PAGE_PROGRAM	(1<<16)
@@ -29,6 +57,9 @@
 static void _flash_lock() {
 	// Clear the unlock state.
 	FLASH_CR |= FLASH_CR_LOCK;
+#ifdef ENABLE_XL_DUAL_BANK
+	FLASH_CR_B(1) |= FLASH_CR_LOCK;
+#endif
 }
 
 static void _flash_unlock() {
@@ -42,36 +73,73 @@ static void _flash_unlock() {
 		FLASH_MODEKEYP = 0xcdef89abU;
 #endif
 	}
+#ifdef ENABLE_XL_DUAL_BANK
+	if (FLASH_CR_B(1) & FLASH_CR_LOCK) {
+		FLASH_KEYR_B(1) = 0x45670123U;
+		FLASH_KEYR_B(1) = 0xcdef89abU;
+	}
+#endif
 }
 
-#define _flash_wait_for_last_operation() \
+#define _flash_wait_bank(b)              \
 	/* 1 cycle wait, see STM32 errata */ \
 	do {                                 \
 		__asm__ volatile("nop");         \
-	} while (FLASH_SR & FLASH_SR_BSY);
+	} while (FLASH_SR_B(b) & FLASH_SR_BSY);
+
+#define _flash_wait_for_last_operation() _flash_wait_bank(0)
 
 static void _flash_erase_page(uint32_t page_address) {
-	_flash_wait_for_last_operation();
+	const unsigned b = flash_bank(page_address);
+	_flash_wait_bank(b);
 
-	FLASH_CR |= FLASH_CR_PER;
-	FLASH_AR = page_address;
-	FLASH_CR |= FLASH_CR_STRT;
+	FLASH_CR_B(b) |= FLASH_CR_PER;
+	FLASH_AR_B(b) = page_address;
+	FLASH_CR_B(b) |= FLASH_CR_STRT;
 
-	_flash_wait_for_last_operation();
+	_flash_wait_bank(b);
 
-	FLASH_CR &= ~FLASH_CR_PER;
+	FLASH_CR_B(b) &= ~FLASH_CR_PER;
 }
 
-static int _flash_page_is_erased(uint32_t addr) {
+static int _flash_range_is_erased(uint32_t addr, unsigned len) {
 	volatile uint32_t *_ptr32 = (uint32_t*)addr;
-	for (unsigned i = 0; i < 1024/sizeof(uint32_t); i++)
+	for (unsigned i = 0; i < len/sizeof(uint32_t); i++)
 		if (_ptr32[i] != 0xffffffffU)
 			return 0;
 	return 1;
 }
 
+#define _flash_page_is_erased(addr) _flash_range_is_erased(addr, FLASH_PAGE_SIZE)
+
+// Returns and clears the (sticky) error flags, of both banks on XL parts.
+static uint32_t _flash_errors() {
+	uint32_t err = FLASH_SR_B(0) & FLASH_SR_ERRORS;
+	FLASH_SR_B(0) = FLASH_SR_ERRORS;
+#ifdef ENABLE_XL_DUAL_BANK
+	err |= FLASH_SR_B(1) & FLASH_SR_ERRORS;
+	FLASH_SR_B(1) = FLASH_SR_ERRORS;
+#endif
+	return err;
+}
+
+#if defined(ENABLE_VERIFY) || defined(ENABLE_SELF_BENCH)
+// Checks that flash holds the given data (len rounded down to halfwords).
+static int _flash_verify(uint32_t addr, const void *data, unsigned len) {
+	const volatile uint32_t *fptr = (uint32_t*)addr;
+	const uint32_t *dptr = (const uint32_t*)data;
+	for (unsigned i = 0; i < len/4; i++)
+		if (fptr[i] != dptr[i])
+			return 0;
+	if (len & 2)
+		return ((volatile uint16_t*)fptr)[len/2 - 1] == ((const uint16_t*)dptr)[len/2 - 1];
+	return 1;
+}
+#endif
+
 static void _flash_program_buffer(uint32_t address, uint16_t *data, unsigned len) {
-	_flash_wait_for_last_operation();
+	const unsigned b = flash_bank(address);
+	_flash_wait_bank(b);
 
 #ifdef ENABLE_CH32F103
 	uint32_t * dst_ptr = (uint32_t *) address;
@@ -112,20 +180,122 @@ static void _flash_program_buffer(uint32_t address, uint16_t *data, unsigned len
 	}
 #else
 	// Enable programming
-	FLASH_CR |= FLASH_CR_PG;
+	FLASH_CR_B(b) |= FLASH_CR_PG;
 
 	volatile uint16_t *addr_ptr = (uint16_t*)address;
 	for (unsigned i = 0; i < len/2; i++) {
 		addr_ptr[i] = data[i];
-		_flash_wait_for_last_operation();
+		_flash_wait_bank(b);
 	}
 
 	// Disable programming
-	FLASH_CR &= ~FLASH_CR_PG;
+	FLASH_CR_B(b) &= ~FLASH_CR_PG;
 #endif
 }
 
-#if defined(ENABLE_PROTECTIONS) || defined(ENABLE_WRITEPROT)
+#ifdef ENABLE_XL_DUAL_BANK
+// Both banks work concurrently: start the operation on one bank, then the
+// other one, and wait for both. Addresses must be on different banks.
+// Instruction fetches from bank 1 stall while bank 1 is busy, which would
+// serialize the two operations, so these run from RAM (copied with .data).
+#ifdef HOST_SIM
+#define RAMFUNC __attribute__((noinline))
+#else
+#define RAMFUNC __attribute__((section(".ramfunc"), noinline, long_call))
+#endif
+
+RAMFUNC static void _flash_erase_page_pair(uint32_t addr1, uint32_t addr2) {
+	_flash_wait_bank(0);
+	_flash_wait_bank(1);
+
+	FLASH_CR_B(0) |= FLASH_CR_PER;
+	FLASH_CR_B(1) |= FLASH_CR_PER;
+	FLASH_AR_B(flash_bank(addr1)) = addr1;
+	FLASH_AR_B(flash_bank(addr2)) = addr2;
+	FLASH_CR_B(0) |= FLASH_CR_STRT;
+	FLASH_CR_B(1) |= FLASH_CR_STRT;
+
+	_flash_wait_bank(0);
+	_flash_wait_bank(1);
+
+	FLASH_CR_B(0) &= ~FLASH_CR_PER;
+	FLASH_CR_B(1) &= ~FLASH_CR_PER;
+}
+
+// Programs two buffers (same length) interleaving halfword writes.
+RAMFUNC static void _flash_program_buffer_pair(uint32_t addr1, uint16_t *data1,
+                                               uint32_t addr2, uint16_t *data2, unsigned len) {
+	_flash_wait_bank(0);
+	_flash_wait_bank(1);
+
+	FLASH_CR_B(0) |= FLASH_CR_PG;
+	FLASH_CR_B(1) |= FLASH_CR_PG;
+
+	volatile uint16_t *ptr1 = (uint16_t*)addr1;
+	volatile uint16_t *ptr2 = (uint16_t*)addr2;
+	for (unsigned i = 0; i < len/2; i++) {
+		ptr1[i] = data1[i];
+		ptr2[i] = data2[i];
+		_flash_wait_bank(0);
+		_flash_wait_bank(1);
+	}
+
+	FLASH_CR_B(0) &= ~FLASH_CR_PG;
+	FLASH_CR_B(1) &= ~FLASH_CR_PG;
+}
+
+// Pages are twice the block size, so a page is only erased (if not blank)
+// before its first write in the session: erasing on a later block would wipe
+// the blocks already written to it. Cleared when the session is aborted.
+static uint32_t pages_erased[(FLASH_SIZE_KB / 2 + 31) / 32];
+
+static void _flash_forget_erased_pages() {
+	for (unsigned i = 0; i < sizeof(pages_erased) / sizeof(pages_erased[0]); i++)
+		pages_erased[i] = 0;
+}
+
+// Returns whether the page holding addr has to be erased before writing to
+// it, marking it as erased.
+static int _flash_page_needs_erase(uint32_t addr) {
+	const unsigned p = (addr - FLASH_BASE_ADDR) / FLASH_PAGE_SIZE;
+	if (pages_erased[p / 32] & (1U << (p % 32)))
+		return 0;
+	pages_erased[p / 32] |= 1U << (p % 32);
+	return !_flash_page_is_erased(addr & ~(FLASH_PAGE_SIZE - 1));
+}
+
+// DfuSe erase command: erases the page (if not blank) even if it was written
+// in this session, and marks it so later writes to it don't erase it again.
+static void _flash_erase_page_marked(uint32_t addr) {
+	_flash_page_needs_erase(addr);
+	if (!_flash_page_is_erased(addr))
+		_flash_erase_page(addr);
+}
+
+// Erases the pages the given blocks (one per bank, up to a page long) span
+// unless they were erased already in this session. A zero length skips that
+// bank. Returns whether anything was erased.
+static int _flash_erase_if_needed_pair(uint32_t addr1, unsigned len1,
+                                        uint32_t addr2, unsigned len2) {
+	int erased = 0;
+	// First and last byte, unaligned blocks straddle two pages
+	for (unsigned end = 0; end < 2; end++) {
+		const uint32_t a1 = addr1 + end * (len1 - 1), a2 = addr2 + end * (len2 - 1);
+		int e1 = len1 && _flash_page_needs_erase(a1);
+		int e2 = len2 && _flash_page_needs_erase(a2);
+		if (e1 && e2)
+			_flash_erase_page_pair(a1, a2);
+		else if (e1)
+			_flash_erase_page(a1);
+		else if (e2)
+			_flash_erase_page(a2);
+		erased |= e1 || e2;
+	}
+	return erased;
+}
+#endif
+
+#if defined(ENABLE_PROTECTIONS) || defined(ENABLE_WRITEPROT) || defined(ENABLE_OPTBYTES_ALT)
 static void _flash_erase_option_bytes() {
 	_flash_wait_for_last_operation();
 
@@ -156,24 +326,59 @@ static void _optbytes_unlock() {
 }
 #endif
 
+// Worst case page erase (tERASE) and page program (tPROG per halfword)
+// times, used to report DFU poll timeouts
+#define FLASH_PAGE_ERASE_MS   40
+#define FLASH_PAGE_PROGRAM_MS (FLASH_PAGE_SIZE / 2 * 53 / 1000 + 1)
+
 #ifdef ENABLE_SAFEWRITE
+// The wipe runs in steps of a few page erases, one step per DFU poll cycle
+#ifndef SAFEWRITE_PAGES_PER_POLL
+#define SAFEWRITE_PAGES_PER_POLL 2
+#endif
+
+static uint32_t wipe_offset = 0;
+static int wipe_done = 0;
+
 static void check_do_erase() {
 	// For protection reasons, we do not allow reading the flash using DFU
 	// and also we make sure to wipe the entire flash on an ERASE/WRITE command
 	// just to guarantee that nobody is able to extract the data by flashing a
 	// stub and executing it.
+	// Each call erases up to SAFEWRITE_PAGES_PER_POLL pages (blank pages are
+	// skipped) and sets wipe_done once the whole payload area is blank.
 
-	static int erased = 0;
-	if (erased) return;
+	if (wipe_done) return;
 
 	/* Change usb_strings accordingly */
 	const uint32_t start_addr = FLASH_BASE_ADDR + (FLASH_BOOTLDR_SIZE_KB*1024);
 	const uint32_t end_addr   = FLASH_BASE_ADDR + (        FLASH_SIZE_KB*1024);
-	for (uint32_t addr = start_addr; addr < end_addr; addr += 1024)
-		if (!_flash_page_is_erased(addr))
+	unsigned erased = 0;
+	#ifdef ENABLE_XL_DUAL_BANK
+	// Wipe both banks at once, page by page
+	const uint32_t bank1_end = end_addr < FLASH_BANK2_ADDR ? end_addr : FLASH_BANK2_ADDR;
+	for (; erased < SAFEWRITE_PAGES_PER_POLL; wipe_offset += FLASH_PAGE_SIZE) {
+		uint32_t a1 = start_addr + wipe_offset, a2 = FLASH_BANK2_ADDR + wipe_offset;
+		if (a1 >= bank1_end && a2 >= end_addr) {
+			wipe_done = 1;
+			return;
+		}
+		erased += _flash_erase_if_needed_pair(a1, a1 < bank1_end ? FLASH_PAGE_SIZE : 0,
+		                                      a2, a2 < end_addr  ? FLASH_PAGE_SIZE : 0);
+	}
+	#else
+	for (; erased < SAFEWRITE_PAGES_PER_POLL; wipe_offset += FLASH_PAGE_SIZE) {
+		uint32_t addr = start_addr + wipe_offset;
+		if (addr >= end_addr) {
+			wipe_done = 1;
+			return;
+		}
+		if (!_flash_page_is_erased(addr)) {
 			_flash_erase_page(addr);
-
-	erased = 1;
+			erased++;
+		}
+	}
+	#endif
 }
 #endif
 
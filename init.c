@@ -2,7 +2,7 @@
 // Based on libopencm3 project.
 #include <stdint.h>
 
-extern unsigned _data_loadaddr, _data, _edata, _ebss, _stack;
+extern unsigned _data_loadaddr, _data, _edata, _ebss, _boot_handoff, _trace_ring;
 
 typedef void (*vector_table_entry_t)(void);
 
@@ -31,10 +31,20 @@ void null_handler(void) {
 typedef void (*funcp_t) (void);
 
 void main(void);
+void boot_app_if_valid(void);
 
 void __attribute__ ((naked)) reset_handler(void) {
 	volatile unsigned *src, *dest;
 
+	/* Ensure 8-byte alignment of stack pointer on interrupts */
+	/* Enabled by default on most Cortex-M parts, but not M3 r1 */
+	volatile uint32_t *_scb_ccr = (uint32_t*)0xE000ED14U;
+	*_scb_ccr |= (1 << 9);
+
+	/* Jumps to the app (if valid) before any RAM is initialized,
+	 * returns only if we need to enter DFU mode. */
+	boot_app_if_valid();
+
 	for (src = &_data_loadaddr, dest = &_data;
 		dest < &_edata;
 		src++, dest++) {
@@ -44,11 +54,6 @@ void __attribute__ ((naked)) reset_handler(void) {
 	while (dest < &_ebss)
 		*dest++ = 0;
 
-	/* Ensure 8-byte alignment of stack pointer on interrupts */
-	/* Enabled by default on most Cortex-M parts, but not M3 r1 */
-	volatile uint32_t *_scb_ccr = (uint32_t*)0xE000ED14U;
-	*_scb_ccr |= (1 << 9);
-
 	/* Call the application's entry point. */
 	main();
 }
@@ -56,7 +61,11 @@ void __attribute__ ((naked)) reset_handler(void) {
 // Vector table (bare minimal one)
 __attribute__ ((section(".vectors")))
 vector_table_t vector_table = {
-	.initial_sp_value = &_stack,
+	#ifdef ENABLE_TRACE
+	.initial_sp_value = &_trace_ring,
+	#else
+	.initial_sp_value = &_boot_handoff,
+	#endif
 	.reset = reset_handler,
 	.nmi = null_handler,
 	.hard_fault = null_handler,
@@ -23,6 +23,11 @@
 #include "reboot.h"
 #include "flash.h"
 #include "watchdog.h"
+#include "boot_handoff.h"
+#include "boot_services.h"
+#include "crc.h"
+#include "vendor.h"
+#include "perf.h"
 
 /* Commands sent with wBlockNum == 0 as per ST implementation. */
 #define CMD_SETADDR	0x21
@@ -30,12 +35,33 @@
 
 // Payload/app comes immediately after Bootloader
 #define APP_ADDRESS (FLASH_BASE_ADDR + (FLASH_BOOTLDR_SIZE_KB)*1024)
+#define FLASH_END_ADDR (FLASH_BASE_ADDR + (FLASH_SIZE_KB)*1024)
+
+#ifdef ENABLE_DUAL_SLOT
+#include "slots.h"
+#endif
+
+#ifdef HOST_SIM
+// Host simulator (see sim/), takes the place of jumping to an image
+void sim_start_image(uint32_t addr);
+#endif
+
+#ifdef ENABLE_SRAM_EXEC
+// RAM window for DFU downloads, above the bootloader data (see the linker
+// script) and below its stack.
+#define SRAM_EXEC_ADDR    0x20002000
+#define SRAM_EXEC_SIZE_KB 10
+#define SRAM_EXEC_END     (SRAM_EXEC_ADDR + SRAM_EXEC_SIZE_KB*1024)
+// Set by a zero length download on the SRAM alt setting (DfuSe "leave")
+static int sram_leave;
+#endif
 
 // USB control data buffer
 uint8_t usbd_control_buffer[DFU_TRANSFER_SIZE];
 
 // DFU state
 static enum dfu_state usbdfu_state = STATE_DFU_IDLE;
+static uint8_t usbdfu_status = DFU_STATUS_OK;
 static struct {
 	uint8_t buf[sizeof(usbd_control_buffer)];
 	uint16_t len;
@@ -43,21 +69,132 @@ static struct {
 	uint16_t blocknum;
 } prog;
 
+#ifdef ENABLE_PERF_COUNTERS
+struct vendor_perf perf;
+// End of the flash work for the last block, 0 once the host polled again
+static uint32_t perf_work_end;
+#endif
+
+static void usbdfu_error(uint8_t status) {
+	usbdfu_status = status;
+	usbdfu_state = STATE_DFU_ERROR;
+}
+
+// Maps (and clears) flash error flags to a DFU status, on_error is used for
+// programming/erase failures other than write protection.
+static uint8_t flash_status(uint8_t on_error) {
+	uint32_t err = _flash_errors();
+	if (err & FLASH_SR_WPERR)
+		return DFU_STATUS_ERR_WRITE;
+	return err ? on_error : DFU_STATUS_OK;
+}
+
+// Status of a block program: flash errors first, then a read back compare
+// (ENABLE_VERIFY).
+static uint8_t flash_program_status(uint32_t addr, const void *data, unsigned len) {
+	uint8_t status = flash_status(DFU_STATUS_ERR_PROG);
+	#ifdef ENABLE_VERIFY
+	if (status == DFU_STATUS_OK && !_flash_verify(addr, data, len))
+		status = DFU_STATUS_ERR_VERIFY;
+	#else
+	(void)addr; (void)data; (void)len;
+	#endif
+	return status;
+}
+
+#ifdef ENABLE_XL_DUAL_BANK
+// Write-behind block: a downloaded block is held here until a block for the
+// other bank arrives, then both are programmed concurrently. Hosts that
+// alternate blocks between banks get (nearly) twice the programming speed.
+static struct {
+	uint8_t buf[DFU_TRANSFER_SIZE];
+	uint16_t len;
+	uint32_t addr;
+} pending;
+// Errors for the held block are reported on a later request, this flags
+// them through the GETSTATUS iString (DFU_HELD_ISTRING)
+static uint8_t held_block_failed;
+
+// Programs the pending block, if any. Flash must be unlocked.
+static uint8_t flush_pending_block() {
+	uint8_t status = DFU_STATUS_OK;
+	if (pending.len) {
+		PERF(PERF_ERASE, _flash_erase_if_needed_pair(pending.addr, pending.len, 0, 0));
+		PERF(PERF_PROGRAM, _flash_program_buffer(pending.addr, (uint16_t*)pending.buf, pending.len));
+		status = flash_program_status(pending.addr, pending.buf, pending.len);
+		held_block_failed = status != DFU_STATUS_OK;
+		pending.len = 0;
+	}
+	return status;
+}
+
+// Note that errors for a block held back are reported on a later request.
+static uint8_t program_block(uint32_t addr, const uint8_t *buf, unsigned len) {
+	if (pending.len == len && flash_bank(pending.addr) != flash_bank(addr)) {
+		PERF(PERF_ERASE, _flash_erase_if_needed_pair(pending.addr, len, addr, len));
+		PERF(PERF_PROGRAM, _flash_program_buffer_pair(pending.addr, (uint16_t*)pending.buf,
+		                                              addr, (uint16_t*)buf, len));
+		pending.len = 0;
+		uint8_t status = flash_program_status(pending.addr, pending.buf, len);
+		held_block_failed = status != DFU_STATUS_OK;
+		return status != DFU_STATUS_OK ? status : flash_program_status(addr, buf, len);
+	}
+
+	uint8_t status = flush_pending_block();
+	memcpy(pending.buf, buf, len);
+	pending.addr = addr;
+	pending.len = len;
+	return status;
+}
+
+static uint8_t flush_pending_block_locked() {
+	_flash_unlock();
+	uint8_t status = flush_pending_block();
+	_flash_lock();
+	return status;
+}
+#endif
+
 // Serial number to expose via USB
 static char serial_no[25];
 
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
-const char * const _usb_strings[5] = {
+
+#ifdef ENABLE_DUAL_SLOT
+// Slot being executed (the other one is the download target), -1 if none
+static int active_slot;
+// Last slot written during this DFU session, -1 if none
+static int written_slot = -1;
+
+// Both slots are listed, the active one is marked read-only at runtime so
+// DfuSe tools refuse to write to it.
+#define SLOT_SEGMENT "," STR(FLASH_SLOT_SIZE_KB) "*001Kg"
+static char flash_layout[] =
+	"@Internal Flash /" STR(FLASH_BASE_ADDR) "/"
+	  STR(FLASH_BOOTLDR_SIZE_KB) "*001Ka" SLOT_SEGMENT SLOT_SEGMENT;
+#define SLOT_LAYOUT_FLAG(n) \
+	(sizeof(flash_layout) - 2 - (1 - (n)) * (sizeof(SLOT_SEGMENT) - 1))
+#endif
+
+const char * const _usb_strings[USB_NUM_STRINGS] = {
 	"davidgf.net (libopencm3 based)", // iManufacturer
 	"DFU bootloader [" VERSION "]", // iProduct
 	serial_no, // iSerialNumber
 	// Interface desc string
 	/* This string is used by ST Microelectronics' DfuSe utility. */
 	/* Change check_do_erase() accordingly */
+	#ifdef ENABLE_DUAL_SLOT
+	flash_layout,
+	#elif defined(ENABLE_XL_DUAL_BANK)
+	"@Internal Flash /" STR(FLASH_BASE_ADDR) "/"
+	  STR(FLASH_BOOTLDR_PAGES) "*002Ka,"
+	  STR(FLASH_BOOTLDR_PAYLOAD_PAGES) "*002Kg",
+	#else
 	"@Internal Flash /" STR(FLASH_BASE_ADDR) "/"
 	  STR(FLASH_BOOTLDR_SIZE_KB) "*001Ka,"
 	  STR(FLASH_BOOTLDR_PAYLOAD_SIZE_KB) "*001Kg",
+	#endif
 	// Config desc string
 	"Bootloader config: "
 	#ifdef ENABLE_WATCHDOG
@@ -75,6 +212,30 @@ const char * const _usb_strings[5] = {
 	#ifdef ENABLE_CHECKSUM
 	"FW-CRC "
 	#endif
+	#ifdef ENABLE_DUAL_SLOT
+	"A/B "
+	#endif
+	#ifdef ENABLE_XL_DUAL_BANK
+	"XL "
+	#endif
+	#ifdef ENABLE_OPTBYTES_ALT
+	"OptB "
+	#endif
+	#ifdef ENABLE_SRAM_EXEC
+	"SRAM "
+	#endif
+	,
+	// Extra alt settings interface strings
+	#ifdef ENABLE_OPTBYTES_ALT
+	"@Option Bytes /0x1FFFF800/01*016 e",
+	#endif
+	#ifdef ENABLE_SRAM_EXEC
+	"@SRAM /" STR(SRAM_EXEC_ADDR) "/" STR(SRAM_EXEC_SIZE_KB) "*001Ke",
+	#endif
+	#ifdef ENABLE_XL_DUAL_BANK
+	// DFU_HELD_ISTRING
+	"Error in the previous (held back) block",
+	#endif
 };
 
 static const char hcharset[16] = "0123456789abcdef";
@@ -87,10 +248,43 @@ static void get_dev_unique_id(char *s) {
 	}
 }
 
+#ifdef ENABLE_SAFEWRITE
+// Erase and write commands are held until the payload wipe completes
+// (option bytes are not covered, SRAM downloads are since they run code)
+#ifdef ENABLE_OPTBYTES_ALT
+#define prog_skips_wipe() (usb_altsetting == DFU_ALT_OPTBYTES)
+#else
+#define prog_skips_wipe() 0
+#endif
+#define prog_needs_wipe() \
+	(!wipe_done && !prog_skips_wipe() && \
+	 (prog.blocknum != 0 || prog.buf[0] == CMD_ERASE))
+#endif
+
+#ifdef ENABLE_SELF_BENCH
+// Flash step of the self benchmark left for the next DFU poll
+enum { BENCH_IDLE, BENCH_PROGRAM, BENCH_ERASE };
+static uint8_t bench_step;
+static void self_bench_step();
+#endif
+
 static uint8_t usbdfu_getstatus(uint32_t *bwPollTimeout) {
 	switch (usbdfu_state) {
 	case STATE_DFU_DNLOAD_SYNC:
 		usbdfu_state = STATE_DFU_DNBUSY;
+#ifdef ENABLE_SELF_BENCH
+		if (bench_step) {
+			*bwPollTimeout = bench_step == BENCH_PROGRAM ? FLASH_PAGE_PROGRAM_MS : FLASH_PAGE_ERASE_MS;
+			return DFU_STATUS_OK;
+		}
+#endif
+#ifdef ENABLE_SAFEWRITE
+		if (prog_needs_wipe()) {
+			// Time for the next wipe step
+			*bwPollTimeout = SAFEWRITE_PAGES_PER_POLL * FLASH_PAGE_ERASE_MS;
+			return DFU_STATUS_OK;
+		}
+#endif
 #ifdef ENABLE_SHORT_POLL
 		*bwPollTimeout = 10;
 #else
@@ -101,10 +295,8 @@ static uint8_t usbdfu_getstatus(uint32_t *bwPollTimeout) {
 		// Device will reset when read is complete.
 		usbdfu_state = STATE_DFU_MANIFEST;
 		return DFU_STATUS_OK;
-	case STATE_DFU_ERROR:
-		return STATE_DFU_ERROR;
 	default:
-		return DFU_STATUS_OK;
+		return usbdfu_status;
 	}
 }
 
@@ -124,60 +316,188 @@ static void _full_system_reset() {
 	RCC_APB2ENR |= (1 << (gpion + 2));
 
 
+#ifdef ENABLE_OPTBYTES_ALT
+// Rewrites the 16 option bytes (the complement bytes are generated by the
+// hardware). New values are loaded on the next reset.
+static uint8_t optbytes_write(uint32_t addr, const uint16_t *opt, unsigned len) {
+	if (addr != (uint32_t)FLASH_OPT_BYTES || len != 16)
+		return DFU_STATUS_ERR_ADDRESS;
+	#ifdef ENABLE_PROTECTIONS
+	// Protections are enforced on every boot anyway
+	return DFU_STATUS_ERR_WRITE;
+	#endif
+	// Dropping RDP triggers a mass erase, that is left to a debugger
+	if ((FLASH_OBR & FLASH_OBR_RDPRT) && (opt[WORD_RDP] & 0xFF) == OPT_RDP_KEY)
+		return DFU_STATUS_ERR_WRITE;
+
+	_optbytes_unlock();
+	_flash_erase_option_bytes();
+	for (unsigned i = 0; i < 8; i++)
+		_flash_program_option_bytes((uint32_t)(&FLASH_OPT_BYTES[i]), opt[i]);
+
+	uint8_t status = flash_status(DFU_STATUS_ERR_PROG);
+	for (unsigned i = 0; i < 8; i++)
+		if ((FLASH_OPT_BYTES[i] ^ opt[i]) & 0xFF)
+			status = DFU_STATUS_ERR_VERIFY;
+	return status;
+}
+#endif
+
+#ifdef ENABLE_SRAM_EXEC
+static void sram_exec(uint32_t addr);
+#endif
+
 static void usbdfu_getstatus_complete(struct usb_setup_data *req) {
 	(void)req;
 
 	// Protect the flash by only writing to the valid flash area
+	#ifdef ENABLE_DUAL_SLOT
+	// Only the inactive slot can be written (or both if none is valid)
+	const uint32_t start_addr = active_slot < 0 ? SLOT_ADDR(0) : SLOT_ADDR(active_slot == 0);
+	const uint32_t end_addr   = active_slot < 0 ? SLOT_ADDR(2) : start_addr + SLOT_SIZE;
+	#else
 	const uint32_t start_addr = FLASH_BASE_ADDR + (FLASH_BOOTLDR_SIZE_KB*1024);
 	const uint32_t end_addr   = FLASH_BASE_ADDR + (        FLASH_SIZE_KB*1024);
+	#endif
 
 	switch (usbdfu_state) {
-	case STATE_DFU_DNBUSY:
+	case STATE_DFU_DNBUSY: {
+		#ifdef ENABLE_SELF_BENCH
+		if (bench_step) {
+			self_bench_step();
+			return;
+		}
+		#endif
+		uint8_t status = DFU_STATUS_OK;
+		trace(TRACE_FLASH_BEGIN, prog.blocknum);
 		_flash_unlock();
+		_flash_errors();
+		#ifdef ENABLE_SAFEWRITE
+		if (prog_needs_wipe()) {
+			// Wipe a few more pages and keep the block for the next poll,
+			// the host sees dfuDNBUSY until the wipe is over.
+			PERF(PERF_ERASE, check_do_erase());
+			status = flash_status(DFU_STATUS_ERR_ERASE);
+			_flash_lock();
+			trace(TRACE_FLASH_END, status);
+			if (status != DFU_STATUS_OK)
+				usbdfu_error(status);
+			else
+				usbdfu_state = STATE_DFU_DNLOAD_SYNC;
+			return;
+		}
+		#endif
 		if (prog.blocknum == 0) {
 			switch (prog.buf[0]) {
 			case CMD_ERASE: {
-				#ifdef ENABLE_SAFEWRITE
-				check_do_erase();
+				// A lone command byte is a mass erase, not supported
+				if (prog.len != 5) {
+					status = DFU_STATUS_ERR_TARGET;
+					break;
+				}
+				#ifdef ENABLE_XL_DUAL_BANK
+				status = flush_pending_block();
+				if (status != DFU_STATUS_OK)
+					break;
 				#endif
 
-				// Clear this page here.
-				uint32_t baseaddr = *(uint32_t *)(prog.buf + 1);
-				if (baseaddr >= start_addr && baseaddr + DFU_TRANSFER_SIZE <= end_addr) {
-					if (!_flash_page_is_erased(baseaddr))
-						_flash_erase_page(baseaddr);
-				}
+				// Clear the page holding this address here.
+				uint32_t baseaddr = *(uint32_t *)(prog.buf + 1) & ~(FLASH_PAGE_SIZE - 1);
+				if (baseaddr >= start_addr && baseaddr + FLASH_PAGE_SIZE <= end_addr) {
+					#ifdef ENABLE_XL_DUAL_BANK
+					PERF(PERF_ERASE, _flash_erase_page_marked(baseaddr));
+					#else
+					int blank;
+					PERF(PERF_BLANK_CHECK, blank = _flash_page_is_erased(baseaddr));
+					if (!blank)
+						PERF(PERF_ERASE, _flash_erase_page(baseaddr));
+					#endif
+					status = flash_status(DFU_STATUS_ERR_ERASE);
+				} else
+					status = DFU_STATUS_ERR_ADDRESS;
 				} break;
 			case CMD_SETADDR:
+				if (prog.len != 5) {
+					status = DFU_STATUS_ERR_TARGET;
+					break;
+				}
 				// Assuming little endian here.
 				prog.addr = *(uint32_t *)(prog.buf + 1);
 				break;
 			}
 		} else {
-			#ifdef ENABLE_SAFEWRITE
-			check_do_erase();
-			#endif
-
 			// From formula Address_Pointer + ((wBlockNum - 2)*wTransferSize)
 			uint32_t baseaddr = prog.addr + ((prog.blocknum - 2) * DFU_TRANSFER_SIZE);
 
+			#ifdef ENABLE_OPTBYTES_ALT
+			if (usb_altsetting == DFU_ALT_OPTBYTES)
+				status = optbytes_write(baseaddr, (uint16_t*)prog.buf, prog.len);
+			else
+			#endif
+			#ifdef ENABLE_SRAM_EXEC
+			if (usb_altsetting == DFU_ALT_SRAM) {
+				if (baseaddr >= SRAM_EXEC_ADDR && baseaddr + prog.len <= SRAM_EXEC_END)
+					memcpy((void*)baseaddr, prog.buf, prog.len);
+				else
+					status = DFU_STATUS_ERR_ADDRESS;
+			} else
+			#endif
 			if (baseaddr >= start_addr && baseaddr + prog.len <= end_addr) {
+				#ifdef ENABLE_XL_DUAL_BANK
+				status = program_block(baseaddr, prog.buf, prog.len);
+				#else
 				// Program buffer in one go after erasing.
-				if (!_flash_page_is_erased(baseaddr))
-					_flash_erase_page(baseaddr);
-				_flash_program_buffer(baseaddr, (uint16_t*)prog.buf, prog.len);
-			}
+				int blank;
+				PERF(PERF_BLANK_CHECK, blank = _flash_page_is_erased(baseaddr));
+				if (!blank)
+					PERF(PERF_ERASE, _flash_erase_page(baseaddr));
+				PERF(PERF_PROGRAM, _flash_program_buffer(baseaddr, (uint16_t*)prog.buf, prog.len));
+				status = flash_program_status(baseaddr, prog.buf, prog.len);
+				#endif
+				#ifdef ENABLE_DUAL_SLOT
+				written_slot = slot_of(baseaddr);
+				#endif
+			} else
+				status = DFU_STATUS_ERR_ADDRESS;
 		}
 		_flash_lock();
 
-		/* Jump straight to dfuDNLOAD-IDLE, skipping dfuDNLOAD-SYNC. */
-		usbdfu_state = STATE_DFU_DNLOAD_IDLE;
+		if (status != DFU_STATUS_OK)
+			usbdfu_error(status);
+		else
+			/* Jump straight to dfuDNLOAD-IDLE, skipping dfuDNLOAD-SYNC. */
+			usbdfu_state = STATE_DFU_DNLOAD_IDLE;
+		trace(TRACE_FLASH_END, status);
+		#ifdef ENABLE_PERF_COUNTERS
+		perf_work_end = perf_now();
+		#endif
 		return;
-	case STATE_DFU_MANIFEST:
+		}
+	case STATE_DFU_MANIFEST: {
+		#ifdef ENABLE_SRAM_EXEC
+		if (sram_leave) {
+			sram_exec(prog.addr);
+			usbdfu_error(DFU_STATUS_ERR_FIRMWARE);
+			return;
+		}
+		#endif
+		#ifdef ENABLE_XL_DUAL_BANK
+		uint8_t status = flush_pending_block_locked();
+		if (status != DFU_STATUS_OK) {
+			usbdfu_error(status);
+			return;
+		}
+		#endif
+		#ifdef ENABLE_DUAL_SLOT
+		// Give the new image a few boots to confirm itself
+		if (written_slot >= 0)
+			slot_start_trial(written_slot);
+		#endif
 		// Perform reset
 		clear_reboot_flags();
 		_full_system_reset();
 		return;
+		}
 	default:
 		return;
 	}
@@ -190,6 +510,10 @@ usbdfu_control_request(struct usb_setup_data *req,
 	case DFU_DNLOAD:
 		if ((len == NULL) || (*len == 0)) {
 			// wLength = 0 means leave DFU
+			#ifdef ENABLE_SRAM_EXEC
+			// Leave to the SETADDR address on the SRAM alt setting
+			sram_leave = usb_altsetting == DFU_ALT_SRAM;
+			#endif
 			usbdfu_state = STATE_DFU_MANIFEST_SYNC;
 			*complete = usbdfu_getstatus_complete;
 			return USBD_REQ_HANDLED;
@@ -206,18 +530,54 @@ usbdfu_control_request(struct usb_setup_data *req,
 		}
 	case DFU_CLRSTATUS:
 		// Just clears errors.
-		if (usbdfu_state == STATE_DFU_ERROR)
+		if (usbdfu_state == STATE_DFU_ERROR) {
 			usbdfu_state = STATE_DFU_IDLE;
+			usbdfu_status = DFU_STATUS_OK;
+			#ifdef ENABLE_XL_DUAL_BANK
+			_flash_forget_erased_pages();
+			held_block_failed = 0;
+			#endif
+		}
 		return USBD_REQ_HANDLED;
-	case DFU_ABORT:
+	case DFU_ABORT: {
+		#ifdef ENABLE_SELF_BENCH
+		// The scratch page still has to be erased, the next polls do it
+		if (bench_step)
+			return USBD_REQ_HANDLED;
+		#endif
+		#ifdef ENABLE_XL_DUAL_BANK
+		// Ends the session, the next write to a page erases it again
+		held_block_failed = 0;
+		uint8_t status = flush_pending_block_locked();
+		_flash_forget_erased_pages();
+		if (status != DFU_STATUS_OK) {
+			usbdfu_error(status);
+			return USBD_REQ_HANDLED;
+		}
+		#endif
 		// Abort just returns to IDLE state.
 		usbdfu_state = STATE_DFU_IDLE;
 		return USBD_REQ_HANDLED;
+		}
 	case DFU_DETACH:
+		#ifdef ENABLE_SRAM_EXEC
+		sram_leave = 0;
+		#endif
 		usbdfu_state = STATE_DFU_MANIFEST_SYNC;
 		*complete = usbdfu_getstatus_complete;
 		return USBD_REQ_HANDLED;
 	case DFU_UPLOAD:
+		#ifdef ENABLE_XL_DUAL_BANK
+		// Make sure reads see all the downloaded data
+		{
+			uint8_t status = flush_pending_block_locked();
+			if (status != DFU_STATUS_OK) {
+				usbdfu_error(status);
+				*len = 0;
+				return USBD_REQ_HANDLED;
+			}
+		}
+		#endif
 		// Send data back to host by reading the image.
 		usbdfu_state = STATE_DFU_UPLOAD_IDLE;
 		if (!req->wValue) {
@@ -228,26 +588,51 @@ usbdfu_control_request(struct usb_setup_data *req,
 			*len = 3;
 			return USBD_REQ_HANDLED;
 		} else {
+			// From formula Address_Pointer + ((wBlockNum - 2)*wTransferSize)
+			uint32_t baseaddr = prog.addr + ((req->wValue - 2) * DFU_TRANSFER_SIZE);
+			#ifdef ENABLE_OPTBYTES_ALT
+			// Option bytes can always be read
+			if (usb_altsetting == DFU_ALT_OPTBYTES) {
+				if (baseaddr == (uint32_t)FLASH_OPT_BYTES) {
+					memcpy(usbd_control_buffer, (void*)FLASH_OPT_BYTES, 16);
+					*len = 16;
+				} else {
+					usbdfu_error(DFU_STATUS_ERR_ADDRESS);
+					*len = 0;
+				}
+				return USBD_REQ_HANDLED;
+			}
+			#endif
 			// Send back data if only if we enabled that.
 			#ifndef ENABLE_DFU_UPLOAD
-			usbdfu_state = STATE_DFU_ERROR;
+			(void)baseaddr;
+			usbdfu_error(DFU_STATUS_ERR_STALLEDPKT);
 			*len = 0;
 			#else
-			// From formula Address_Pointer + ((wBlockNum - 2)*wTransferSize)
-			uint32_t baseaddr = prog.addr + ((req->wValue - 2) * DFU_TRANSFER_SIZE);
+			#ifdef ENABLE_SRAM_EXEC
+			const int sram = usb_altsetting == DFU_ALT_SRAM;
+			const uint32_t start_addr = sram ? SRAM_EXEC_ADDR : FLASH_BASE_ADDR + (FLASH_BOOTLDR_SIZE_KB*1024);
+			const uint32_t end_addr   = sram ? SRAM_EXEC_END  : FLASH_BASE_ADDR + (        FLASH_SIZE_KB*1024);
+			#else
 			const uint32_t start_addr = FLASH_BASE_ADDR + (FLASH_BOOTLDR_SIZE_KB*1024);
 			const uint32_t end_addr   = FLASH_BASE_ADDR + (        FLASH_SIZE_KB*1024);
+			#endif
 			if (baseaddr >= start_addr && baseaddr + DFU_TRANSFER_SIZE <= end_addr) {
 				memcpy(usbd_control_buffer, (void*)baseaddr, DFU_TRANSFER_SIZE);
 				*len = DFU_TRANSFER_SIZE;
 			} else {
-				usbdfu_state = STATE_DFU_ERROR;
+				usbdfu_error(DFU_STATUS_ERR_ADDRESS);
 				*len = 0;
 			}
 			#endif
 		}
 		return USBD_REQ_HANDLED;
 	case DFU_GETSTATUS: {
+		#ifdef ENABLE_PERF_COUNTERS
+		if (perf_work_end)
+			perf_add(PERF_POLL_GAP, perf_work_end);
+		perf_work_end = 0;
+		#endif
 		// Perform the action and register complete callback.
 		uint32_t bwPollTimeout = 0; /* 24-bit integer in DFU class spec */
 		usbd_control_buffer[0] = usbdfu_getstatus(&bwPollTimeout);
@@ -255,7 +640,12 @@ usbdfu_control_request(struct usb_setup_data *req,
 		usbd_control_buffer[2] = (bwPollTimeout >> 8) & 0xFF;
 		usbd_control_buffer[3] = (bwPollTimeout >> 16) & 0xFF;
 		usbd_control_buffer[4] = usbdfu_state;
+		#ifdef ENABLE_XL_DUAL_BANK
+		// Tells the host that the error belongs to the block held back
+		usbd_control_buffer[5] = usbdfu_state == STATE_DFU_ERROR && held_block_failed ? DFU_HELD_ISTRING : 0;
+		#else
 		usbd_control_buffer[5] = 0; /* iString not used here */
+		#endif
 		*len = 6;
 		*complete = usbdfu_getstatus_complete;
 		return USBD_REQ_HANDLED;
@@ -302,44 +692,23 @@ inline static void gpio_set_mode(uint32_t gpiodev, uint16_t gpion, uint8_t mode)
 #define gpio_read(gpiodev, gpion) \
 	(GPIO_IDR(gpiodev) & (1 << (gpion)))
 
-#ifdef ENABLE_GPIO_DFU_BOOT
-int force_dfu_gpio() {
-	rcc_gpio_enable(GPIO_DFU_BOOT_PORT);
-#ifdef GPIO_DFU_BOOT_PIN_NOPD
-	gpio_set_input(GPIO_DFU_BOOT_PORT, GPIO_DFU_BOOT_PIN);
-#else
-	gpio_set_input_pp(GPIO_DFU_BOOT_PORT, GPIO_DFU_BOOT_PIN);
-	gpio_clear(GPIO_DFU_BOOT_PORT, GPIO_DFU_BOOT_PIN);
-#endif
-	for (unsigned int i = 0; i < 512; i++)
-		__asm__("nop");
-	uint16_t val = gpio_read(GPIO_DFU_BOOT_PORT, GPIO_DFU_BOOT_PIN);
-	gpio_set_input(GPIO_DFU_BOOT_PORT, GPIO_DFU_BOOT_PIN);
-	return val != 0;
-}
-#else
-#define force_dfu_gpio()  (0)
-#endif
-
 #define FLASH_ACR_LATENCY         7
 #define FLASH_ACR_LATENCY_2WS  0x02
 #define FLASH_ACR          (*(volatile uint32_t*)0x40022000U)
-#define FLASH_OBR          (*(volatile uint32_t*)0x4002201CU)
-#define FLASH_WRPR         (*(volatile uint32_t*)0x40022020U)
-#define FLASH_OPT_BYTES    ((volatile uint16_t*)0x1FFFF800U)
-#define WORD_RDP           0
-#define WORD_WRP0          4
 
 #define RCC_CFGR_HPRE_SYSCLK_NODIV      0x0
 #define RCC_CFGR_PPRE1_HCLK_DIV2        0x4
 #define RCC_CFGR_PPRE2_HCLK_NODIV       0x0
 #define RCC_CFGR_ADCPRE_PCLK2_DIV8      0x3
 #define RCC_CFGR_PLLMUL_PLL_CLK_MUL9    0x7
+#define RCC_CFGR_PLLMUL_PLL_CLK_MUL12   0xA
+#define RCC_CFGR_USBPRE_PLL_CLK_NODIV   (1 << 22)
 #define RCC_CFGR_PLLSRC_HSE_CLK         0x1
 #define RCC_CFGR_PLLXTPRE_HSE_CLK       0x0
 #define RCC_CFGR_SW_SYSCLKSEL_PLLCLK    0x2
 #define RCC_CFGR_SW_SHIFT                 0
 #define RCC_CFGR_SW (3 << RCC_CFGR_SW_SHIFT)
+#define RCC_CFGR_SWS (3 << 2)
 
 #define RCC_CR_HSEON    (1 << 16)
 #define RCC_CR_HSERDY   (1 << 17)
@@ -359,6 +728,7 @@ int force_dfu_gpio() {
 
 #define STK_CSR        (*(volatile uint32_t *) 0xe000e010)
 #define STK_RVR        (*(volatile uint32_t *) 0xe000e014)
+#define STK_CVR        (*(volatile uint32_t *) 0xe000e018)
 #define STK_CSR_COUNTFLAG	(1<<16)
 #define STK_CSR_ENABLE		(1<<0)
 #define STK_CSR_CLKSOURCE	(1<<2)
@@ -373,22 +743,119 @@ static inline int reset_due_to_pin() {
 }
 #endif
 
-static void clock_setup_in_hse_8mhz_out_72mhz() {
+// Startup delays, in microseconds. They are timed with SysTick so they do
+// not depend on the compiler output or the current core clock.
+#define HSI_MHZ    8
+
+// Pin settle time once the pull resistor is on, many RC constants for a
+// few tens of pF and the internal ~40K pull-down.
+#ifndef GPIO_DFU_BOOT_SETTLE_US
+#define GPIO_DFU_BOOT_SETTLE_US   50
+#endif
+// Same after a software reset: a few RC constants of the pin alone.
+#ifndef GPIO_DFU_BOOT_SOFT_SETTLE_US
+#define GPIO_DFU_BOOT_SOFT_SETTLE_US 5
+#endif
+// A hub flags a disconnect after TDDIS (2.5us) of SE0 (USB 2.0, 7.1.7.3),
+// but hosts and hubs commonly miss one that short, hold it for 2ms.
+#ifndef USB_DISCONNECT_US
+#define USB_DISCONNECT_US         2000
+#endif
+_Static_assert(USB_DISCONNECT_US * 72 <= 0xFFFFFF, "USB disconnect time exceeds SysTick range");
+#ifdef ENABLE_HSI_USB_FALLBACK
+// HSE usually starts in ~2ms, fall back to HSI if it takes longer than this.
+#ifndef HSE_STARTUP_TIMEOUT_US
+#define HSE_STARTUP_TIMEOUT_US    100000
+#endif
+
+_Static_assert(HSE_STARTUP_TIMEOUT_US * HSI_MHZ <= 0xFFFFFF, "HSE timeout exceeds SysTick range");
+#endif
+
+// (Re)starts SysTick counting down the given number of core cycles, the
+// COUNTFLAG is set every time the period elapses.
+static void systick_start(uint32_t cycles) {
+	STK_CSR = 0;
+	STK_RVR = cycles - 1;
+	STK_CVR = 0;
+	STK_CSR = STK_CSR_CLKSOURCE | STK_CSR_ENABLE;
+}
+
+#define systick_expired() (STK_CSR & STK_CSR_COUNTFLAG)
+
+static void delay_us(uint32_t us, uint32_t mhz) {
+	systick_start(us * mhz);
+	while (!systick_expired());
+}
+
+#ifdef ENABLE_BOOT_TIMING
+// The timing pin is driven high right after reset and goes low when the
+// app is started or when the host configures the DFU device. A scope on
+// NRST and this pin gives reset-to-app and reset-to-enumeration times.
+static void boot_timing_start() {
+	rcc_gpio_enable(GPIO_BOOT_TIMING_PORT);
+	gpio_set(GPIO_BOOT_TIMING_PORT, GPIO_BOOT_TIMING_PIN);
+	gpio_set_output(GPIO_BOOT_TIMING_PORT, GPIO_BOOT_TIMING_PIN);
+}
+
+void boot_timing_mark() {
+	gpio_clear(GPIO_BOOT_TIMING_PORT, GPIO_BOOT_TIMING_PIN);
+}
+#endif
+
+#ifdef ENABLE_GPIO_DFU_BOOT
+int force_dfu_gpio() {
+	rcc_gpio_enable(GPIO_DFU_BOOT_PORT);
+#ifdef GPIO_DFU_BOOT_PIN_NOPD
+	gpio_set_input(GPIO_DFU_BOOT_PORT, GPIO_DFU_BOOT_PIN);
+#else
+	gpio_set_input_pp(GPIO_DFU_BOOT_PORT, GPIO_DFU_BOOT_PIN);
+	gpio_clear(GPIO_DFU_BOOT_PORT, GPIO_DFU_BOOT_PIN);
+#endif
+	// Software resets come from the app or from ourselves, the board has
+	// been up for a while, so only wait for the pull resistor itself.
+	delay_us((RCC_CSR & RCC_CSR_SFTRSTF) ? GPIO_DFU_BOOT_SOFT_SETTLE_US : GPIO_DFU_BOOT_SETTLE_US,
+	         HSI_MHZ);
+	uint16_t val = gpio_read(GPIO_DFU_BOOT_PORT, GPIO_DFU_BOOT_PIN);
+	gpio_set_input(GPIO_DFU_BOOT_PORT, GPIO_DFU_BOOT_PIN);
+	return val != 0;
+}
+#else
+#define force_dfu_gpio()  (0)
+#endif
+
+// Returns the resulting SYSCLK in MHz: 72 from HSE, or 48 from HSI if the
+// crystal does not start and ENABLE_HSI_USB_FALLBACK is set (HSI is outside
+// the USB clock tolerance, so that is opt-in).
+static uint32_t clock_setup_in_hse_8mhz_out_72mhz() {
 	// No need to use HSI or HSE while setting up the PLL, just use the RC osc.
 
 	/* Enable external high-speed oscillator 8MHz. */
 	RCC_CR |= RCC_CR_HSEON;
+	#ifdef ENABLE_HSI_USB_FALLBACK
+	// Do not wait forever
+	systick_start(HSE_STARTUP_TIMEOUT_US * HSI_MHZ);
+	while (!(RCC_CR & RCC_CR_HSERDY) && !systick_expired());
+	#else
 	while (!(RCC_CR & RCC_CR_HSERDY));
+	#endif
 
 	/*
 	 * Set prescalers for AHB, ADC, ABP1, ABP2.
 	 * Do this before touching the PLL (TODO: why?).
 	 */
+	uint32_t sysclk_mhz = 72;
 	uint32_t reg32 = RCC_CFGR & 0xFFC0000F;
 	reg32 |= (RCC_CFGR_HPRE_SYSCLK_NODIV << 4) | (RCC_CFGR_PPRE1_HCLK_DIV2 << 8) |
-	         (RCC_CFGR_PPRE2_HCLK_NODIV << 11) | (RCC_CFGR_ADCPRE_PCLK2_DIV8 << 14) |
-	         (RCC_CFGR_PLLMUL_PLL_CLK_MUL9 << 18) | (RCC_CFGR_PLLSRC_HSE_CLK << 16) |
-	         (RCC_CFGR_PLLXTPRE_HSE_CLK << 17);
+	         (RCC_CFGR_PPRE2_HCLK_NODIV << 11) | (RCC_CFGR_ADCPRE_PCLK2_DIV8 << 14);
+	if (RCC_CR & RCC_CR_HSERDY)
+		reg32 |= (RCC_CFGR_PLLMUL_PLL_CLK_MUL9 << 18) | (RCC_CFGR_PLLSRC_HSE_CLK << 16) |
+		         (RCC_CFGR_PLLXTPRE_HSE_CLK << 17);
+	else {
+		// HSI/2 * 12 = 48MHz, feed it straight to the USB block.
+		RCC_CR &= ~RCC_CR_HSEON;
+		reg32 |= (RCC_CFGR_PLLMUL_PLL_CLK_MUL12 << 18) | RCC_CFGR_USBPRE_PLL_CLK_NODIV;
+		sysclk_mhz = 48;
+	}
 	RCC_CFGR = reg32;
 
 	// 0WS from 0-24MHz
@@ -402,7 +869,302 @@ static void clock_setup_in_hse_8mhz_out_72mhz() {
 
 	// Select PLL as SYSCLK source.
     RCC_CFGR = (RCC_CFGR & ~RCC_CFGR_SW) | (RCC_CFGR_SW_SYSCLKSEL_PLLCLK << RCC_CFGR_SW_SHIFT);
+
+	return sysclk_mhz;
+}
+
+#ifdef ENABLE_VENDOR_REQUESTS
+#ifdef ENABLE_LINK_STATS
+// Defined in usb.c
+extern struct vendor_link_stats link_stats;
+#endif
+
+// PLL output picked by the clock setup
+#define core_mhz() ((RCC_CR & RCC_CR_HSEON) ? 72 : 48)
+
+#ifdef ENABLE_CAPS
+// Build configuration, see struct vendor_caps
+static void get_caps(struct vendor_caps *c) {
+	c->version = VENDOR_CAPS_VERSION;
+	c->size = sizeof(*c);
+	c->transfer_size = DFU_TRANSFER_SIZE;
+	c->features = 0
+	#ifdef ENABLE_DFU_UPLOAD
+		| CAPS_DFU_UPLOAD
+	#endif
+	#ifdef ENABLE_SAFEWRITE
+		| CAPS_SAFEWRITE
+	#endif
+	#if defined(ENABLE_WRITEPROT) || defined(ENABLE_PROTECTIONS)
+		| CAPS_WRITEPROT
+	#endif
+	#ifdef ENABLE_PROTECTIONS
+		| CAPS_PROTECTIONS
+	#endif
+	#if defined(ENABLE_CHECKSUM) || defined(ENABLE_DUAL_SLOT)
+		| CAPS_CHECKSUM
+	#endif
+	#ifdef ENABLE_DUAL_SLOT
+		| CAPS_DUAL_SLOT
+	#endif
+	#ifdef ENABLE_XL_DUAL_BANK
+		| CAPS_XL_DUAL_BANK
+	#endif
+	#ifdef ENABLE_SHORT_POLL
+		| CAPS_SHORT_POLL
+	#endif
+	#ifdef ENABLE_OPTBYTES_ALT
+		| CAPS_OPTBYTES_ALT
+	#endif
+	#ifdef ENABLE_SRAM_EXEC
+		| CAPS_SRAM_EXEC
+	#endif
+	#ifdef ENABLE_WATCHDOG
+		| CAPS_WATCHDOG
+	#endif
+	#ifdef ENABLE_BOOT_HANDOFF
+		| CAPS_BOOT_HANDOFF
+	#endif
+	#ifdef ENABLE_BOOT_SERVICES
+		| CAPS_BOOT_SERVICES
+	#endif
+	#ifdef WINUSB_SUPPORT
+		| CAPS_WINUSB
+	#endif
+	#ifdef ENABLE_VERIFY
+		| CAPS_VERIFY
+	#endif
+		;
+	c->flash_base = FLASH_BASE_ADDR;
+	c->app_start = APP_ADDRESS;
+	c->app_end = FLASH_END_ADDR;
+	c->page_size = FLASH_PAGE_SIZE;
+	#ifdef ENABLE_CH32F103
+	c->program_align = 128;
+	c->flash_class = CAPS_FLASH_CH32;
+	#else
+	c->program_align = 2;
+	c->flash_class = CAPS_FLASH_STM32;
+	#endif
+	#ifdef ENABLE_SHORT_POLL
+	c->poll_ms = 10;
+	#else
+	c->poll_ms = 100;
+	#endif
+	#if defined(ENABLE_CHECKSUM) || defined(ENABLE_DUAL_SLOT)
+	c->checksum_kind = CAPS_CHECKSUM_XOR;
+	#else
+	c->checksum_kind = CAPS_CHECKSUM_NONE;
+	#endif
+	c->dfuse_cmds = CAPS_CMD_GET | CAPS_CMD_SETADDR | CAPS_CMD_ERASE;
+	c->vendor_reqs = (1 << (VENDOR_REQ_GET_CAPS - 0x50))
+	#ifdef ENABLE_PERF_COUNTERS
+		| (1 << (VENDOR_REQ_GET_PERF - 0x50))
+	#endif
+	#ifdef ENABLE_TRACE
+		| (1 << (VENDOR_REQ_GET_TRACE - 0x50))
+	#endif
+	#ifdef ENABLE_LINK_STATS
+		| (1 << (VENDOR_REQ_GET_LINK_STATS - 0x50))
+	#endif
+	#ifdef ENABLE_SELF_BENCH
+		| (1 << (VENDOR_REQ_SELF_BENCH - 0x50))
+	#endif
+		;
 }
+#endif
+
+#ifdef ENABLE_SELF_BENCH
+#define bench_us(start, mhz) ((perf_now() - (start)) / (mhz))
+
+// Scratch page and the byte it is programmed with
+#define BENCH_PAGE    (FLASH_END_ADDR - FLASH_PAGE_SIZE)
+#define BENCH_PATTERN 0xA5
+
+static struct vendor_self_bench bench;
+
+// Runs the quick parts of the benchmark (blank check, CRC over the
+// bootloader flash and PMA copies, see vendor.h). Programming and erasing
+// the scratch page (only if blank) are left to the next two DFU polls, like
+// a SAFEWRITE wipe: the host sees dfuDNBUSY until the page is blank again.
+static void self_bench_start() {
+	const unsigned mhz = core_mhz();
+	uint32_t t;
+	int blank;
+
+	bench.version = VENDOR_BENCH_VERSION;
+	bench.status = DFU_STATUS_OK;
+	bench.core_mhz = mhz;
+	bench.pending = 0;
+	bench.page_addr = BENCH_PAGE;
+	bench.page_size = FLASH_PAGE_SIZE;
+	bench.program_us = bench.erase_us = 0;
+
+	t = perf_now();
+	blank = _flash_page_is_erased(BENCH_PAGE);
+	bench.blank_check_us = bench_us(t, mhz);
+
+	bench.crc_bytes = FLASH_BOOTLDR_SIZE_KB * 1024;
+	t = perf_now();
+	crc32_words((uint32_t*)FLASH_BASE_ADDR, bench.crc_bytes / 4);
+	bench.crc_us = bench_us(t, mhz);
+
+	// 16 round trips of the largest free chunk
+	bench.pma_bytes = 16 * 256 * 2;
+	t = perf_now();
+	for (unsigned i = 0; i < 16; i++)
+		usb_pma_roundtrip(usbd_control_buffer, 256);
+	bench.pma_us = bench_us(t, mhz);
+
+	if (!blank)
+		bench.status = DFU_STATUS_ERR_CHECK_ERASED;
+	else {
+		bench.pending = 1;
+		bench_step = BENCH_PROGRAM;
+		usbdfu_state = STATE_DFU_DNLOAD_SYNC;
+	}
+}
+
+// One flash step per poll: the page is programmed with the pattern, then
+// erased (even if programming failed) before going back to dfuIDLE.
+static void self_bench_step() {
+	const unsigned mhz = core_mhz();
+	uint32_t t;
+	uint8_t status;
+
+	_flash_unlock();
+	_flash_errors();
+	if (bench_step == BENCH_PROGRAM) {
+		// prog.buf is unused in dfuIDLE, it holds the pattern
+		memset(prog.buf, BENCH_PATTERN, sizeof(prog.buf));
+		t = perf_now();
+		for (unsigned off = 0; off < FLASH_PAGE_SIZE; off += sizeof(prog.buf))
+			_flash_program_buffer(BENCH_PAGE + off, (uint16_t*)prog.buf, sizeof(prog.buf));
+		bench.program_us = bench_us(t, mhz);
+		status = flash_status(DFU_STATUS_ERR_PROG);
+		for (unsigned off = 0; off < FLASH_PAGE_SIZE && status == DFU_STATUS_OK; off += sizeof(prog.buf))
+			if (!_flash_verify(BENCH_PAGE + off, prog.buf, sizeof(prog.buf)))
+				status = DFU_STATUS_ERR_VERIFY;
+		bench.status = status;
+		bench_step = BENCH_ERASE;
+		usbdfu_state = STATE_DFU_DNLOAD_SYNC;
+	} else {
+		t = perf_now();
+		_flash_erase_page(BENCH_PAGE);
+		bench.erase_us = bench_us(t, mhz);
+		status = flash_status(DFU_STATUS_ERR_ERASE);
+		if (status == DFU_STATUS_OK && !_flash_page_is_erased(BENCH_PAGE))
+			status = DFU_STATUS_ERR_ERASE;
+		if (bench.status == DFU_STATUS_OK)
+			bench.status = status;
+		bench.pending = 0;
+		bench_step = BENCH_IDLE;
+		usbdfu_state = STATE_DFU_IDLE;
+	}
+	_flash_lock();
+}
+#endif
+
+// Vendor requests, see vendor.h. They only return data, all of them fit the
+// control buffer.
+enum usbd_request_return_codes
+usb_vendor_request(struct usb_setup_data *req, uint16_t *len) {
+	if (!(req->bmRequestType & USB_REQ_TYPE_IN))
+		return USBD_REQ_NOTSUPP;
+
+	switch (req->bRequest) {
+	#ifdef ENABLE_PERF_COUNTERS
+	case VENDOR_REQ_GET_PERF:
+		perf.version = VENDOR_PERF_VERSION;
+		perf.count = PERF_NUM;
+		perf.core_mhz = core_mhz();
+		memcpy(usbd_control_buffer, &perf, sizeof(perf));
+		*len = sizeof(perf);
+		if (req->wValue & VENDOR_PERF_CLEAR)
+			for (unsigned i = 0; i < PERF_NUM; i++)
+				perf.counter[i].cycles = perf.counter[i].calls = 0;
+		return USBD_REQ_HANDLED;
+	#endif
+	#ifdef ENABLE_LINK_STATS
+	case VENDOR_REQ_GET_LINK_STATS:
+		link_stats.version = VENDOR_LINK_VERSION;
+		link_stats.count = LINK_NUM;
+		memcpy(usbd_control_buffer, &link_stats, sizeof(link_stats));
+		*len = sizeof(link_stats);
+		if (req->wValue & VENDOR_LINK_CLEAR)
+			for (unsigned i = 0; i < LINK_NUM; i++)
+				link_stats.counter[i] = 0;
+		return USBD_REQ_HANDLED;
+	#endif
+	#ifdef ENABLE_SELF_BENCH
+	case VENDOR_REQ_SELF_BENCH:
+		// Not while a download, an upload or the benchmark is in progress
+		if (usbdfu_state != STATE_DFU_IDLE)
+			return USBD_REQ_NOTSUPP;
+		if (req->wValue & VENDOR_BENCH_START)
+			self_bench_start();
+		memcpy(usbd_control_buffer, &bench, sizeof(bench));
+		*len = sizeof(bench);
+		return USBD_REQ_HANDLED;
+	#endif
+	#ifdef ENABLE_CAPS
+	case VENDOR_REQ_GET_CAPS: {
+		struct vendor_caps c;
+		get_caps(&c);
+		memcpy(usbd_control_buffer, &c, sizeof(c));
+		*len = sizeof(c);
+		return USBD_REQ_HANDLED;
+		}
+	#endif
+	#ifdef ENABLE_TRACE
+	case VENDOR_REQ_GET_TRACE:
+		memcpy(usbd_control_buffer, TRACE_RING, sizeof(struct trace_ring));
+		*len = sizeof(struct trace_ring);
+		if (req->wValue & VENDOR_TRACE_CLEAR)
+			TRACE_RING->head = 0;
+		return USBD_REQ_HANDLED;
+	#endif
+	}
+	return USBD_REQ_NOTSUPP;
+}
+#endif
+
+#ifdef ENABLE_SRAM_EXEC
+// Jumps to a vector table downloaded to the SRAM window. Only returns if
+// the image doesn't look valid.
+static void sram_exec(uint32_t addr) {
+	const uint32_t *vt = (uint32_t*)addr;
+	#ifdef ENABLE_SAFEWRITE
+	// RAM survives resets, only run what was downloaded after the wipe
+	if (!wipe_done)
+		return;
+	#endif
+	if (addr < SRAM_EXEC_ADDR || addr >= SRAM_EXEC_END || (addr & 0x7F) ||
+	    (vt[0] & 0x2FFE0000) != 0x20000000 ||
+	    vt[1] < addr || vt[1] >= SRAM_EXEC_END)
+		return;
+
+	// Leave the chip as reset left it: USB off, SysTick off, clock back to
+	// HSI. D+ is kept low so the host sees a disconnect until the image
+	// brings USB up again.
+	*USB_CNTR_REG = USB_CNTR_PWDN;
+	gpio_set_output(GPIOA, 12);
+	gpio_clear(GPIOA, 12);
+	STK_CSR = 0;
+	RCC_CFGR &= ~RCC_CFGR_SW;
+	while (RCC_CFGR & RCC_CFGR_SWS);
+	RCC_CR &= ~(RCC_CR_PLLON | RCC_CR_HSEON);
+
+	volatile uint32_t *_csb_vtor = (uint32_t*)0xE000ED08U;
+	*_csb_vtor = addr;
+	#ifdef HOST_SIM
+	sim_start_image(addr);
+	#else
+	__asm__ volatile("msr msp, %0"::"g"(vt[0]));
+	(*(void (**)())(addr + 4))();
+	#endif
+}
+#endif
 
 bool validate_checksum(const uint32_t * const image, unsigned size) {
 	// Do some simple XOR checking
@@ -413,11 +1175,57 @@ bool validate_checksum(const uint32_t * const image, unsigned size) {
 	return xorv == 0;
 }
 
-int main(void) {
+#ifdef ENABLE_BOOT_HANDOFF
+static void fill_boot_handoff(uint32_t reset_cause, uint32_t app_addr, uint8_t flags) {
+	struct boot_handoff *h = (struct boot_handoff*)BOOT_HANDOFF_ADDR;
+	const uint32_t * const base_addr = (uint32_t*)app_addr;
+
+	uint8_t reason = 0;
+	if (reset_cause & (RCC_CSR_PORRSTF | RCC_CSR_LPWRRSTF))
+		reason |= BOOT_REASON_COLD;
+	else if (reset_cause & (RCC_CSR_IWDGRSTF | RCC_CSR_WWDGRSTF))
+		reason |= BOOT_REASON_WATCHDOG;
+	else if (reset_cause & RCC_CSR_SFTRSTF)
+		reason |= BOOT_REASON_SOFTWARE;
+	else if (reset_cause & RCC_CSR_PINRSTF)
+		reason |= BOOT_REASON_PIN;
+	if (rebooted_into_updater())
+		reason |= BOOT_REASON_UPDATER;
+
+	h->magic = BOOT_HANDOFF_MAGIC;
+	h->version = BOOT_HANDOFF_VERSION;
+	h->size = sizeof(*h);
+	h->boot_reason = reason;
+	h->flags = flags;
+	h->reset_cause = reset_cause;
+	h->image_size = base_addr[0x20 / 4];
+	h->image_check = base_addr[0x1C / 4];
+	h->bl_product = (uint32_t)_usb_strings[1];
+	#ifdef ENABLE_DUAL_SLOT
+	uint16_t trial = boot_slot_trial_read();
+	h->slot = slot_of(app_addr);
+	h->trial_boots = (trial & BOOT_SLOT_TRIAL_PENDING) ? (trial & BOOT_SLOT_TRIAL_COUNT) : 0;
+	#else
+	h->slot = h->trial_boots = 0;
+	#endif
+	h->reserved0 = 0;
+	h->reserved1 = 0;
+}
+#endif
+
+// Called straight from reset_handler, before .data and .bss are set up, so
+// it must not touch any global variable (only the stack and constants).
+// Starting the app from here avoids initializing the bootloader RAM at all.
+__attribute__((noinline))
+void boot_app_if_valid(void) {
 	/* Boot the application if it seems valid and we haven't been
 	 * asked to reboot into DFU mode. This should make the CPU to
 	 * boot into DFU if the user app has been erased. */
 
+	#ifdef ENABLE_BOOT_TIMING
+	boot_timing_start();
+	#endif
+
 	#ifdef ENABLE_WRITEPROT
 	// On every boot we check the FLASH WPR bits and proceed to protect
 	// the bootloader if it's unprotected. This requires a reset.
@@ -466,7 +1274,7 @@ int main(void) {
 	*_AFIO_MAPR = (*_AFIO_MAPR & ~(0x7 << 24)) | (0x4 << 24);
 	#endif
 
-	#ifdef ENABLE_CHECKSUM
+	#if defined(ENABLE_CHECKSUM) && !defined(ENABLE_DUAL_SLOT)
 	const uint32_t start_addr = 0x08000000 + (FLASH_BOOTLDR_SIZE_KB*1024);
 	const uint32_t * const base_addr = (uint32_t*)start_addr;
 	uint32_t imagesize = base_addr[0x20 / 4];
@@ -478,53 +1286,92 @@ int main(void) {
 	#ifdef ENABLE_PINRST_DFU_BOOT
 	             reset_due_to_pin() ||
 	#endif
-	#ifdef ENABLE_WATCHDOG
+	#if defined(ENABLE_WATCHDOG) && defined(ENABLE_DUAL_SLOT)
+	             (reset_due_to_watchdog() && !slot_trial_pending()) ||
+	#elif defined(ENABLE_WATCHDOG)
 	             reset_due_to_watchdog() ||
 	#endif
 	             imagesize > FLASH_BOOTLDR_PAYLOAD_SIZE_KB*1024/4 ||
 	             force_dfu_gpio();
 
+	#if defined(ENABLE_BOOT_HANDOFF) || defined(ENABLE_TRACE)
+	uint32_t reset_cause = RCC_CSR;
+	#endif
 	RCC_CSR |= RCC_CSR_RMVF;
+	trace_boot(reset_cause);
 
+	uint32_t app_addr = 0;
+	#ifdef ENABLE_DUAL_SLOT
+	// Newest valid slot, after accounting for trial boots
+	if (!go_dfu)
+		app_addr = slot_boot_select();
+	#else
 	if (!go_dfu &&
-	   (*(volatile uint32_t *)APP_ADDRESS & 0x2FFE0000) == 0x20000000) {
+	   (*(volatile uint32_t *)APP_ADDRESS & 0x2FFE0000) == 0x20000000
+	   #ifdef ENABLE_CHECKSUM
+	   && validate_checksum(base_addr, imagesize)
+	   #endif
+	   )
+		app_addr = APP_ADDRESS;
+	#endif
 
-		#ifdef ENABLE_CHECKSUM
-		if (validate_checksum(base_addr, imagesize))
+	if (app_addr) {
+		#ifdef ENABLE_BOOT_HANDOFF
+		uint8_t handoff_flags = 0;
+		#if defined(ENABLE_CHECKSUM) || defined(ENABLE_DUAL_SLOT)
+		handoff_flags |= BOOT_HANDOFF_IMAGE_VALID;
+		#endif
+		#ifdef ENABLE_BOOT_HANDOFF_CLOCKS
+		if (clock_setup_in_hse_8mhz_out_72mhz() == 72)
+			handoff_flags |= BOOT_HANDOFF_CLOCK_72MHZ;
+		#endif
+		fill_boot_handoff(reset_cause, app_addr, handoff_flags);
+		#endif
+		// Clear flags
+		clear_reboot_flags();
+		#ifdef ENABLE_WATCHDOG
+		// Enable the watchdog
+		enable_iwdg(4096 * ENABLE_WATCHDOG / 26);
+		#endif
+		#ifdef ENABLE_BOOT_TIMING
+		boot_timing_mark();
+		#endif
+		#ifdef ENABLE_TRACE
+		trace_put(TRACE_APP_START, app_addr & 0xFFFFFF, 0);
+		#endif
+		// The startup delays and the HSE wait ran on SysTick, do not
+		// hand the app a running timer.
+		STK_CSR = 0;
+		// Set vector table base address.
+		volatile uint32_t *_csb_vtor = (uint32_t*)0xE000ED08U;
+		*_csb_vtor = app_addr;
+		#ifdef HOST_SIM
+		sim_start_image(app_addr);
+		#else
+		// Initialise master stack pointer.
+		__asm__ volatile("msr msp, %0"::"g"
+				 (*(volatile uint32_t *)app_addr));
+		// Jump to application.
+		(*(void (**)())(app_addr + 4))();
 		#endif
-		{
-			// Clear flags
-			clear_reboot_flags();
-			#ifdef ENABLE_WATCHDOG
-			// Enable the watchdog
-			enable_iwdg(4096 * ENABLE_WATCHDOG / 26);
-			#endif
-			// Set vector table base address.
-			volatile uint32_t *_csb_vtor = (uint32_t*)0xE000ED08U;
-			*_csb_vtor = APP_ADDRESS & 0xFFFF;
-			// Initialise master stack pointer.
-			__asm__ volatile("msr msp, %0"::"g"
-					 (*(volatile uint32_t *)APP_ADDRESS));
-			// Jump to application.
-			(*(void (**)())(APP_ADDRESS + 4))();
-		}
 	}
+}
+
+int main(void) {
+	// Only reached when DFU mode is required (see boot_app_if_valid)
+	uint32_t sysclk_mhz = clock_setup_in_hse_8mhz_out_72mhz();
+	perf_init();
+	trace(TRACE_DFU_MODE, sysclk_mhz);
+
+	#ifdef ENABLE_DUAL_SLOT
+	PERF(PERF_CHECKSUM, active_slot = slot_newest_valid());
+	if (active_slot >= 0)
+		flash_layout[SLOT_LAYOUT_FLAG(active_slot)] = 'a';
+	#endif
 
-	clock_setup_in_hse_8mhz_out_72mhz();
 #ifdef USE_BACKUP_REGS
 	clear_reboot_flags();
 #endif
-	/*setup systick*/
-#ifdef	ENABLE_LED_STATUS
-	uint32_t	led_status = 1;
-	uint32_t	led_tick_cnt = 0;
-	rcc_gpio_enable(GPIO_LED_STATUS_PORT);
-	gpio_set_output_od(GPIO_LED_STATUS_PORT, GPIO_LED_STATUS_PIN);
-	gpio_clear(GPIO_LED_STATUS_PORT, GPIO_LED_STATUS_PIN);	/* turn on status LED */
-	STK_RVR = 7199999UL;		/* set tick to 100ms */
-	STK_CSR = STK_CSR_CLKSOURCE | STK_CSR_ENABLE;
-#endif
-
 
 	/* Disable USB peripheral as it overrides GPIO settings */
 	*USB_CNTR_REG = USB_CNTR_PWDN;
@@ -535,8 +1382,17 @@ int main(void) {
 	rcc_gpio_enable(GPIOA);
 	gpio_set_output(GPIOA, 12);
 	gpio_clear(GPIOA, 12);
-	for (unsigned int i = 0; i < 100000; i++)
-		__asm__("nop");
+	delay_us(USB_DISCONNECT_US, sysclk_mhz);
+
+	/*setup systick*/
+#ifdef	ENABLE_LED_STATUS
+	uint32_t	led_status = 1;
+	uint32_t	led_tick_cnt = 0;
+	rcc_gpio_enable(GPIO_LED_STATUS_PORT);
+	gpio_set_output_od(GPIO_LED_STATUS_PORT, GPIO_LED_STATUS_PIN);
+	gpio_clear(GPIO_LED_STATUS_PORT, GPIO_LED_STATUS_PIN);	/* turn on status LED */
+	systick_start(sysclk_mhz * 100000);	/* set tick to 100ms */
+#endif
 
 	get_dev_unique_id(serial_no);
 	RCC_APB2ENR |= 1;	//enable alternative function clock for USB
@@ -547,9 +1403,20 @@ int main(void) {
 
 	usb_init();
 
+#ifdef ENABLE_TRACE
+	uint32_t traced_state = 0xFFFF;
+#endif
+
 	while (1) {
 		// Poll based approach
 		do_usb_poll();
+#ifdef ENABLE_TRACE
+		uint32_t dfu_state = usbdfu_state | (usbdfu_status << 8);
+		if (dfu_state != traced_state) {
+			trace(TRACE_DFU_STATE, dfu_state);
+			traced_state = dfu_state;
+		}
+#endif
 #ifdef ENABLE_LED_STATUS
 		if ( STK_CSR & STK_CSR_COUNTFLAG) {
 			uint32_t	status_limit;
@@ -583,6 +1450,70 @@ int main(void) {
 	__builtin_unreachable();
 }
 
+#ifdef ENABLE_BOOT_SERVICES
+// Service table for the app, see boot_services.h. These run in the app
+// context, so they must not use any bootloader global variable.
+
+#define svc_range_ok(addr, len) \
+	((addr) >= APP_ADDRESS && (addr) <= FLASH_END_ADDR && (len) <= FLASH_END_ADDR - (addr))
+
+static int svc_flash_result() {
+	int ret = _flash_errors() ? BOOT_SVC_ERR_FLASH : BOOT_SVC_OK;
+	_flash_lock();
+	return ret;
+}
+
+static int svc_erase_page(uint32_t addr) {
+	if (!svc_range_ok(addr, FLASH_PAGE_SIZE) || (addr & (FLASH_PAGE_SIZE - 1)))
+		return BOOT_SVC_ERR_ADDRESS;
+	_flash_unlock();
+	_flash_errors();
+	_flash_erase_page(addr);
+	return svc_flash_result();
+}
+
+static int svc_program(uint32_t addr, const void *data, unsigned len) {
+	#ifdef ENABLE_CH32F103
+	const uint32_t align = 127;
+	#else
+	const uint32_t align = 1;
+	#endif
+	if (!svc_range_ok(addr, len) || (addr & align) || (len & 1))
+		return BOOT_SVC_ERR_ADDRESS;
+	_flash_unlock();
+	_flash_errors();
+	_flash_program_buffer(addr, (uint16_t*)data, len);
+	int ret = svc_flash_result();
+	#ifdef ENABLE_VERIFY
+	if (ret == BOOT_SVC_OK && !_flash_verify(addr, data, len))
+		ret = BOOT_SVC_ERR_FLASH;
+	#endif
+	return ret;
+}
+
+static int svc_page_is_erased(uint32_t addr) {
+	return _flash_page_is_erased(addr & ~(FLASH_PAGE_SIZE - 1));
+}
+
+static uint32_t svc_crc32(const uint32_t *data, unsigned nwords) {
+	return crc32_words(data, nwords);
+}
+
+__attribute__((section(".services"), used))
+const struct boot_services boot_services = {
+	.magic = BOOT_SERVICES_MAGIC,
+	.version = BOOT_SERVICES_VERSION,
+	.size = sizeof(struct boot_services),
+	.page_size = FLASH_PAGE_SIZE,
+	.app_start = APP_ADDRESS,
+	.app_end = FLASH_END_ADDR,
+	.erase_page = svc_erase_page,
+	.program = svc_program,
+	.page_is_erased = svc_page_is_erased,
+	.crc32 = svc_crc32,
+};
+#endif
+
 // Implement this here to save space, quite minimalistic :D
 __attribute__((used))
 void *memcpy(void * dst, const void * src, size_t count) {
@@ -595,6 +1526,30 @@ void *memcpy(void * dst, const void * src, size_t count) {
 
 // Config checks
 
+#if defined(ENABLE_BOOT_TIMING) && (!defined(GPIO_BOOT_TIMING_PORT) || !defined(GPIO_BOOT_TIMING_PIN))
+  #error "ENABLE_BOOT_TIMING requires GPIO_BOOT_TIMING_PORT and GPIO_BOOT_TIMING_PIN"
+#endif
+
+#if defined(ENABLE_BOOT_HANDOFF_CLOCKS) && !defined(ENABLE_BOOT_HANDOFF)
+  #error "ENABLE_BOOT_HANDOFF_CLOCKS requires ENABLE_BOOT_HANDOFF"
+#endif
+
+#if defined(HOST_SIM) && defined(ENABLE_CH32F103)
+  #error "The host simulator only models the STM32F103 flash controller"
+#endif
+
+#if defined(ENABLE_XL_DUAL_BANK) && defined(ENABLE_CH32F103)
+  #error "CH32F103 parts have a single flash bank, ENABLE_XL_DUAL_BANK is for STM32F103 XL-density"
+#endif
+
+#if defined(ENABLE_XL_DUAL_BANK) && defined(ENABLE_DUAL_SLOT)
+  #error "ENABLE_DUAL_SLOT does not support XL-density (2KB page) parts yet"
+#endif
+
+#if defined(ENABLE_DUAL_SLOT) && defined(ENABLE_SAFEWRITE)
+  #error "ENABLE_SAFEWRITE wipes both slots, it cannot be used with ENABLE_DUAL_SLOT"
+#endif
+
 #if defined(ENABLE_WRITEPROT) && defined(ENABLE_PROTECTIONS)
   #error "ENABLE_PROTECTIONS already includes the same protections as ENABLE_WRITEPROT, do not specify both!"
 #endif
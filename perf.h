@@ -0,0 +1,91 @@
+#ifndef __PERF__HH__
+#define __PERF__HH__
+
+// Cycle accounting with the DWT cycle counter (ENABLE_PERF_COUNTERS), read
+// by the host through VENDOR_REQ_GET_PERF (see vendor.h), and the event
+// trace ring (ENABLE_TRACE, see trace.h) which is timestamped with it.
+// The self benchmark (ENABLE_SELF_BENCH) times itself with it too.
+// Without the flags every macro here compiles to nothing.
+
+#if defined(ENABLE_PERF_COUNTERS) || defined(ENABLE_TRACE) || defined(ENABLE_SELF_BENCH)
+
+#define DEMCR          (*(volatile uint32_t*)0xE000EDFCU)
+#define DEMCR_TRCENA   (1 << 24)
+#define DWT_CTRL       (*(volatile uint32_t*)0xE0001000U)
+#define DWT_CTRL_CYCCNTENA  (1 << 0)
+#define DWT_CYCCNT     (*(volatile uint32_t*)0xE0001004U)
+
+static inline void perf_init() {
+	DEMCR |= DEMCR_TRCENA;
+	DWT_CYCCNT = 0;
+	DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+}
+
+#define perf_now()  DWT_CYCCNT
+
+#else
+
+#define perf_init()
+
+#endif
+
+#ifdef ENABLE_PERF_COUNTERS
+
+#include "vendor.h"
+
+// Defined in main
+extern struct vendor_perf perf;
+
+static inline void perf_add(unsigned id, uint32_t start) {
+	perf.counter[id].cycles += DWT_CYCCNT - start;
+	perf.counter[id].calls++;
+}
+
+// Runs a statement and charges its cycles to a counter
+#define PERF(id, stmt) do {            \
+	uint32_t _perf_start = DWT_CYCCNT; \
+	stmt;                              \
+	perf_add(id, _perf_start);         \
+} while (0)
+
+#else
+
+#define PERF(id, stmt) do { stmt; } while (0)
+
+#endif
+
+#ifdef ENABLE_TRACE
+
+#include "trace.h"
+
+#define TRACE_RING  ((struct trace_ring*)TRACE_ADDR)
+
+static inline void trace_put(unsigned ev, uint32_t arg, uint32_t time) {
+	struct trace_entry *e = &TRACE_RING->e[TRACE_RING->head++ & (TRACE_ENTRIES - 1)];
+	e->time = time;
+	e->data = ev | (arg << 8);
+}
+
+// A couple of stores, cheap enough for the USB paths
+#define trace(ev, arg)  trace_put(ev, arg, DWT_CYCCNT)
+
+// Called on every reset, before RAM is initialized. Starts a new ring
+// after a power up (or if it was overwritten).
+static inline void trace_boot(uint32_t reset_cause) {
+	if (TRACE_RING->magic != TRACE_MAGIC || TRACE_RING->version != TRACE_VERSION) {
+		TRACE_RING->magic = TRACE_MAGIC;
+		TRACE_RING->version = TRACE_VERSION;
+		TRACE_RING->entries = TRACE_ENTRIES;
+		TRACE_RING->head = 0;
+	}
+	trace_put(TRACE_BOOT, reset_cause >> 24, 0);
+}
+
+#else
+
+#define trace(ev, arg)
+#define trace_boot(reset_cause)
+
+#endif
+
+#endif
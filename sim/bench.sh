@@ -0,0 +1,37 @@
+#!/bin/sh
+# Runs dfubench for each CONFIG flavour below, as one CSV table with the
+# flavour in the first column. Run from the top level directory; arguments
+# are passed to dfubench.exe (e.g. -n 64 -x 1024).
+
+FLAVOURS="
+default|
+long-poll|-DENABLE_DFU_UPLOAD
+short-poll|-DENABLE_DFU_UPLOAD -DENABLE_SHORT_POLL
+safewrite|-DENABLE_DFU_UPLOAD -DENABLE_SHORT_POLL -DENABLE_SAFEWRITE
+xl-1024|-DENABLE_DFU_UPLOAD -DENABLE_SHORT_POLL -DENABLE_XL_DUAL_BANK
+"
+
+echo "# $(git describe --abbrev=8 --dirty --always --tags)"
+header=1
+echo "$FLAVOURS" | while IFS='|' read -r name config; do
+	[ -z "$name" ] && continue
+	size=128
+	case "$name" in xl-*) size=1024 ;; esac
+	make clean >/dev/null 2>&1
+	if [ "$name" = default ]; then
+		make FLASH_SIZE=$size sim >/dev/null 2>&1
+	else
+		make FLASH_SIZE=$size CONFIG="$config" sim >/dev/null 2>&1
+	fi
+	if [ $? -ne 0 ]; then
+		echo "$name,build failed"
+		continue
+	fi
+	./sim/dfubench.exe -c "$@" | grep -v '^#' | while read -r line; do
+		case "$line" in
+		workload,*) [ $header = 1 ] && echo "flavour,$line" ;;
+		*) echo "$name,$line" ;;
+		esac
+	done
+	header=0
+done
@@ -0,0 +1,159 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Simulator core (sim.c runs fw.so against it): virtual clock, resets, the
+ * device thread hand over and the host side API.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+
+#include "flash_config.h"
+#include "sim.h"
+
+void sim_log(struct sim *s, const char *fmt, ...) {
+	if (!s->verbose)
+		return;
+	va_list args;
+	va_start(args, fmt);
+	fprintf(stderr, "[%12.6f] ", sim_seconds(s));
+	vfprintf(stderr, fmt, args);
+	fputc('\n', stderr);
+	va_end(args);
+}
+
+double sim_seconds(const struct sim *s) {
+	return s->now / 1e12;
+}
+
+void sim_tick(struct sim *s, uint64_t ps) {
+	s->now += ps;
+	s->cycle_rem += ps * sim_core_mhz(s);
+	s->cycles += s->cycle_rem / 1000000;
+	s->cycle_rem %= 1000000;
+
+	if (s->iwdg_running && s->now >= s->iwdg_deadline && !s->reset_pending) {
+		sim_log(s, "IWDG timeout");
+		s->iwdg_running = 0;
+		s->reset_pending = SIM_RST_IWDG | SIM_RST_PIN;
+	}
+}
+
+void sim_cycles(struct sim *s, unsigned cycles) {
+	sim_tick(s, cycles * 1000000ULL / sim_core_mhz(s));
+}
+
+void sim_advance(struct sim *s, uint64_t ps) {
+	sim_tick(s, ps);
+}
+
+// Default configuration, before sim.c maps the memory
+void sim_config(struct sim *s, const char *fw_path) {
+	memset(s, 0, sizeof(*s));
+	s->flash_kb = FLASH_SIZE_KB;
+	#ifdef ENABLE_XL_DUAL_BANK
+	s->page_size = 2048;
+	s->xl_banks = 1;
+	#else
+	s->page_size = 1024;
+	#endif
+	s->hse = 1;
+	s->erase_ns = SIM_FLASH_ERASE_NS;
+	s->program_ns = SIM_FLASH_PROGRAM_NS;
+	s->fw_path = fw_path;
+	memcpy(s->unique_id, "\x53\x49\x4d\x00\x30\x31\x32\x33\x34\x35\x36\x37", 12);
+}
+
+// Blank flash, factory option bytes, device ID
+void sim_blank(struct sim *s) {
+	memset(s->flash, 0xff, s->flash_kb * 1024);
+	memset(s->sysmem, 0xff, SIM_PAGE);
+	*(uint16_t*)&s->sysmem[SIM_FLASH_SIZE_REG - SIM_SYSMEM_BASE] = s->flash_kb;
+	memcpy(&s->sysmem[SIM_UNIQUE_ID - SIM_SYSMEM_BASE], s->unique_id, 12);
+	static const uint16_t optbytes[8] = { 0x5AA5, 0x00FF, 0x00FF, 0x00FF, 0x00FF, 0x00FF, 0x00FF, 0x00FF };
+	memcpy(&s->sysmem[SIM_OPTBYTES - SIM_SYSMEM_BASE], optbytes, sizeof(optbytes));
+}
+
+int sim_start_device(struct sim *s, void *(*device_thread)(void *)) {
+	sem_init(&s->dev_go, 0, 0);
+	sem_init(&s->host_go, 0, 0);
+	return pthread_create(&s->thread, NULL, device_thread, s) ? -1 : 0;
+}
+
+void sim_reset_models(struct sim *s, uint32_t cause) {
+	s->reset_pending = 0;
+	s->stats.resets++;
+	if (cause & SIM_RST_POR) {
+		// RAM content is random after power up, the backup domain is lost
+		for (unsigned i = 0; i < SIM_SRAM_SIZE; i++)
+			s->sram[i] = rand();
+		memset(&s->periph[SIM_PMA_BASE - SIM_PERIPH_BASE + 0xC00], 0, 0x400);
+	}
+	periph_reset(s, cause);
+	s->state = SIM_RUNNING;
+	sim_log(s, "reset (RCC_CSR flags 0x%08x)", cause);
+}
+
+void sim_device_yield(struct sim *s) {
+	sem_post(&s->host_go);
+	sem_wait(&s->dev_go);
+	if (s->reset_pending)
+		sim_system_reset(s, s->reset_pending);
+}
+
+// Stops the firmware until the next reset
+void sim_device_halt(struct sim *s, enum sim_state state) {
+	s->state = state;
+	while (s->state == state)
+		sim_device_yield(s);
+}
+
+void sim_run(struct sim *s) {
+	if (s->state == SIM_OFF || (s->state != SIM_RUNNING && !s->reset_pending))
+		return;
+
+	sem_post(&s->dev_go);
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 10;
+	while (sem_timedwait(&s->host_go, &ts) < 0) {
+		if (errno == ETIMEDOUT) {
+			fprintf(stderr, "sim: device stuck for 10s at %.6fs (virtual)\n", sim_seconds(s));
+			exit(1);
+		}
+	}
+}
+
+void sim_reset(struct sim *s, uint32_t cause) {
+	s->reset_pending = cause;
+	sim_run(s);
+}
+
+void sim_power_on(struct sim *s) {
+	if (s->state == SIM_OFF)
+		s->state = SIM_RUNNING;
+	sim_reset(s, SIM_RST_POR | SIM_RST_PIN);
+}
+
+// What an app does to get back to the bootloader in DFU mode (see reboot.h)
+void sim_reboot_into_dfu(struct sim *s) {
+	#ifdef USE_BACKUP_REGS
+	*(uint16_t*)&s->periph[0x40006C04U - SIM_PERIPH_BASE] = 0x4F42;   // BKP_DR1, DR2
+	*(uint16_t*)&s->periph[0x40006C08U - SIM_PERIPH_BASE] = 0x544F;
+	#else
+	*(volatile uint64_t*)&s->sram[SIM_SRAM_SIZE - 8] = 0xDEADBEEFCC00FFEEULL;
+	#endif
+	sim_reset(s, SIM_RST_SOFTWARE | SIM_RST_PIN);
+}
+
+void sim_flash_load(struct sim *s, uint32_t addr, const void *data, unsigned len) {
+	if (addr < SIM_FLASH_BASE || addr - SIM_FLASH_BASE + (uint64_t)len > s->flash_kb * 1024) {
+		fprintf(stderr, "sim: flash load out of range (0x%08x, %u bytes)\n", addr, len);
+		exit(1);
+	}
+	memcpy(&s->flash[addr - SIM_FLASH_BASE], data, len);
+}
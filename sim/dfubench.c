@@ -0,0 +1,417 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * DFU throughput benchmark: standard workloads against the simulated
+ * bootloader for a few host behaviours and transfer sizes, in virtual time.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <libgen.h>
+
+#include "flash_config.h"
+#include "sim.h"
+
+#define APP_ADDRESS (FLASH_BASE_ADDR + FLASH_BOOTLDR_SIZE_KB * 1024)
+#define XFER_SIZE   1024   // wTransferSize
+
+// DFU class requests and states
+#define DFU_DNLOAD     1
+#define DFU_UPLOAD     2
+#define DFU_GETSTATUS  3
+#define DFU_ABORT      6
+#define STATE_DFU_DNBUSY      4
+#define STATE_DFU_DNLOAD_IDLE 5
+#define STATE_DFU_MANIFEST    7
+
+// Where the time goes
+enum { PH_ERASE, PH_DNLOAD, PH_POLL, PH_SLEEP, PH_UPLOAD, PH_NUM };
+
+struct host {
+	const char *name;
+	int sleep_poll;     // Sleeps bwPollTimeout while the device is busy (DFU spec)
+	int frame_align;    // Each control transfer starts on a frame boundary
+	int erase_first;    // DfuSe ERASE for every page before downloading
+};
+
+static const struct host hosts[] = {
+	// tools/dfuflash: polls right away, the device NAKs until it is done
+	{ "flasher",  0, 0, 0 },
+	// tools/dfuflash -S: same, but sleeps bwPollTimeout while the device is busy
+	{ "flasher-S", 1, 0, 0 },
+	// dfu-util: erases first, sleeps bwPollTimeout, synchronous transfers
+	{ "dfu-util", 1, 1, 1 },
+};
+
+enum { W_FULL, W_UPDATE, W_UPDATE_DIFF, W_SPARSE, W_HALF_PAGE, W_READBACK, W_NUM };
+
+static const char *wl_names[W_NUM] = { "full", "update", "update-diff", "sparse", "half-page", "readback" };
+static const char *wl_help[W_NUM] = {
+	"blank flash, whole image",
+	"1 in 16 blocks changed, whole image sent",
+	"1 in 16 blocks changed, read back and only changed pages sent",
+	"1 in 4 blocks hold data on blank flash, blank blocks not sent",
+	"old data in the second half of every page only, whole image",
+	"image uploaded and compared",
+};
+
+struct run {
+	uint64_t ps[PH_NUM];
+	unsigned xfers;
+	const struct host *host;
+	unsigned xfer;
+};
+
+static struct sim sim;
+static struct run *cur;
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [options]\n", prog);
+	fprintf(stderr, "  -f fw.so    Simulated bootloader build (default: fw.so next to this binary)\n");
+	fprintf(stderr, "  -n kb       Image size (default 32)\n");
+	fprintf(stderr, "  -w list     Workloads (default all):");
+	for (unsigned i = 0; i < W_NUM; i++)
+		fprintf(stderr, " %s", wl_names[i]);
+	fprintf(stderr, "\n  -H list     Host behaviours (default all): flasher flasher-S dfu-util\n");
+	fprintf(stderr, "  -x list     Transfer sizes, up to %u (default 1024,256)\n", XFER_SIZE);
+	fprintf(stderr, "  -E ms       Page erase time (default %.1f)\n", SIM_FLASH_ERASE_NS / 1e6);
+	fprintf(stderr, "  -P us       Halfword program time (default %.1f)\n", SIM_FLASH_PROGRAM_NS / 1e3);
+	fprintf(stderr, "  -c          CSV output\n");
+	fprintf(stderr, "  -v          Log peripheral and USB events\n");
+	fprintf(stderr, "Workloads:\n");
+	for (unsigned i = 0; i < W_NUM; i++)
+		fprintf(stderr, "  %-12s %s\n", wl_names[i], wl_help[i]);
+}
+
+static int in_list(const char *list, const char *name) {
+	if (!list)
+		return 1;
+	size_t n = strlen(name);
+	for (const char *p = list; (p = strstr(p, name)); p += n)
+		if ((p == list || p[-1] == ',') && (p[n] == ',' || !p[n]))
+			return 1;
+	return 0;
+}
+
+static int control(unsigned phase, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                   uint8_t *data, uint16_t wLength) {
+	uint64_t t0 = sim.now, frame = SIM_USB_FRAME_NS * SIM_NS;
+	if (cur->host->frame_align && sim.now % frame)
+		sim_advance(&sim, frame - sim.now % frame);
+	int ret = sim_usb_control(&sim, bmRequestType, bRequest, wValue, 0, data, wLength);
+	cur->ps[phase] += sim.now - t0;
+	cur->xfers++;
+	return ret;
+}
+
+// GETSTATUS until the device is done, sleeping as the host would
+static int dfu_wait(unsigned phase, uint8_t expect) {
+	uint8_t st[6];
+	for (;;) {
+		int ret = control(phase, 0xA1, DFU_GETSTATUS, 0, st, 6);
+		if (ret < 0)
+			return ret;
+		if (st[4] != STATE_DFU_DNBUSY && st[4] != STATE_DFU_MANIFEST)
+			return st[4] == expect && !st[0] ? 0 : -st[4];
+		if (cur->host->sleep_poll) {
+			uint64_t ps = (st[1] | st[2] << 8 | st[3] << 16) * 1000000000ULL;
+			sim_advance(&sim, ps);
+			cur->ps[PH_SLEEP] += ps;
+		}
+	}
+}
+
+static int dfu_command(unsigned phase, uint8_t cmd, uint32_t addr) {
+	uint8_t buf[5] = { cmd, addr, addr >> 8, addr >> 16, addr >> 24 };
+	int ret = control(phase, 0x21, DFU_DNLOAD, 0, buf, 5);
+	return ret < 0 ? ret : dfu_wait(phase, STATE_DFU_DNLOAD_IDLE);
+}
+
+static void fix_checksum(uint8_t *img, unsigned size) {
+	uint32_t *w = (uint32_t*)img, xorv = 0xB4DC0FEE;
+	w[0x1C / 4] = 0;
+	for (unsigned i = 0; i < size / 4; i++)
+		xorv ^= w[i];
+	w[0x1C / 4] = xorv;
+}
+
+// Random payload with a valid vector table and checksum (see checksum.py)
+static uint8_t *gen_image(unsigned size, unsigned seed) {
+	uint32_t *img = malloc(size);
+	srand(seed);
+	for (unsigned i = 0; i < size / 4; i++)
+		img[i] = rand() ^ (rand() << 16);
+	img[0] = 0x20005000;
+	img[1] = APP_ADDRESS + 0x101;
+	img[0x20 / 4] = size / 4;
+	fix_checksum((uint8_t*)img, size);
+	return (uint8_t*)img;
+}
+
+static int is_blank(const uint8_t *p, unsigned len) {
+	for (unsigned i = 0; i < len; i++)
+		if (p[i] != 0xFF)
+			return 0;
+	return 1;
+}
+
+// Sends the chunks flagged in send (all of them if NULL). Every run of
+// chunks starts with a SETADDR; chunks below wTransferSize get one each,
+// as block numbers count in wTransferSize units. The bootloader erases
+// wTransferSize blocks as it programs them, so for smaller chunks the
+// pages are erased first.
+static int download(const uint8_t *img, unsigned size, const uint8_t *send) {
+	unsigned xfer = cur->xfer, chunks = (size + xfer - 1) / xfer;
+	int ret;
+	if (cur->host->erase_first || xfer < XFER_SIZE) {
+		uint32_t last = 0;
+		for (unsigned i = 0; i < chunks; i++) {
+			uint32_t page = (APP_ADDRESS + i * xfer) & ~(sim.page_size - 1);
+			if ((send && !send[i]) || (last && page == last))
+				continue;
+			if ((ret = dfu_command(PH_ERASE, 0x41, page)) < 0)
+				return ret;
+			last = page;
+		}
+	}
+
+	int block = -1;
+	for (unsigned i = 0; i < chunks; i++) {
+		if (send && !send[i]) {
+			block = -1;
+			continue;
+		}
+		if (block < 0 || xfer < XFER_SIZE) {
+			if ((ret = dfu_command(PH_DNLOAD, 0x21, APP_ADDRESS + i * xfer)) < 0)
+				return ret;
+			block = 2;
+		}
+		unsigned len = size - i * xfer < xfer ? size - i * xfer : xfer;
+		if ((ret = control(PH_DNLOAD, 0x21, DFU_DNLOAD, block++, (uint8_t*)&img[i * xfer], len)) < 0 ||
+		    (ret = dfu_wait(PH_POLL, STATE_DFU_DNLOAD_IDLE)) < 0)
+			return ret;
+	}
+	return 0;
+}
+
+// Reads the image back, wTransferSize at a time, into buf. Like dfu-util
+// it sets the address and leaves dfuDNLOAD-IDLE with an ABORT first.
+static int upload(uint8_t *buf, unsigned size) {
+	int ret;
+	if ((ret = dfu_command(PH_UPLOAD, 0x21, APP_ADDRESS)) < 0 ||
+	    (ret = control(PH_UPLOAD, 0x21, DFU_ABORT, 0, NULL, 0)) < 0)
+		return ret;
+	for (unsigned i = 0; i < (size + XFER_SIZE - 1) / XFER_SIZE; i++) {
+		unsigned len = size - i * XFER_SIZE < XFER_SIZE ? size - i * XFER_SIZE : XFER_SIZE;
+		if ((ret = control(PH_UPLOAD, 0xA1, DFU_UPLOAD, i + 2, &buf[i * XFER_SIZE], XFER_SIZE)) < 0)
+			return ret;
+		if (ret < (int)len)
+			return -1;
+	}
+	return control(PH_UPLOAD, 0x21, DFU_ABORT, 0, NULL, 0);
+}
+
+// Pages (or chunks, when bigger) that differ from what the device holds
+static uint8_t *diff_mask(const uint8_t *img, const uint8_t *dev, unsigned size) {
+	unsigned xfer = cur->xfer, chunks = (size + xfer - 1) / xfer;
+	unsigned unit = sim.page_size > xfer ? sim.page_size : xfer;
+	uint8_t *send = calloc(chunks, 1);
+	for (unsigned i = 0; i < chunks; i++) {
+		unsigned first = i * xfer / unit * unit, len = first + unit > size ? size - first : unit;
+		send[i] = memcmp(&img[first], &dev[first], len) != 0;
+	}
+	return send;
+}
+
+static int workload(unsigned wl, unsigned blocks, unsigned seed) {
+	unsigned size = blocks * XFER_SIZE;
+	if (!blocks)
+		return -1;
+	uint8_t *img = gen_image(size, seed), *old = NULL, *send = NULL, *buf = malloc(size + XFER_SIZE);
+	int ret = 0;
+
+	// Flash contents before the session
+	sim_blank(&sim);
+	if (wl == W_UPDATE || wl == W_UPDATE_DIFF) {
+		old = malloc(size);
+		memcpy(old, img, size);
+		for (unsigned i = 5; i < blocks; i += 16)
+			((uint32_t*)old)[i * XFER_SIZE / 4 + 7] ^= 0x5A5A5A5A;
+		fix_checksum(old, size);
+		sim_flash_load(&sim, APP_ADDRESS, old, size);
+	} else if (wl == W_SPARSE) {
+		for (unsigned i = 1; i < blocks; i++)
+			if (i % 4)
+				memset(&img[i * XFER_SIZE], 0xFF, XFER_SIZE);
+		fix_checksum(img, size);
+	} else if (wl == W_HALF_PAGE) {
+		// On XL parts the first half of each page is a blank block, which
+		// must not be programmed before the page gets erased for the second
+		old = gen_image(sim.page_size / 2, seed + 1);
+		for (unsigned off = 0; off < size; off += sim.page_size)
+			sim_flash_load(&sim, APP_ADDRESS + off + sim.page_size / 2, old, sim.page_size / 2);
+	} else if (wl == W_READBACK)
+		sim_flash_load(&sim, APP_ADDRESS, img, size);
+
+	sim_power_on(&sim);
+	if (sim.state == SIM_APP)
+		sim_reboot_into_dfu(&sim);
+	if ((ret = sim_usb_enumerate(&sim)) < 0 ||
+	    (ret = sim_usb_control(&sim, 0x01, 11, 0, 0, NULL, 0)) < 0)
+		goto out;
+	memset(&sim.stats, 0, sizeof(sim.stats));
+
+	switch (wl) {
+	case W_READBACK:
+		if ((ret = upload(buf, size)) >= 0 && memcmp(buf, img, size))
+			ret = -1;
+		goto out;
+	case W_UPDATE_DIFF:
+		if ((ret = upload(buf, size)) < 0)
+			goto out;
+		send = diff_mask(img, buf, size);
+		break;
+	case W_SPARSE: {
+		unsigned chunks = (size + cur->xfer - 1) / cur->xfer;
+		send = malloc(chunks);
+		for (unsigned i = 0; i < chunks; i++)
+			send[i] = !is_blank(&img[i * cur->xfer], cur->xfer);
+		} break;
+	}
+	if ((ret = download(img, size, send)) < 0)
+		goto out;
+
+	// Manifest (not timed), the new image has to boot
+	uint8_t st[6];
+	if ((ret = sim_usb_control(&sim, 0x21, DFU_DNLOAD, 0, 0, NULL, 0)) < 0)
+		goto out;
+	sim_usb_control(&sim, 0xA1, DFU_GETSTATUS, 0, 0, st, 6);
+	sim_run(&sim);
+	if (sim.state != SIM_APP || memcmp(&sim.flash[APP_ADDRESS - FLASH_BASE_ADDR], img, size))
+		ret = -1;
+out:
+	free(img);
+	free(old);
+	free(send);
+	free(buf);
+	return ret;
+}
+
+static const char *default_fw(void) {
+	static char path[PATH_MAX];
+	ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 8);
+	if (n <= 0)
+		return "fw.so";
+	path[n] = 0;
+	strcat(dirname(path), "/fw.so");
+	return path;
+}
+
+static void print_flags(void) {
+	printf("# Build %s:", VERSION);
+	#ifdef ENABLE_SHORT_POLL
+	printf(" SHORT_POLL");
+	#endif
+	#ifdef ENABLE_SAFEWRITE
+	printf(" SAFEWRITE");
+	#endif
+	#ifdef ENABLE_CHECKSUM
+	printf(" CHECKSUM");
+	#endif
+	#ifdef ENABLE_DFU_UPLOAD
+	printf(" DFU_UPLOAD");
+	#endif
+	#ifdef ENABLE_XL_DUAL_BANK
+	printf(" XL_DUAL_BANK");
+	#endif
+	#ifdef ENABLE_WATCHDOG
+	printf(" WATCHDOG");
+	#endif
+	printf(" (%uKB flash, %u byte pages, erase %.1fms, program %.1fus)\n", sim.flash_kb,
+	       sim.page_size, sim.erase_ns / 1e6, sim.program_ns / 1e3);
+}
+
+int main(int argc, char **argv) {
+	const char *fw = NULL, *wls = NULL, *hls = NULL, *xls = "1024,256";
+	unsigned kb = 32;
+	double erase_ms = 0, program_us = 0;
+	int csv = 0, verbose = 0, opt;
+
+	while ((opt = getopt(argc, argv, "hf:n:w:H:x:E:P:cv")) != -1) {
+		switch (opt) {
+		case 'f': fw = optarg; break;
+		case 'n': kb = atoi(optarg); break;
+		case 'w': wls = optarg; break;
+		case 'H': hls = optarg; break;
+		case 'x': xls = optarg; break;
+		case 'E': erase_ms = atof(optarg); break;
+		case 'P': program_us = atof(optarg); break;
+		case 'c': csv = 1; break;
+		case 'v': verbose = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	unsigned size = kb * 1024;
+	if (!kb || size > FLASH_BOOTLDR_PAYLOAD_SIZE_KB * 1024) {
+		fprintf(stderr, "ERROR! Bad image size (%u KB)\n", kb);
+		return 1;
+	}
+	if (sim_init(&sim, fw ? fw : default_fw()) < 0)
+		return 1;
+	sim.verbose = verbose;
+	if (erase_ms > 0)
+		sim.erase_ns = erase_ms * 1e6;
+	if (program_us > 0)
+		sim.program_ns = program_us * 1e3;
+
+	print_flags();
+	if (csv)
+		printf("workload,host,xfer,kbps,xfers,page_erases,halfword_programs,erase_ms,dnload_ms,poll_ms,sleep_ms,upload_ms,ok\n");
+	else
+		printf("%-12s %-9s %5s %7s %6s %6s %8s %9s %9s %9s %9s %9s\n", "Workload", "Host", "Xfer",
+		       "KB/s", "Xfers", "Erases", "Programs", "Erase ms", "Dnload ms", "Poll ms", "Sleep ms", "Upload ms");
+
+	int failed = 0;
+	for (unsigned w = 0; w < W_NUM; w++) {
+		if (!in_list(wls, wl_names[w]))
+			continue;
+		for (unsigned h = 0; h < sizeof(hosts) / sizeof(hosts[0]); h++) {
+			if (!in_list(hls, hosts[h].name))
+				continue;
+			for (const char *x = xls; x && *x; x = strchr(x, ',') ? strchr(x, ',') + 1 : NULL) {
+				struct run run = { .host = &hosts[h], .xfer = atoi(x) };
+				if (!run.xfer || run.xfer > XFER_SIZE || (run.xfer & 1))
+					continue;
+				// Uploads count in wTransferSize blocks
+				if (run.xfer != XFER_SIZE && (w == W_READBACK || w == W_UPDATE_DIFF))
+					continue;
+				#ifdef ENABLE_SAFEWRITE
+				// The first download wipes the payload, partial updates can't work
+				if (w == W_UPDATE_DIFF)
+					continue;
+				#endif
+				cur = &run;
+				int ret = workload(w, kb, 1);
+				failed |= ret < 0;
+
+				uint64_t total = 0;
+				for (unsigned p = 0; p < PH_NUM; p++)
+					total += run.ps[p];
+				double kbps = total && ret >= 0 ? size / 1024.0 / (total / 1e12) : 0;
+				const char *fmt = csv ? "%s,%s,%u,%.1f,%u,%u,%u,%.1f,%.1f,%.1f,%.1f,%.1f,%s\n" :
+				                        "%-12s %-9s %5u %7.1f %6u %6u %8u %9.1f %9.1f %9.1f %9.1f %9.1f %s\n";
+				printf(fmt, wl_names[w], hosts[h].name, run.xfer, kbps, run.xfers, sim.stats.page_erases,
+				       sim.stats.halfword_programs, run.ps[PH_ERASE] / 1e9, run.ps[PH_DNLOAD] / 1e9,
+				       run.ps[PH_POLL] / 1e9, run.ps[PH_SLEEP] / 1e9, run.ps[PH_UPLOAD] / 1e9,
+				       ret < 0 ? (csv ? "0" : "FAILED") : (csv ? "1" : ""));
+			}
+		}
+	}
+	return failed;
+}
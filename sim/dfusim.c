@@ -0,0 +1,376 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Runs a DfuSe download against the simulated bootloader and reports the
+ * virtual time it takes, plus the flash and USB activity behind it.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <libgen.h>
+
+#include "flash_config.h"
+#include "sim.h"
+#include "../vendor.h"
+#include "../trace.h"
+
+#define APP_ADDRESS (FLASH_BASE_ADDR + FLASH_BOOTLDR_SIZE_KB * 1024)
+#define XFER_SIZE   1024
+
+// DFU class requests and states
+#define DFU_DNLOAD     1
+#define DFU_UPLOAD     2
+#define DFU_GETSTATUS  3
+#define DFU_CLRSTATUS  4
+#define DFU_ABORT      6
+#define STATE_DFU_IDLE        2
+#define STATE_DFU_DNBUSY      4
+#define STATE_DFU_DNLOAD_IDLE 5
+#define STATE_DFU_MANIFEST    7
+#define STATE_DFU_ERROR       10
+
+static struct sim sim;
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [options] [file.bin]\n", prog);
+	fprintf(stderr, "  -f fw.so  Simulated bootloader build (default: fw.so next to this binary)\n");
+	fprintf(stderr, "  -n kb     Size of the generated test image (default 32, ignored with a file)\n");
+	fprintf(stderr, "  -s seed   Random seed for the generated image\n");
+	fprintf(stderr, "  -u        Update: flash holds an older image (of the same size) first\n");
+	fprintf(stderr, "  -H        Half written pages: flash holds old data in the second half of\n");
+	fprintf(stderr, "            every page the image spans (on XL parts, half a page is a block)\n");
+	fprintf(stderr, "  -e        Erase every page the image spans first\n");
+	fprintf(stderr, "  -V        Verify the image by reading it back (needs ENABLE_DFU_UPLOAD)\n");
+	fprintf(stderr, "  -p        Print the bootloader cycle counters (needs ENABLE_PERF_COUNTERS)\n");
+	fprintf(stderr, "  -t        Print the bootloader event trace (needs ENABLE_TRACE)\n");
+	fprintf(stderr, "  -l        Print the bootloader USB link counters (needs ENABLE_LINK_STATS)\n");
+	fprintf(stderr, "  -c        Print the bootloader capabilities (needs ENABLE_CAPS)\n");
+	fprintf(stderr, "  -b        Run the bootloader self benchmark first (needs ENABLE_SELF_BENCH)\n");
+	fprintf(stderr, "  -X n      Corrupt every nth USB data packet (n >= 2), like a marginal cable\n");
+	fprintf(stderr, "  -v        Log peripheral and USB events\n");
+}
+
+static void fail(const char *what, int err) {
+	fprintf(stderr, "ERROR! %s failed (%d) at %.6fs\n", what, err, sim_seconds(&sim));
+	if (sim.state == SIM_HALTED)
+		fprintf(stderr, "Device halted: %s\n", sim.halt_reason);
+	exit(1);
+}
+
+// Random payload with a valid vector table and checksum (see checksum.py)
+static uint8_t *gen_image(unsigned size, unsigned seed) {
+	uint32_t *img = malloc(size);
+	srand(seed);
+	for (unsigned i = 0; i < size / 4; i++)
+		img[i] = rand() ^ (rand() << 16);
+	img[0] = 0x20005000;
+	img[1] = APP_ADDRESS + 0x101;
+	img[0x20 / 4] = size / 4;
+	img[0x1C / 4] = 0;
+	uint32_t xorv = 0xB4DC0FEE;
+	for (unsigned i = 0; i < size / 4; i++)
+		xorv ^= img[i];
+	img[0x1C / 4] = xorv;
+	return (uint8_t*)img;
+}
+
+// GETSTATUS until the device is done with the pending operation
+static int dfu_wait(uint8_t expect) {
+	uint8_t st[6];
+	for (;;) {
+		int ret = sim_usb_control(&sim, 0xA1, DFU_GETSTATUS, 0, 0, st, 6);
+		if (ret < 0)
+			return ret;
+		if (st[4] != STATE_DFU_DNBUSY && st[4] != STATE_DFU_MANIFEST)
+			return st[4] == expect && !st[0] ? 0 : -st[4];
+		sim_advance(&sim, (st[1] | st[2] << 8 | st[3] << 16) * 1000000000ULL);
+	}
+}
+
+static int dfu_command(uint8_t cmd, uint32_t addr) {
+	uint8_t buf[5] = { cmd, addr, addr >> 8, addr >> 16, addr >> 24 };
+	int ret = sim_usb_control(&sim, 0x21, DFU_DNLOAD, 0, 0, buf, 5);
+	return ret < 0 ? ret : dfu_wait(STATE_DFU_DNLOAD_IDLE);
+}
+
+// DWT counters read through the vendor request (like tools/dfuinfo -p)
+static void print_perf(const struct vendor_perf *p, int ret) {
+	static const char *names[PERF_NUM] = {
+		"erase", "program", "blank_check", "checksum", "pma_copy", "poll_gap",
+	};
+	if (ret < (int)sizeof(*p) || p->version != VENDOR_PERF_VERSION) {
+		printf("Cycle counters: not available (%d)\n", ret);
+		return;
+	}
+	printf("Cycle counters (core at %u MHz):\n", p->core_mhz);
+	for (unsigned i = 0; i < PERF_NUM; i++)
+		printf("  %-12s %8u calls %12u cycles %10.1f us/call\n", names[i], p->counter[i].calls,
+		       p->counter[i].cycles, p->counter[i].calls ?
+		       (double)p->counter[i].cycles / p->counter[i].calls / p->core_mhz : 0);
+}
+
+static void print_link_stats(const struct vendor_link_stats *l, int ret) {
+	static const char *names[LINK_NUM] = {
+		"bus_errors", "pma_overruns", "missed_sofs", "stalls", "short_reads", "bus_resets", "setups",
+	};
+	if (ret < (int)sizeof(*l) || l->version != VENDOR_LINK_VERSION) {
+		printf("Link counters: not available (%d)\n", ret);
+		return;
+	}
+	printf("Link counters:");
+	for (unsigned i = 0; i < LINK_NUM; i++)
+		printf(" %s %u", names[i], l->counter[i]);
+	printf("\n");
+}
+
+static void print_caps(const struct vendor_caps *c, int ret) {
+	if (ret < (int)sizeof(*c) || c->version < VENDOR_CAPS_VERSION) {
+		printf("Capabilities: not available (%d)\n", ret);
+		return;
+	}
+	printf("Capabilities: features 0x%04x, payload 0x%08x-0x%08x, %u byte pages, %u byte alignment, "
+	       "flash class %u, %u ms polls, checksum %u, DfuSe commands 0x%x, vendor requests 0x%x\n",
+	       c->features, c->app_start, c->app_end, c->page_size, c->program_align, c->flash_class,
+	       c->poll_ms, c->checksum_kind, c->dfuse_cmds, c->vendor_reqs);
+}
+
+// Self benchmark timings (like tools/dfuinfo -b)
+static void print_self_bench(const struct vendor_self_bench *b, int ret) {
+	if (ret != (int)sizeof(*b) || b->version != VENDOR_BENCH_VERSION) {
+		printf("Self benchmark: not available (%d)\n", ret);
+		return;
+	}
+	printf("Self benchmark (status %u): blank check %u us, program %u us, erase %u us per %u byte page, "
+	       "CRC %u bytes in %u us, PMA %u bytes in %u us\n", b->status, b->blank_check_us, b->program_us,
+	       b->erase_us, b->page_size, b->crc_bytes, b->crc_us, b->pma_bytes, b->pma_us);
+}
+
+// Event trace read through the vendor request (tools/dfuinfo -t decodes the args)
+static void print_trace(const struct trace_ring *t, int ret) {
+	static const char *names[] = {
+		"-", "boot", "app_start", "dfu_mode", "usb_reset", "usb_setup", "usb_fsm",
+		"usb_stall", "dfu_state", "flash_begin", "flash_end",
+	};
+	if (ret != (int)sizeof(*t) || t->magic != TRACE_MAGIC) {
+		printf("Event trace: not available (%d)\n", ret);
+		return;
+	}
+	unsigned n = t->head < TRACE_ENTRIES ? t->head : TRACE_ENTRIES;
+	printf("Event trace (last %u of %u):\n", n, t->head);
+	for (unsigned i = t->head - n; i != t->head; i++) {
+		const struct trace_entry *e = &t->e[i % TRACE_ENTRIES];
+		unsigned ev = e->data & 0xFF;
+		printf("  %10u cycles  %-12s 0x%06x\n", e->time,
+		       ev < sizeof(names) / sizeof(names[0]) ? names[ev] : "?", e->data >> 8);
+	}
+}
+
+static const char *default_fw(void) {
+	static char path[PATH_MAX];
+	ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 8);
+	if (n <= 0)
+		return "fw.so";
+	path[n] = 0;
+	strcat(dirname(path), "/fw.so");
+	return path;
+}
+
+int main(int argc, char **argv) {
+	const char *fw = NULL;
+	unsigned kb = 32, seed = 1;
+	int update = 0, half = 0, erase = 0, verify = 0, perf = 0, trace = 0, link = 0, bench = 0, caps = 0, verbose = 0, opt;
+	unsigned error_every = 0;
+
+	while ((opt = getopt(argc, argv, "hf:n:s:uHeVptlbcX:v")) != -1) {
+		switch (opt) {
+		case 'f': fw = optarg; break;
+		case 'n': kb = atoi(optarg); break;
+		case 's': seed = atoi(optarg); break;
+		case 'u': update = 1; break;
+		case 'H': half = 1; break;
+		case 'e': erase = 1; break;
+		case 'V': verify = 1; break;
+		case 'p': perf = 1; break;
+		case 't': trace = 1; break;
+		case 'l': link = 1; break;
+		case 'b': bench = 1; break;
+		case 'c': caps = 1; break;
+		case 'X': error_every = atoi(optarg); break;
+		case 'v': verbose = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	uint8_t *img;
+	unsigned size;
+	if (optind < argc) {
+		FILE *fd = fopen(argv[optind], "rb");
+		if (!fd) {
+			fprintf(stderr, "ERROR! Cannot open %s\n", argv[optind]);
+			return 1;
+		}
+		fseek(fd, 0, SEEK_END);
+		size = ftell(fd);
+		fseek(fd, 0, SEEK_SET);
+		img = calloc(1, size + 4);
+		if (fread(img, 1, size, fd) != size)
+			return 1;
+		fclose(fd);
+		size = (size + 1) & ~1U;
+	} else {
+		size = kb * 1024;
+		img = gen_image(size, seed);
+	}
+	if (error_every == 1) {
+		fprintf(stderr, "ERROR! -X needs 2 or more (every packet would fail)\n");
+		return 1;
+	}
+	if (size > FLASH_BOOTLDR_PAYLOAD_SIZE_KB * 1024) {
+		fprintf(stderr, "ERROR! Image too big (%u bytes)\n", size);
+		return 1;
+	}
+
+	if (sim_init(&sim, fw ? fw : default_fw()) < 0)
+		return 1;
+	sim.verbose = verbose;
+	sim.usb_error_every = error_every;
+	if (update) {
+		uint8_t *old = gen_image(size, seed + 1);
+		sim_flash_load(&sim, APP_ADDRESS, old, size);
+		free(old);
+	}
+	if (half) {
+		unsigned hp = sim.page_size / 2;
+		uint8_t *old = gen_image(hp, seed + 2);
+		for (unsigned off = 0; off < size; off += sim.page_size)
+			sim_flash_load(&sim, APP_ADDRESS + off + hp, old, hp);
+		free(old);
+	}
+
+	struct timespec w0, w1;
+	clock_gettime(CLOCK_MONOTONIC, &w0);
+	sim_power_on(&sim);
+	if (sim.state == SIM_APP)
+		sim_reboot_into_dfu(&sim);
+	int ret;
+	if ((ret = sim_usb_enumerate(&sim)) < 0)
+		fail("Enumeration", ret);
+	double t_enum = sim_seconds(&sim);
+
+	if ((ret = sim_usb_control(&sim, 0x01, 11, 0, 0, NULL, 0)) < 0)
+		fail("SET_INTERFACE", ret);
+
+	struct vendor_caps capabilities;
+	int caps_ret = 0;
+	if (caps)
+		caps_ret = sim_usb_control(&sim, 0xC0, VENDOR_REQ_GET_CAPS, 0, 0, (uint8_t*)&capabilities, sizeof(capabilities));
+	// Needs dfuIDLE, and runs before the image could reach the scratch page
+	struct vendor_self_bench self_bench;
+	int bench_ret = 0;
+	if (bench) {
+		bench_ret = sim_usb_control(&sim, 0xC0, VENDOR_REQ_SELF_BENCH, VENDOR_BENCH_START, 0,
+		                            (uint8_t*)&self_bench, sizeof(self_bench));
+		// The flash part runs on the GETSTATUS polls
+		if (bench_ret == (int)sizeof(self_bench) && self_bench.pending) {
+			if ((ret = dfu_wait(STATE_DFU_IDLE)) < 0)
+				fail("Self benchmark", ret);
+			bench_ret = sim_usb_control(&sim, 0xC0, VENDOR_REQ_SELF_BENCH, 0, 0,
+			                            (uint8_t*)&self_bench, sizeof(self_bench));
+		}
+	}
+
+	if (erase) {
+		for (unsigned off = 0; off < size; off += sim.page_size)
+			if ((ret = dfu_command(0x41, APP_ADDRESS + off)) < 0)
+				fail("Erase", ret);
+	}
+	double t_erase = sim_seconds(&sim);
+
+	if ((ret = dfu_command(0x21, APP_ADDRESS)) < 0)
+		fail("Set address", ret);
+	unsigned blocks = (size + XFER_SIZE - 1) / XFER_SIZE;
+	for (unsigned i = 0; i < blocks; i++) {
+		unsigned len = size - i * XFER_SIZE < XFER_SIZE ? size - i * XFER_SIZE : XFER_SIZE;
+		if ((ret = sim_usb_control(&sim, 0x21, DFU_DNLOAD, i + 2, 0, &img[i * XFER_SIZE], len)) < 0 ||
+		    (ret = dfu_wait(STATE_DFU_DNLOAD_IDLE)) < 0)
+			fail("Download", ret);
+	}
+	double t_download = sim_seconds(&sim);
+
+	if (verify) {
+		uint8_t buf[XFER_SIZE];
+		if ((ret = sim_usb_control(&sim, 0x21, DFU_ABORT, 0, 0, NULL, 0)) < 0)
+			fail("Abort", ret);
+		for (unsigned i = 0; i < blocks; i++) {
+			unsigned len = size - i * XFER_SIZE < XFER_SIZE ? size - i * XFER_SIZE : XFER_SIZE;
+			if ((ret = sim_usb_control(&sim, 0xA1, DFU_UPLOAD, i + 2, 0, buf, XFER_SIZE)) < 0)
+				fail("Upload", ret);
+			if (ret < (int)len || memcmp(buf, &img[i * XFER_SIZE], len)) {
+				fprintf(stderr, "ERROR! Verify mismatch in block %u\n", i);
+				return 1;
+			}
+		}
+		if ((ret = sim_usb_control(&sim, 0x21, DFU_ABORT, 0, 0, NULL, 0)) < 0)
+			fail("Abort", ret);
+	}
+	double t_verify = sim_seconds(&sim);
+	struct vendor_perf counters;
+	int perf_ret = 0;
+	if (perf)
+		perf_ret = sim_usb_control(&sim, 0xC0, VENDOR_REQ_GET_PERF, 0, 0, (uint8_t*)&counters, sizeof(counters));
+	struct vendor_link_stats link_stats;
+	int link_ret = 0;
+	if (link)
+		link_ret = sim_usb_control(&sim, 0xC0, VENDOR_REQ_GET_LINK_STATS, 0, 0, (uint8_t*)&link_stats, sizeof(link_stats));
+	struct trace_ring ring;
+	int trace_ret = 0;
+	if (trace)
+		trace_ret = sim_usb_control(&sim, 0xC0, VENDOR_REQ_GET_TRACE, 0, 0, (uint8_t*)&ring, sizeof(ring));
+
+	// Manifest: the bootloader resets and should start the new image
+	if ((ret = sim_usb_control(&sim, 0x21, DFU_DNLOAD, 0, 0, NULL, 0)) < 0)
+		fail("Manifest", ret);
+	uint8_t st[6];
+	sim_usb_control(&sim, 0xA1, DFU_GETSTATUS, 0, 0, st, 6);
+	sim_run(&sim);
+	clock_gettime(CLOCK_MONOTONIC, &w1);
+	double t_end = sim_seconds(&sim);
+
+	int ok = sim.state == SIM_APP && sim.app_addr == APP_ADDRESS &&
+	         !memcmp(&sim.flash[APP_ADDRESS - FLASH_BASE_ADDR], img, size);
+	printf("Image: %u bytes (%u blocks) at 0x%08x\n", size, blocks, APP_ADDRESS);
+	printf("Virtual time: enumerate %.3fs, erase %.3fs, download %.3fs, verify %.3fs, manifest %.3fs\n",
+	       t_enum, t_erase - t_enum, t_download - t_erase, t_verify - t_download, t_end - t_verify);
+	printf("Download rate: %.1f KB/s\n", size / 1024.0 / (t_download - t_erase));
+	printf("Flash: %u page erases, %u halfword programs, %u errors\n",
+	       sim.stats.page_erases, sim.stats.halfword_programs, sim.stats.flash_errors);
+	printf("USB: %u setups, %u IN, %u OUT, %u NAKs, %u errors, %u bytes out, %u bytes in\n",
+	       sim.stats.usb_setups, sim.stats.usb_in, sim.stats.usb_out, sim.stats.usb_naks,
+	       sim.stats.usb_errors, sim.stats.usb_bytes_out, sim.stats.usb_bytes_in);
+	printf("Peripheral accesses: %llu reads, %llu writes, %u resets (wall time %.3fs)\n",
+	       (unsigned long long)sim.stats.mmio_reads, (unsigned long long)sim.stats.mmio_writes,
+	       sim.stats.resets, (w1.tv_sec - w0.tv_sec) + (w1.tv_nsec - w0.tv_nsec) / 1e9);
+	if (caps)
+		print_caps(&capabilities, caps_ret);
+	if (bench)
+		print_self_bench(&self_bench, bench_ret);
+	if (perf)
+		print_perf(&counters, perf_ret);
+	if (link)
+		print_link_stats(&link_stats, link_ret);
+	if (trace)
+		print_trace(&ring, trace_ret);
+	if (!ok) {
+		fprintf(stderr, "ERROR! Device did not boot the new image (state %d, at 0x%08x)\n",
+		        sim.state, sim.app_addr);
+		return 1;
+	}
+	printf("Device booted the image at 0x%08x\n", sim.app_addr);
+	return 0;
+}
@@ -0,0 +1,229 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Flash controller (FPEC) model: unlock sequences, page and option byte
+ * erase, halfword programming, write protection and operation timing.
+ *
+ */
+
+#include <string.h>
+
+#include "sim.h"
+
+#define KEY1 0x45670123U
+#define KEY2 0xCDEF89ABU
+
+#define CR_PG     (1U << 0)
+#define CR_PER    (1U << 1)
+#define CR_MER    (1U << 2)
+#define CR_OPTPG  (1U << 4)
+#define CR_OPTER  (1U << 5)
+#define CR_STRT   (1U << 6)
+#define CR_LOCK   (1U << 7)
+#define CR_OPTWRE (1U << 9)
+#define CR_IRQS   (0x1400U)
+#define SR_BSY    (1U << 0)
+#define SR_PGERR  (1U << 2)
+#define SR_WPERR  (1U << 4)
+#define SR_EOP    (1U << 5)
+
+#define BANK2_ADDR 0x08080000U
+
+static uint32_t *opt_reg(struct sim *s, uint32_t off) {
+	return (uint32_t*)&s->periph[SIM_FLASH_REGS - SIM_PERIPH_BASE + off];
+}
+
+static uint16_t *optbytes(struct sim *s) {
+	return (uint16_t*)&s->sysmem[SIM_OPTBYTES - SIM_SYSMEM_BASE];
+}
+
+void flash_reset(struct sim *s) {
+	for (unsigned b = 0; b < 2; b++) {
+		memset(&s->fl[b], 0, sizeof(s->fl[b]));
+		s->fl[b].cr = CR_LOCK;
+	}
+
+	// Option bytes are loaded on reset
+	const uint16_t *ob = optbytes(s);
+	uint32_t obr = (ob[1] & 0xFF) << 2 | (ob[2] & 0xFF) << 10 | (ob[3] & 0xFF) << 18;
+	if ((ob[0] & 0xFF) != 0xA5)
+		obr |= 1U << 1;   // RDPRT
+	*opt_reg(s, 0x1C) = obr;
+	*opt_reg(s, 0x20) = (ob[4] & 0xFF) | (ob[5] & 0xFF) << 8 | (ob[6] & 0xFF) << 16 | (uint32_t)(ob[7] & 0xFF) << 24;
+}
+
+// Each WRPR bit guards 4KB (the last one everything above)
+static int write_protected(struct sim *s, uint32_t addr) {
+	unsigned bit = (addr - SIM_FLASH_BASE) / 4096;
+	return !((*opt_reg(s, 0x20) >> (bit > 31 ? 31 : bit)) & 1);
+}
+
+static void flash_wait(struct sim *s, struct sim_flash_bank *fb) {
+	if (s->now < fb->busy_until)
+		sim_tick(s, fb->busy_until - s->now);
+}
+
+static void flash_error(struct sim *s, struct sim_flash_bank *fb, uint32_t flag, uint32_t addr) {
+	fb->sr |= flag;
+	s->stats.flash_errors++;
+	sim_log(s, "flash %s error at 0x%08x", flag == SR_WPERR ? "write protection" : "programming", addr);
+}
+
+static void flash_start(struct sim *s, unsigned b) {
+	struct sim_flash_bank *fb = &s->fl[b];
+	flash_wait(s, fb);
+
+	if (fb->cr & CR_PER) {
+		uint32_t page = fb->ar & ~(s->page_size - 1);
+		uint32_t lo = b ? BANK2_ADDR : SIM_FLASH_BASE;
+		uint32_t hi = b || !s->xl_banks ? SIM_FLASH_BASE + s->flash_kb * 1024 : BANK2_ADDR;
+		if (page < lo || page >= hi)
+			return;
+		if (write_protected(s, page)) {
+			flash_error(s, fb, SR_WPERR, page);
+			return;
+		}
+		memset(&s->flash[page - SIM_FLASH_BASE], 0xFF, s->page_size);
+		s->stats.page_erases++;
+	}
+	else if (fb->cr & CR_MER) {
+		// Not used by the bootloader, erases the bank
+		uint32_t lo = b ? BANK2_ADDR : SIM_FLASH_BASE;
+		uint32_t hi = b || !s->xl_banks ? SIM_FLASH_BASE + s->flash_kb * 1024 : BANK2_ADDR;
+		memset(&s->flash[lo - SIM_FLASH_BASE], 0xFF, hi - lo);
+	}
+	else if ((fb->cr & CR_OPTER) && !b) {
+		if (!(fb->cr & CR_OPTWRE)) {
+			flash_error(s, fb, SR_WPERR, SIM_OPTBYTES);
+			return;
+		}
+		memset(optbytes(s), 0xFF, 16);
+		s->stats.optbyte_erases++;
+	}
+	else
+		return;
+
+	fb->busy_until = s->now + s->erase_ns * SIM_NS;
+	fb->sr |= SR_EOP;
+}
+
+uint32_t flash_reg_read(struct sim *s, uint32_t off, int peek) {
+	unsigned b = off >= 0x40 && s->xl_banks;
+	struct sim_flash_bank *fb = &s->fl[b];
+	switch (off - b * 0x40) {
+	case 0x0C:
+		// Polling a busy controller lasts until the operation ends
+		if (s->now < fb->busy_until) {
+			if (peek)
+				return fb->sr | SR_BSY;
+			flash_wait(s, fb);
+		}
+		return fb->sr;
+	case 0x10:
+		return fb->cr;
+	case 0x14:
+		return fb->ar;
+	case 0x04:
+	case 0x08:
+		return 0;
+	}
+	return *opt_reg(s, off);
+}
+
+void flash_reg_write(struct sim *s, uint32_t off, uint32_t val) {
+	unsigned b = off >= 0x40 && s->xl_banks;
+	struct sim_flash_bank *fb = &s->fl[b];
+	switch (off - b * 0x40) {
+	case 0x04:
+		// A wrong key locks the controller until the next reset
+		if (fb->key_error || !(fb->cr & CR_LOCK))
+			break;
+		if (val == (fb->key_stage ? KEY2 : KEY1)) {
+			if (fb->key_stage++) {
+				fb->cr &= ~CR_LOCK;
+				fb->key_stage = 0;
+			}
+		} else {
+			fb->key_error = 1;
+			sim_log(s, "flash: wrong unlock key 0x%08x", val);
+		}
+		break;
+	case 0x08:
+		if (b || (fb->cr & CR_LOCK))
+			break;
+		if (val == (fb->optkey_stage ? KEY2 : KEY1)) {
+			if (fb->optkey_stage++) {
+				fb->cr |= CR_OPTWRE;
+				fb->optkey_stage = 0;
+			}
+		} else
+			fb->optkey_stage = 0;
+		break;
+	case 0x0C:
+		fb->sr &= ~(val & (SR_PGERR | SR_WPERR | SR_EOP));
+		break;
+	case 0x10:
+		if (fb->cr & CR_LOCK)
+			break;
+		fb->cr = (val & (CR_PG | CR_PER | CR_MER | CR_OPTPG | CR_OPTER | CR_LOCK | CR_IRQS)) |
+		         (fb->cr & val & CR_OPTWRE);
+		if (val & CR_LOCK)
+			fb->cr &= ~CR_OPTWRE;
+		if (val & CR_STRT)
+			flash_start(s, b);
+		break;
+	case 0x14:
+		fb->ar = val;
+		break;
+	default:
+		if (off < 0x1C)
+			*opt_reg(s, off) = val;   // ACR
+	}
+}
+
+// Program cycle on the flash array or the option bytes. The new value is in
+// memory already, it is fixed up to what the hardware would store.
+void flash_array_write(struct sim *s, uint32_t addr, uint16_t old, uint16_t val) {
+	uint16_t *cell;
+	struct sim_flash_bank *fb;
+	int opt = addr >= SIM_SYSMEM_BASE;
+	if (opt) {
+		cell = (uint16_t*)&s->sysmem[addr - SIM_SYSMEM_BASE];
+		fb = &s->fl[0];
+	} else {
+		cell = (uint16_t*)&s->flash[addr - SIM_FLASH_BASE];
+		fb = &s->fl[s->xl_banks && addr >= BANK2_ADDR];
+	}
+	*cell = old;
+	flash_wait(s, fb);
+
+	if (opt) {
+		if (addr < SIM_OPTBYTES || addr >= SIM_OPTBYTES + 16 || !(fb->cr & CR_OPTPG) || !(fb->cr & CR_OPTWRE)) {
+			sim_log(s, "flash: ignored write to 0x%08x", addr);
+			return;
+		}
+		if (old != 0xFFFF) {
+			flash_error(s, fb, SR_PGERR, addr);
+			return;
+		}
+		// The complement byte is generated by the hardware
+		*cell = (val & 0xFF) | (~val & 0xFF) << 8;
+		s->stats.optbyte_programs++;
+	} else {
+		if (!(fb->cr & CR_PG)) {
+			sim_log(s, "flash: ignored write to 0x%08x", addr);
+			return;
+		}
+		if (write_protected(s, addr)) {
+			flash_error(s, fb, SR_WPERR, addr);
+			return;
+		}
+		if (old != 0xFFFF && val) {
+			flash_error(s, fb, SR_PGERR, addr);
+			return;
+		}
+		*cell = val;
+		s->stats.halfword_programs++;
+	}
+	fb->busy_until = s->now + s->program_ns * SIM_NS;
+	fb->sr |= SR_EOP;
+}
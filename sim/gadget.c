@@ -0,0 +1,245 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Exposes the simulated bootloader as a real USB device through the Linux
+ * raw-gadget interface (usually on dummy_hcd), so that dfu-util or the
+ * tools/ flashers can talk to it like to a board.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include "flash_config.h"
+#include "sim.h"
+
+// Events queued by newer kernels only
+#define RAW_EVENT_RESET       5
+#define RAW_EVENT_DISCONNECT  6
+
+static struct sim sim;
+static struct timespec wall0;
+static uint64_t virt0;
+
+struct raw_event {
+	struct usb_raw_event ev;
+	uint8_t data[sizeof(struct usb_ctrlrequest)];
+};
+
+struct raw_io {
+	struct usb_raw_ep_io io;
+	uint8_t data[4096];
+};
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [options]\n", prog);
+	fprintf(stderr, "  -f fw.so    Simulated bootloader build (default: fw.so next to this binary)\n");
+	fprintf(stderr, "  -d driver   UDC driver (default dummy_udc)\n");
+	fprintf(stderr, "  -D device   UDC instance (default dummy_udc.0)\n");
+	fprintf(stderr, "  -i file     Load a flash image (from 0x%08x) before powering on\n", FLASH_BASE_ADDR);
+	fprintf(stderr, "  -o file     Save the flash contents whenever the bootloader starts an image\n");
+	fprintf(stderr, "  -k ms       Keep going: reboot into DFU this long after an image is started\n");
+	fprintf(stderr, "  -v          Log peripheral and USB events\n");
+}
+
+// Virtual time never runs behind the wall clock, so timeouts behave
+static void sync_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t wall = (now.tv_sec - wall0.tv_sec) * 1000000000000ULL + (now.tv_nsec - wall0.tv_nsec) * 1000ULL;
+	if (sim.now - virt0 < wall)
+		sim_advance(&sim, wall - (sim.now - virt0));
+}
+
+static int gadget_open(const char *driver, const char *device) {
+	int fd = open("/dev/raw-gadget", O_RDWR);
+	if (fd < 0) {
+		perror("open /dev/raw-gadget (modprobe raw_gadget dummy_hcd)");
+		return -1;
+	}
+	struct usb_raw_init init;
+	memset(&init, 0, sizeof(init));
+	strncpy((char*)init.driver_name, driver, UDC_NAME_LENGTH_MAX - 1);
+	strncpy((char*)init.device_name, device, UDC_NAME_LENGTH_MAX - 1);
+	init.speed = USB_SPEED_FULL;
+	if (ioctl(fd, USB_RAW_IOCTL_INIT, &init) < 0 || ioctl(fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+		perror("raw-gadget init");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Forwards a control request to the simulated device. OUT data stages are
+// acknowledged by the UDC before the device sees them, so those requests
+// cannot be stalled (DFU reports errors through GETSTATUS anyway).
+static void serve_control(int fd, const struct usb_ctrlrequest *req) {
+	struct raw_io io;
+	uint16_t wLength = req->wLength;
+	memset(&io.io, 0, sizeof(io.io));
+	if (wLength > sizeof(io.data))
+		wLength = sizeof(io.data);
+
+	int ret;
+	if (req->bRequestType & USB_DIR_IN) {
+		ret = sim_usb_control(&sim, req->bRequestType, req->bRequest, req->wValue,
+		                      req->wIndex, io.data, wLength);
+		if (ret >= 0) {
+			io.io.length = ret;
+			if (ioctl(fd, USB_RAW_IOCTL_EP0_WRITE, &io) < 0)
+				perror("ep0 write");
+			return;
+		}
+	} else if (wLength) {
+		io.io.length = wLength;
+		if (ioctl(fd, USB_RAW_IOCTL_EP0_READ, &io) < 0) {
+			perror("ep0 read");
+			return;
+		}
+		sim_usb_control(&sim, req->bRequestType, req->bRequest, req->wValue,
+		                req->wIndex, io.data, wLength);
+		return;
+	} else {
+		ret = sim_usb_control(&sim, req->bRequestType, req->bRequest, req->wValue,
+		                      req->wIndex, NULL, 0);
+		if (ret >= 0) {
+			if (req->bRequestType == USB_DIR_OUT && req->bRequest == USB_REQ_SET_CONFIGURATION) {
+				ioctl(fd, USB_RAW_IOCTL_VBUS_DRAW, 0x32);
+				ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0);
+			}
+			ioctl(fd, USB_RAW_IOCTL_EP0_READ, &io);   // Status stage
+			return;
+		}
+	}
+	ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+}
+
+// Serves the host until the simulated device leaves the bus
+static void serve(int fd) {
+	while (sim_usb_connected(&sim)) {
+		struct raw_event e;
+		e.ev.type = 0;
+		e.ev.length = sizeof(e.data);
+		if (ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, &e) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("raw-gadget event");
+			exit(1);
+		}
+		sync_time();
+
+		switch (e.ev.type) {
+		case USB_RAW_EVENT_CONNECT:
+		case RAW_EVENT_RESET:
+			// The UDC handles SET_ADDRESS, the device gets it here
+			if (sim_usb_reset(&sim, 1) < 0)
+				fprintf(stderr, "Simulated device did not take the bus reset\n");
+			break;
+		case USB_RAW_EVENT_CONTROL:
+			serve_control(fd, (struct usb_ctrlrequest*)e.data);
+			break;
+		case RAW_EVENT_DISCONNECT:
+			return;
+		}
+	}
+}
+
+static void save_flash(const char *fn) {
+	FILE *fd = fopen(fn, "wb");
+	if (!fd || fwrite(sim.flash, 1, sim.flash_kb * 1024, fd) != sim.flash_kb * 1024)
+		fprintf(stderr, "ERROR! Cannot write %s\n", fn);
+	if (fd)
+		fclose(fd);
+}
+
+static const char *default_fw(void) {
+	static char path[PATH_MAX];
+	ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 8);
+	if (n <= 0)
+		return "fw.so";
+	path[n] = 0;
+	strcat(dirname(path), "/fw.so");
+	return path;
+}
+
+int main(int argc, char **argv) {
+	const char *fw = NULL, *driver = "dummy_udc", *device = "dummy_udc.0";
+	const char *image_fn = NULL, *save_fn = NULL;
+	int keep_ms = -1, verbose = 0, opt;
+
+	while ((opt = getopt(argc, argv, "hf:d:D:i:o:k:v")) != -1) {
+		switch (opt) {
+		case 'f': fw = optarg; break;
+		case 'd': driver = optarg; break;
+		case 'D': device = optarg; break;
+		case 'i': image_fn = optarg; break;
+		case 'o': save_fn = optarg; break;
+		case 'k': keep_ms = atoi(optarg); break;
+		case 'v': verbose = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (sim_init(&sim, fw ? fw : default_fw()) < 0)
+		return 1;
+	sim.verbose = verbose;
+	if (image_fn) {
+		FILE *fd = fopen(image_fn, "rb");
+		uint8_t *buf = malloc(sim.flash_kb * 1024);
+		size_t n = fd ? fread(buf, 1, sim.flash_kb * 1024, fd) : 0;
+		if (!n) {
+			fprintf(stderr, "ERROR! Cannot read %s\n", image_fn);
+			return 1;
+		}
+		fclose(fd);
+		sim_flash_load(&sim, FLASH_BASE_ADDR, buf, n);
+		free(buf);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &wall0);
+	sim_power_on(&sim);
+	virt0 = sim.now;
+	if (sim.state == SIM_APP)
+		sim_reboot_into_dfu(&sim);
+
+	for (;;) {
+		if (sim_usb_connected(&sim)) {
+			int fd = gadget_open(driver, device);
+			if (fd < 0)
+				return 1;
+			printf("Bootloader connected to %s\n", device);
+			serve(fd);
+			close(fd);   // Unbinding is what the host sees as a disconnect
+		}
+		sync_time();
+
+		if (sim.state == SIM_APP) {
+			printf("Bootloader started the image at 0x%08x (%.3fs)\n", sim.app_addr, sim_seconds(&sim));
+			if (save_fn)
+				save_flash(save_fn);
+			if (keep_ms < 0)
+				return 0;
+			struct timespec ts = { keep_ms / 1000, (keep_ms % 1000) * 1000000L };
+			nanosleep(&ts, NULL);
+			sync_time();
+			sim_reboot_into_dfu(&sim);
+		} else if (sim.state == SIM_HALTED) {
+			fprintf(stderr, "Device halted: %s\n", sim.halt_reason);
+			return 1;
+		} else if (!sim_usb_connected(&sim)) {
+			fprintf(stderr, "Device left the bus (%.3fs)\n", sim_seconds(&sim));
+			return 1;
+		}
+	}
+}
@@ -0,0 +1,354 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Peripheral models: RCC, GPIO, SysTick/SCB, IWDG and CRC, plus the
+ * register dispatch. Registers nobody models behave as plain memory.
+ *
+ */
+
+#include <string.h>
+
+#include "sim.h"
+
+// RCC bits
+#define CR_HSION     (1U << 0)
+#define CR_HSIRDY    (1U << 1)
+#define CR_HSEON     (1U << 16)
+#define CR_HSERDY    (1U << 17)
+#define CR_PLLON     (1U << 24)
+#define CR_PLLRDY    (1U << 25)
+#define CSR_LSION    (1U << 0)
+#define CSR_LSIRDY   (1U << 1)
+#define CSR_RMVF     (1U << 24)
+#define CSR_FLAGS    0xFC000000U
+
+#define STK_ENABLE    (1U << 0)
+#define STK_CLKSOURCE (1U << 2)
+#define STK_COUNTFLAG (1U << 16)
+
+#define AIRCR_VECTKEY      0x05FA0000U
+#define AIRCR_SYSRESETREQ  (1U << 2)
+
+#define DEMCR_TRCENA       (1U << 24)
+#define DWT_CYCCNTENA      (1U << 0)
+
+// Plain registers live in the backing memory of the trapped pages
+static uint32_t *plain_reg(struct sim *s, uint32_t addr) {
+	if (addr >= SIM_SCS_BASE)
+		return (uint32_t*)&s->scs[addr - SIM_SCS_BASE];
+	if (addr >= SIM_DWT_BASE)
+		return (uint32_t*)&s->dwt[addr - SIM_DWT_BASE];
+	return (uint32_t*)&s->periph[addr - SIM_PERIPH_BASE];
+}
+
+// SW (the switch is immediate, SWS is derived from it on reads)
+unsigned sim_core_mhz(const struct sim *s) {
+	switch (s->rcc_cfgr & 3) {
+	case 2: {
+		unsigned mul = ((s->rcc_cfgr >> 18) & 0xF) + 2;
+		unsigned src = !(s->rcc_cfgr & (1 << 16)) ? 4 : (s->rcc_cfgr & (1 << 17)) ? 4 : 8;
+		return src * (mul > 16 ? 16 : mul);
+		}
+	default:
+		return 8;  // HSI or the 8MHz crystal
+	}
+}
+
+void periph_reset(struct sim *s, uint32_t cause) {
+	// Plain registers back to zero (PMA and backup registers are memory)
+	memset(s->periph, 0, SIM_PMA_BASE - SIM_PERIPH_BASE);
+	memset(&s->periph[SIM_PMA_BASE + SIM_PAGE - SIM_PERIPH_BASE], 0, SIM_PERIPH_END - SIM_PMA_BASE - SIM_PAGE);
+	memset(s->scs, 0, SIM_PAGE);
+	memset(s->dwt, 0, SIM_PAGE);
+	*plain_reg(s, SIM_RCC + 0x14) = 0x14;   // AHBENR: SRAM and FLITF clocks
+
+	s->rcc_cr = CR_HSION | CR_HSIRDY;
+	s->rcc_cfgr = 0;
+	s->rcc_csr = (cause & SIM_RST_POR) ? cause : (s->rcc_csr & CSR_FLAGS) | cause;
+	for (unsigned i = 0; i < 7; i++) {
+		s->gpio[i].crl = s->gpio[i].crh = 0x44444444;
+		s->gpio[i].odr = 0;
+	}
+	s->stk_csr = s->stk_rvr = 0;
+	s->iwdg_running = s->iwdg_unlocked = 0;
+	s->iwdg_pr = 0;
+	s->iwdg_rlr = 0xFFF;
+	s->crc = 0xFFFFFFFF;
+	s->dwt_ctrl = s->dwt_cyccnt = 0;
+	s->last_read = 0;
+	flash_reset(s);
+	usb_reset(s);
+}
+
+// SysTick counts down from RVR to 0 and sets COUNTFLAG on every wrap
+static uint64_t stk_ticks(struct sim *s) {
+	return (s->cycles - s->stk_base) / ((s->stk_csr & STK_CLKSOURCE) ? 1 : 8);
+}
+
+static uint32_t systick_read(struct sim *s, uint32_t addr, int peek) {
+	uint64_t period = (uint64_t)s->stk_rvr + 1;
+	switch (addr) {
+	case SIM_SYSTICK: {
+		if (!(s->stk_csr & STK_ENABLE))
+			return s->stk_csr;
+		uint64_t wraps = stk_ticks(s) / period;
+		// A spinning wait loop lasts until the next wrap
+		if (!peek && wraps == s->stk_seen && s->last_read) {
+			uint64_t cycles = ((s->stk_seen + 1) * period - stk_ticks(s)) *
+			                  ((s->stk_csr & STK_CLKSOURCE) ? 1 : 8);
+			sim_cycles(s, cycles);
+			wraps = stk_ticks(s) / period;
+		}
+		uint32_t flag = wraps > s->stk_seen ? STK_COUNTFLAG : 0;
+		if (!peek)
+			s->stk_seen = wraps;
+		return s->stk_csr | flag;
+		}
+	case SIM_SYSTICK + 4:
+		return s->stk_rvr;
+	case SIM_SYSTICK + 8: {
+		uint64_t t = stk_ticks(s);
+		return !(s->stk_csr & STK_ENABLE) || !t ? 0 : s->stk_rvr - (t - 1) % period;
+		}
+	}
+	return 0;
+}
+
+static void systick_write(struct sim *s, uint32_t addr, uint32_t val) {
+	switch (addr) {
+	case SIM_SYSTICK:
+		if ((val & STK_ENABLE) && !(s->stk_csr & STK_ENABLE)) {
+			s->stk_base = s->cycles;
+			s->stk_seen = 0;
+		}
+		s->stk_csr = val & 7;
+		break;
+	case SIM_SYSTICK + 4:
+		s->stk_rvr = val & 0xFFFFFF;
+		break;
+	case SIM_SYSTICK + 8:
+		// Any write clears the counter and COUNTFLAG
+		s->stk_base = s->cycles;
+		s->stk_seen = 0;
+		break;
+	}
+}
+
+// The cycle counter runs off the core clock while both enables are set
+static uint32_t dwt_cyccnt(struct sim *s) {
+	if (!(*plain_reg(s, SIM_DEMCR) & DEMCR_TRCENA) || !(s->dwt_ctrl & DWT_CYCCNTENA))
+		return s->dwt_cyccnt;
+	return s->dwt_cyccnt + (uint32_t)(s->cycles - s->dwt_at);
+}
+
+static void dwt_write(struct sim *s, uint32_t addr, uint32_t val) {
+	s->dwt_cyccnt = addr == SIM_DWT_BASE + 4 ? val : dwt_cyccnt(s);
+	s->dwt_at = s->cycles;
+	if (addr == SIM_DWT_BASE)
+		s->dwt_ctrl = val;
+	else if (addr != SIM_DWT_BASE + 4)
+		*plain_reg(s, addr) = val;
+}
+
+static uint32_t rcc_read(struct sim *s, uint32_t off, int peek) {
+	switch (off) {
+	case 0x00: {
+		uint32_t cr = s->rcc_cr;
+		// Polling a starting oscillator or PLL lasts until it is ready
+		if ((cr & CR_HSEON) && s->hse) {
+			if (!peek && s->now < s->hse_on_at + SIM_HSE_STARTUP_NS * SIM_NS)
+				sim_tick(s, s->hse_on_at + SIM_HSE_STARTUP_NS * SIM_NS - s->now);
+			cr |= CR_HSERDY;
+		}
+		if ((cr & CR_PLLON) && (!(s->rcc_cfgr & (1 << 16)) || (cr & CR_HSERDY))) {
+			if (!peek && s->now < s->pll_on_at + SIM_PLL_LOCK_NS * SIM_NS)
+				sim_tick(s, s->pll_on_at + SIM_PLL_LOCK_NS * SIM_NS - s->now);
+			cr |= CR_PLLRDY;
+		}
+		return cr;
+		}
+	case 0x04:
+		// The clock switch is immediate
+		return (s->rcc_cfgr & ~0xCU) | ((s->rcc_cfgr & 3) << 2);
+	case 0x24: {
+		uint32_t csr = s->rcc_csr;
+		if ((csr & CSR_LSION) && s->now >= s->lsi_on_at + SIM_LSI_STARTUP_NS * SIM_NS)
+			csr |= CSR_LSIRDY;
+		return csr;
+		}
+	}
+	return *plain_reg(s, SIM_RCC + off);
+}
+
+static void rcc_write(struct sim *s, uint32_t off, uint32_t val) {
+	switch (off) {
+	case 0x00:
+		if ((val & CR_HSEON) && !(s->rcc_cr & CR_HSEON))
+			s->hse_on_at = s->now;
+		if ((val & CR_PLLON) && !(s->rcc_cr & CR_PLLON))
+			s->pll_on_at = s->now;
+		s->rcc_cr = (val & (CR_HSION | CR_HSEON | CR_PLLON | 0x00F8)) | CR_HSIRDY;
+		break;
+	case 0x04:
+		s->rcc_cfgr = val & ~0xCU;
+		break;
+	case 0x24:
+		if ((val & CSR_LSION) && !(s->rcc_csr & CSR_LSION))
+			s->lsi_on_at = s->now;
+		s->rcc_csr = (s->rcc_csr & CSR_FLAGS) | (val & CSR_LSION);
+		if (val & CSR_RMVF)
+			s->rcc_csr &= ~CSR_FLAGS;
+		break;
+	default:
+		*plain_reg(s, SIM_RCC + off) = val;
+	}
+}
+
+// Input data: outputs read back, inputs see external drive or the pull
+static uint32_t gpio_idr(const struct sim_gpio *g) {
+	uint32_t idr = 0;
+	for (unsigned pin = 0; pin < 16; pin++) {
+		unsigned cfg = ((pin < 8 ? g->crl : g->crh) >> ((pin & 7) * 4)) & 0xF;
+		uint32_t bit = 1U << pin;
+		if (cfg & 3)
+			idr |= g->odr & bit;
+		else if (g->drive & bit)
+			idr |= g->level & bit;
+		else if ((cfg >> 2) == 2)
+			idr |= g->odr & bit;
+	}
+	return idr;
+}
+
+static uint32_t gpio_read(struct sim *s, unsigned port, uint32_t off) {
+	struct sim_gpio *g = &s->gpio[port];
+	switch (off) {
+	case 0x00: return g->crl;
+	case 0x04: return g->crh;
+	case 0x08: return gpio_idr(g);
+	case 0x0C: return g->odr;
+	}
+	return 0;
+}
+
+static void gpio_write(struct sim *s, unsigned port, uint32_t off, uint32_t val) {
+	struct sim_gpio *g = &s->gpio[port];
+	switch (off) {
+	case 0x00: g->crl = val; break;
+	case 0x04: g->crh = val; break;
+	case 0x0C: g->odr = val & 0xFFFF; break;
+	case 0x10: g->odr = (g->odr | (val & 0xFFFF)) & ~(val >> 16); break;
+	case 0x14: g->odr &= ~(val & 0xFFFF); break;
+	}
+}
+
+void sim_gpio_drive(struct sim *s, unsigned port, unsigned pin, int level) {
+	struct sim_gpio *g = &s->gpio[port];
+	g->drive |= 1 << pin;
+	g->level = (g->level & ~(1 << pin)) | (!!level << pin);
+}
+
+int sim_gpio_output(struct sim *s, unsigned port, unsigned pin) {
+	return (s->gpio[port].odr >> pin) & 1;
+}
+
+static void iwdg_write(struct sim *s, uint32_t off, uint32_t val) {
+	switch (off) {
+	case 0x00:
+		switch (val & 0xFFFF) {
+		case 0x5555:
+			s->iwdg_unlocked = 1;
+			return;
+		case 0xCCCC:
+			s->iwdg_running = 1;
+			// Fall through, starting reloads the counter
+		case 0xAAAA: {
+			// 40kHz LSI, prescaler 4 << PR
+			uint64_t ticks = (uint64_t)(s->iwdg_rlr + 1) * (4U << s->iwdg_pr);
+			s->iwdg_deadline = s->now + ticks * 25000000ULL;
+			break;
+			}
+		}
+		s->iwdg_unlocked = 0;
+		break;
+	case 0x04:
+		if (s->iwdg_unlocked)
+			s->iwdg_pr = val & 7;
+		break;
+	case 0x08:
+		if (s->iwdg_unlocked)
+			s->iwdg_rlr = val & 0xFFF;
+		break;
+	}
+}
+
+// CRC-32/MPEG-2, one word at a time like the hardware unit
+static void crc_feed(struct sim *s, uint32_t word) {
+	s->crc ^= word;
+	for (unsigned i = 0; i < 32; i++)
+		s->crc = (s->crc & 0x80000000U) ? (s->crc << 1) ^ 0x04C11DB7U : s->crc << 1;
+}
+
+uint32_t periph_read(struct sim *s, uint32_t addr, int peek) {
+	uint32_t val;
+	if (!peek) {
+		s->stats.mmio_reads++;
+		sim_cycles(s, SIM_ACCESS_CYCLES);
+	}
+
+	if (addr >= SIM_USB && addr < SIM_USB + 0x400)
+		val = usb_reg_read(s, addr - SIM_USB, peek);
+	else if (addr >= SIM_FLASH_REGS && addr < SIM_FLASH_REGS + 0x400)
+		val = flash_reg_read(s, addr - SIM_FLASH_REGS, peek);
+	else if (addr >= SIM_RCC && addr < SIM_RCC + 0x400)
+		val = rcc_read(s, addr - SIM_RCC, peek);
+	else if (addr >= SIM_GPIO && addr < SIM_GPIO + 7 * 0x400)
+		val = gpio_read(s, (addr - SIM_GPIO) / 0x400, addr & 0x3FF);
+	else if (addr >= SIM_SYSTICK && addr < SIM_SYSTICK + 0x10)
+		val = systick_read(s, addr, peek);
+	else if (addr >= SIM_IWDG && addr < SIM_IWDG + 0x400)
+		val = (addr & 0x3FF) == 0x04 ? s->iwdg_pr : (addr & 0x3FF) == 0x08 ? s->iwdg_rlr : 0;
+	else if (addr == SIM_CRC)
+		val = s->crc;
+	else if (addr == SIM_DWT_BASE)
+		val = s->dwt_ctrl;
+	else if (addr == SIM_DWT_BASE + 4)
+		val = dwt_cyccnt(s);
+	else
+		val = *plain_reg(s, addr);
+
+	if (!peek)
+		s->last_read = 1;
+	return val;
+}
+
+void periph_write(struct sim *s, uint32_t addr, uint32_t val) {
+	s->stats.mmio_writes++;
+	s->last_read = 0;
+	sim_cycles(s, SIM_ACCESS_CYCLES);
+
+	if (addr >= SIM_USB && addr < SIM_USB + 0x400)
+		usb_reg_write(s, addr - SIM_USB, val);
+	else if (addr >= SIM_FLASH_REGS && addr < SIM_FLASH_REGS + 0x400)
+		flash_reg_write(s, addr - SIM_FLASH_REGS, val);
+	else if (addr >= SIM_RCC && addr < SIM_RCC + 0x400)
+		rcc_write(s, addr - SIM_RCC, val);
+	else if (addr >= SIM_GPIO && addr < SIM_GPIO + 7 * 0x400)
+		gpio_write(s, (addr - SIM_GPIO) / 0x400, addr & 0x3FF, val);
+	else if (addr >= SIM_SYSTICK && addr < SIM_SYSTICK + 0x10)
+		systick_write(s, addr, val);
+	else if (addr >= SIM_IWDG && addr < SIM_IWDG + 0x400)
+		iwdg_write(s, addr & 0x3FF, val);
+	else if (addr == SIM_CRC)
+		crc_feed(s, val);
+	else if (addr == SIM_CRC + 8) {
+		if (val & 1)
+			s->crc = 0xFFFFFFFF;
+	} else if (addr == SIM_DEMCR || (addr >= SIM_DWT_BASE && addr < SIM_DWT_BASE + SIM_PAGE)) {
+		// Latch the counter before its enables change
+		dwt_write(s, addr, val);
+	} else if (addr == SIM_SCB_AIRCR) {
+		if ((val & 0xFFFF0000U) == AIRCR_VECTKEY && (val & AIRCR_SYSRESETREQ))
+			sim_system_reset(s, SIM_RST_SOFTWARE | SIM_RST_PIN);
+	} else
+		*plain_reg(s, addr) = val;
+}
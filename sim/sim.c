@@ -0,0 +1,258 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Native execution: memory map, peripheral access trapping and the device
+ * thread running the firmware (fw.so).
+ *
+ * The firmware keeps its raw MMIO accesses. Flash, system memory, SRAM and
+ * the peripheral space are mapped at their STM32 addresses; peripheral
+ * pages are inaccessible, so every register access faults. The fault
+ * handler asks the models for the register value, lets the instruction run
+ * alone (x86 trap flag) and hands any written value to the models. Flash
+ * and option bytes are read-only mappings, so only program cycles trap.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <sys/mman.h>
+
+#include "flash_config.h"
+#include "sim.h"
+
+#ifndef __x86_64__
+#error "The simulator single steps trapped accesses, only x86-64 hosts are supported"
+#endif
+
+#define TRAP_FLAG 0x100
+
+enum { R_NONE, R_FLASH, R_SYSMEM, R_SRAM, R_PERIPH };
+
+// Only one simulated device per process (signal handlers are global)
+static struct sim *cur;
+
+static int region_of(uintptr_t a, int *prot) {
+	if (a >= SIM_FLASH_BASE && a < SIM_FLASH_BASE + cur->flash_kb * 1024) {
+		*prot = PROT_READ;
+		return R_FLASH;
+	}
+	if (a >= SIM_SYSMEM_BASE && a < SIM_SYSMEM_BASE + SIM_PAGE) {
+		*prot = PROT_READ;
+		return R_SYSMEM;
+	}
+	if ((a >= SIM_PERIPH_BASE && a < SIM_PERIPH_END && (a & ~(SIM_PAGE - 1)) != SIM_PMA_BASE) ||
+	    (a >= SIM_SCS_BASE && a < SIM_SCS_BASE + SIM_PAGE) ||
+	    (a >= SIM_DWT_BASE && a < SIM_DWT_BASE + SIM_PAGE)) {
+		*prot = PROT_NONE;
+		return R_PERIPH;
+	}
+	return R_NONE;
+}
+
+static void fatal_fault(int sig, uintptr_t a) {
+	char msg[96];
+	int n = snprintf(msg, sizeof(msg), "sim: unexpected %s at 0x%lx\n",
+	                 sig == SIGSEGV ? "memory access" : "trap", (unsigned long)a);
+	if (write(2, msg, n) < 0) {}
+	signal(sig, SIG_DFL);  // Faults again on return, with a core dump
+}
+
+static void on_segv(int sig, siginfo_t *si, void *ctx) {
+	ucontext_t *uc = ctx;
+	struct sim *s = cur;
+	uintptr_t a = (uintptr_t)si->si_addr;
+	int prot, kind = s ? region_of(a, &prot) : R_NONE;
+	if (kind == R_NONE || s->step.active || !pthread_equal(pthread_self(), s->thread)) {
+		fatal_fault(sig, a);
+		return;
+	}
+
+	if (s->reset_pending)
+		sim_system_reset(s, s->reset_pending);
+
+	int write = uc->uc_mcontext.gregs[REG_ERR] & 2;
+	uint32_t word = a & ~3U, val = 0;
+	if (kind == R_PERIPH)
+		val = periph_read(s, word, write);
+
+	s->step.active = 1;
+	s->step.write = write;
+	s->step.addr = a;
+	s->step.page = a & ~(uintptr_t)(SIM_PAGE - 1);
+	s->step.prot = prot;
+	mprotect((void*)s->step.page, SIM_PAGE, PROT_READ | PROT_WRITE);
+	if (kind == R_PERIPH)
+		*(volatile uint32_t*)(uintptr_t)word = val;
+	s->step.old = *(volatile uint32_t*)(uintptr_t)word;
+
+	uc->uc_mcontext.gregs[REG_EFL] |= TRAP_FLAG;
+}
+
+static void on_trap(int sig, siginfo_t *si, void *ctx) {
+	ucontext_t *uc = ctx;
+	struct sim *s = cur;
+	if (!s || !s->step.active) {
+		fatal_fault(sig, (uintptr_t)si->si_addr);
+		return;
+	}
+	uc->uc_mcontext.gregs[REG_EFL] &= ~TRAP_FLAG;
+
+	uint32_t word = s->step.addr & ~3U;
+	uint32_t val = *(volatile uint32_t*)(uintptr_t)word;
+	mprotect((void*)s->step.page, SIM_PAGE, s->step.prot);
+	s->step.active = 0;
+
+	// Read-modify-write instructions may report a read fault
+	if (!s->step.write && val == s->step.old)
+		return;
+
+	if (s->step.prot == PROT_NONE) {
+		periph_write(s, word, val);
+		return;
+	}
+
+	// Flash array or option bytes, one program cycle per halfword
+	for (unsigned i = 0; i < 2; i++) {
+		uint32_t haddr = word + i * 2;
+		uint16_t o = s->step.old >> (i * 16), n = val >> (i * 16);
+		if (o != n || haddr == (s->step.addr & ~1U))
+			flash_array_write(s, haddr, o, n);
+	}
+}
+
+// Maps a region at its STM32 address plus a writable alias for the models
+static uint8_t *map_region(uint32_t addr, size_t len, int prot, const char *name) {
+	int fd = memfd_create(name, 0);
+	if (fd < 0 || ftruncate(fd, len) < 0)
+		return NULL;
+	void *p = mmap((void*)(uintptr_t)addr, len, prot, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	void *alias = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p != (void*)(uintptr_t)addr || alias == MAP_FAILED) {
+		fprintf(stderr, "sim: cannot map %s at 0x%08x\n", name, addr);
+		return NULL;
+	}
+	return alias;
+}
+
+// Firmware writable segments, saved after loading and restored on reset so
+// every boot starts from a fresh .data/.bss (like the reset handler does).
+static int find_fw_segments(struct dl_phdr_info *info, size_t size, void *arg) {
+	struct sim *s = arg;
+	(void)size;
+	uintptr_t sym = (uintptr_t)s->fw_main;
+	int found = 0;
+	for (unsigned i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+		uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+		if (ph->p_type == PT_LOAD && sym >= start && sym < start + ph->p_memsz)
+			found = 1;
+	}
+	if (!found)
+		return 0;
+
+	for (unsigned i = 0; i < info->dlpi_phnum && s->fw_nsegs < 4; i++) {
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+		if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_W))
+			continue;
+		s->fw_seg[s->fw_nsegs].addr = (uint8_t*)(info->dlpi_addr + ph->p_vaddr);
+		s->fw_seg[s->fw_nsegs].len = ph->p_memsz;
+		s->fw_seg[s->fw_nsegs].copy = malloc(ph->p_memsz);
+		memcpy(s->fw_seg[s->fw_nsegs].copy, s->fw_seg[s->fw_nsegs].addr, ph->p_memsz);
+		s->fw_nsegs++;
+	}
+	return 1;
+}
+
+static void fw_restore(struct sim *s) {
+	// Page by page, RELRO pages never change (and are read-only)
+	for (unsigned i = 0; i < s->fw_nsegs; i++) {
+		uint8_t *p = s->fw_seg[i].addr, *end = p + s->fw_seg[i].len;
+		const uint8_t *src = s->fw_seg[i].copy;
+		while (p < end) {
+			uint8_t *next = (uint8_t*)(((uintptr_t)p + SIM_PAGE) & ~(uintptr_t)(SIM_PAGE - 1));
+			size_t n = (next < end ? next : end) - p;
+			if (memcmp(p, src, n))
+				memcpy(p, src, n);
+			p += n;
+			src += n;
+		}
+	}
+}
+
+// Resets the models and starts over from the reset handler
+void sim_system_reset(struct sim *s, uint32_t cause) {
+	sim_reset_models(s, cause);
+	siglongjmp(s->boot_jmp, 1);
+}
+
+// Called by the firmware instead of jumping to an image (see main.c)
+void sim_start_image(uint32_t addr) {
+	struct sim *s = cur;
+	s->app_addr = addr;
+	s->app_sp = *(volatile uint32_t*)(uintptr_t)addr;
+	s->app_pc = *(volatile uint32_t*)(uintptr_t)(addr + 4);
+	sim_log(s, "jump to image at 0x%08x (SP 0x%08x, PC 0x%08x)", addr, s->app_sp, s->app_pc);
+	sim_device_halt(s, SIM_APP);
+}
+
+static void *device_thread(void *arg) {
+	struct sim *s = arg;
+	sem_wait(&s->dev_go);
+	if (!sigsetjmp(s->boot_jmp, 1))
+		sim_reset_models(s, s->reset_pending);
+
+	fw_restore(s);
+	s->fw_boot();
+	s->fw_main();
+	snprintf(s->halt_reason, sizeof(s->halt_reason), "main() returned");
+	sim_device_halt(s, SIM_HALTED);
+	return NULL;
+}
+
+int sim_init(struct sim *s, const char *fw_path) {
+	sim_config(s, fw_path);
+	cur = s;
+
+	s->flash = map_region(SIM_FLASH_BASE, s->flash_kb * 1024, PROT_READ, "flash");
+	s->sysmem = map_region(SIM_SYSMEM_BASE, SIM_PAGE, PROT_READ, "sysmem");
+	s->periph = map_region(SIM_PERIPH_BASE, SIM_PERIPH_END - SIM_PERIPH_BASE, PROT_NONE, "periph");
+	s->scs = map_region(SIM_SCS_BASE, SIM_PAGE, PROT_NONE, "scs");
+	s->dwt = map_region(SIM_DWT_BASE, SIM_PAGE, PROT_NONE, "dwt");
+	void *ram = mmap((void*)(uintptr_t)SIM_SRAM_BASE, SIM_SRAM_SIZE, PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (!s->flash || !s->sysmem || !s->periph || !s->scs || !s->dwt || ram != (void*)(uintptr_t)SIM_SRAM_BASE)
+		return -1;
+	mprotect((void*)(uintptr_t)SIM_PMA_BASE, SIM_PAGE, PROT_READ | PROT_WRITE);
+	s->sram = ram;
+	sim_blank(s);
+
+	s->fw = dlopen(fw_path, RTLD_NOW | RTLD_LOCAL);
+	if (!s->fw) {
+		fprintf(stderr, "sim: %s\n", dlerror());
+		return -1;
+	}
+	s->fw_boot = (void (*)(void))dlsym(s->fw, "boot_app_if_valid");
+	s->fw_main = (int (*)(void))dlsym(s->fw, "main");
+	if (!s->fw_boot || !s->fw_main) {
+		fprintf(stderr, "sim: %s is not a bootloader build\n", fw_path);
+		return -1;
+	}
+	dl_iterate_phdr(find_fw_segments, s);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_flags = SA_SIGINFO;
+	sa.sa_sigaction = on_segv;
+	sigaction(SIGSEGV, &sa, NULL);
+	sa.sa_sigaction = on_trap;
+	sigaction(SIGTRAP, &sa, NULL);
+
+	return sim_start_device(s, device_thread);
+}
@@ -0,0 +1,223 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Host (Linux x86-64) simulator for the DFU bootloader: the real main.c and
+ * usb.c run natively against models of the STM32F103 peripherals.
+ *
+ */
+
+#ifndef __SIM__HH__
+#define __SIM__HH__
+
+#include <stdint.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+// STM32F103 memory map, mapped at the same addresses in the host process
+#define SIM_FLASH_BASE     0x08000000U
+#define SIM_SYSMEM_BASE    0x1FFFF000U
+#define SIM_FLASH_SIZE_REG 0x1FFFF7E0U
+#define SIM_UNIQUE_ID      0x1FFFF7E8U
+#define SIM_OPTBYTES       0x1FFFF800U
+#define SIM_SRAM_BASE      0x20000000U
+#define SIM_SRAM_SIZE      (20*1024)
+#define SIM_PERIPH_BASE    0x40000000U
+#define SIM_PERIPH_END     0x40024000U
+#define SIM_PMA_BASE       0x40006000U    // USB PMA and backup registers page
+#define SIM_DWT_BASE       0xE0001000U
+#define SIM_SCS_BASE       0xE000E000U
+#define SIM_PAGE           4096U
+
+// Peripheral register blocks
+#define SIM_IWDG           0x40003000U
+#define SIM_USB            0x40005C00U
+#define SIM_GPIO           0x40010800U
+#define SIM_RCC            0x40021000U
+#define SIM_FLASH_REGS     0x40022000U
+#define SIM_CRC            0x40023000U
+#define SIM_SYSTICK        0xE000E010U
+#define SIM_SCB_AIRCR      0xE000ED0CU
+#define SIM_DEMCR          0xE000EDFCU
+
+// Timing model (typical datasheet figures, flash ones can be changed)
+#define SIM_ACCESS_CYCLES         4        // Core cycles per peripheral access
+#define SIM_FLASH_ERASE_NS        20000000 // Page (and option bytes) erase
+#define SIM_FLASH_PROGRAM_NS      52500    // Halfword program
+#define SIM_HSE_STARTUP_NS        1000000
+#define SIM_PLL_LOCK_NS           200000
+#define SIM_LSI_STARTUP_NS        85000
+#define SIM_USB_CONNECT_NS        100000000  // Host debounce after attach
+#define SIM_USB_RESET_NS          10000000
+#define SIM_USB_TIMEOUT_NS        5000000000ULL
+#define SIM_USB_FRAME_NS          1000000
+
+#define SIM_NS  1000ULL   // Virtual time is kept in picoseconds
+
+// RCC_CSR reset flags, used as reset causes
+#define SIM_RST_PIN        (1U << 26)
+#define SIM_RST_POR        (1U << 27)
+#define SIM_RST_SOFTWARE   (1U << 28)
+#define SIM_RST_IWDG       (1U << 29)
+
+// USB transfer errors (negated)
+#define SIM_USB_STALL      32   // EPIPE
+#define SIM_USB_NODEV      19   // ENODEV
+#define SIM_USB_TIMEOUT    110  // ETIMEDOUT
+
+enum sim_state {
+	SIM_OFF,
+	SIM_RUNNING,      // Running the bootloader
+	SIM_APP,          // Jumped to an image, waits for a reset
+	SIM_HALTED,       // main() returned or the firmware did something fatal
+};
+
+struct sim_stats {
+	uint64_t mmio_reads, mmio_writes;
+	unsigned page_erases, optbyte_erases, halfword_programs, optbyte_programs;
+	unsigned flash_errors;
+	unsigned usb_setups, usb_in, usb_out, usb_naks, usb_bytes_in, usb_bytes_out;
+	unsigned usb_errors;          // Corrupted packets (retried by the host)
+	unsigned resets;
+};
+
+struct sim_flash_bank {
+	uint32_t cr, sr, ar;
+	int key_stage, optkey_stage, key_error;
+	uint64_t busy_until;
+};
+
+struct sim_usb {
+	uint16_t ep[8];
+	uint16_t cntr, istr, daddr, btable;
+	int attached;       // Peripheral powered (pull-up on)
+	uint8_t addr;       // Address the host talks to
+	uint8_t mps0;       // bMaxPacketSize0 as read by the host
+	unsigned packets;   // Data packets sent so far (error injection)
+};
+
+struct sim_gpio {
+	uint32_t crl, crh, odr;
+	uint16_t drive, level;   // Pins driven from outside and their levels
+};
+
+struct sim {
+	// Configuration
+	unsigned flash_kb, page_size;
+	int xl_banks;            // Two flash banks (XL-density)
+	int hse;                 // Crystal fitted
+	uint32_t erase_ns, program_ns;   // Flash page erase and halfword program times
+	unsigned usb_error_every;        // Corrupt every Nth data packet (0: never, else 2 or more)
+	uint8_t unique_id[12];
+	const char *fw_path;
+	int verbose;
+
+	// Virtual clock (ps) and core cycle count
+	uint64_t now, cycles, cycle_rem;
+
+	// Device thread and the host/device hand over
+	pthread_t thread;
+	sem_t dev_go, host_go;
+	sigjmp_buf boot_jmp;
+	volatile enum sim_state state;
+	uint32_t reset_pending;  // Reset cause flags, applied by the device thread
+	uint32_t app_addr, app_sp, app_pc;
+	char halt_reason[96];
+
+	// Firmware (shared object, restored on every reset)
+	void *fw;
+	void (*fw_boot)(void);
+	int (*fw_main)(void);
+	struct { uint8_t *addr, *copy; size_t len; } fw_seg[4];
+	unsigned fw_nsegs;
+
+	// Memory (writable aliases of the fixed mappings)
+	uint8_t *flash, *sysmem, *sram, *periph, *scs, *dwt;
+
+	// Single stepped access in progress
+	struct {
+		int active, write;
+		uint32_t addr;
+		uintptr_t page;
+		int prot;
+		uint32_t old;
+	} step;
+	int last_read;           // Previous peripheral access was a read
+
+	// Peripheral models
+	uint32_t rcc_cr, rcc_cfgr, rcc_csr;
+	uint64_t hse_on_at, pll_on_at, lsi_on_at;
+	struct sim_flash_bank fl[2];
+	struct sim_usb usb;
+	struct sim_gpio gpio[7];       // GPIOA to GPIOG
+	uint32_t stk_csr, stk_rvr;
+	uint64_t stk_base, stk_seen;
+	uint32_t iwdg_pr, iwdg_rlr;
+	int iwdg_unlocked, iwdg_running;
+	uint64_t iwdg_deadline;
+	uint32_t crc;
+	uint32_t dwt_ctrl, dwt_cyccnt;   // CYCCNT as of dwt_at
+	uint64_t dwt_at;
+
+	struct sim_stats stats;
+};
+
+// Setup, fw_path is the firmware shared object (fw.so)
+int sim_init(struct sim *s, const char *fw_path);
+// Power on (or power cycle) and run until the device waits for the host
+void sim_power_on(struct sim *s);
+// Resets with the given RCC_CSR cause flags (SIM_RST_*)
+void sim_reset(struct sim *s, uint32_t cause);
+// Sets the DFU reboot flag (like an app would) and resets
+void sim_reboot_into_dfu(struct sim *s);
+// Lets the device run until it is idle (waiting for USB traffic)
+void sim_run(struct sim *s);
+// Host side time passing (the device is idle meanwhile)
+void sim_advance(struct sim *s, uint64_t ps);
+double sim_seconds(const struct sim *s);
+
+// Debugger style access to flash and RAM
+void sim_flash_load(struct sim *s, uint32_t addr, const void *data, unsigned len);
+void sim_gpio_drive(struct sim *s, unsigned port, unsigned pin, int level);
+int sim_gpio_output(struct sim *s, unsigned port, unsigned pin);
+
+// Host side of the USB bus: connects, resets and enumerates the device
+int sim_usb_enumerate(struct sim *s);
+// Bus reset, then SET_ADDRESS (what hosts do before anything else)
+int sim_usb_reset(struct sim *s, uint8_t addr);
+// Whether the device is running the bootloader with USB connected
+int sim_usb_connected(const struct sim *s);
+// Control transfer, returns the data stage length or -SIM_USB_*
+int sim_usb_control(struct sim *s, uint8_t bmRequestType, uint8_t bRequest,
+                    uint16_t wValue, uint16_t wIndex, uint8_t *data, uint16_t wLength);
+
+// Internal: core (core.c)
+void sim_tick(struct sim *s, uint64_t ps);
+void sim_cycles(struct sim *s, unsigned cycles);
+void sim_log(struct sim *s, const char *fmt, ...);
+void sim_config(struct sim *s, const char *fw_path);
+void sim_blank(struct sim *s);
+int sim_start_device(struct sim *s, void *(*device_thread)(void *));
+void sim_reset_models(struct sim *s, uint32_t cause);
+void sim_device_yield(struct sim *s);
+void sim_device_halt(struct sim *s, enum sim_state state);
+
+// Internal: execution (sim.c)
+void sim_system_reset(struct sim *s, uint32_t cause);
+
+// Internal: peripheral models (periph.c, flash_model.c, usb_model.c)
+unsigned sim_core_mhz(const struct sim *s);
+
+void periph_reset(struct sim *s, uint32_t cause);
+uint32_t periph_read(struct sim *s, uint32_t addr, int peek);
+void periph_write(struct sim *s, uint32_t addr, uint32_t val);
+
+void flash_reset(struct sim *s);
+uint32_t flash_reg_read(struct sim *s, uint32_t off, int peek);
+void flash_reg_write(struct sim *s, uint32_t off, uint32_t val);
+void flash_array_write(struct sim *s, uint32_t addr, uint16_t old, uint16_t val);
+
+void usb_reset(struct sim *s);
+uint32_t usb_reg_read(struct sim *s, uint32_t off, int peek);
+void usb_reg_write(struct sim *s, uint32_t off, uint32_t val);
+
+#endif
@@ -0,0 +1,357 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * USB full speed device peripheral model plus the host side of the bus:
+ * SETUP/OUT/IN transactions, control transfers and enumeration.
+ *
+ */
+
+#include <string.h>
+
+#include "sim.h"
+
+#define EP_CTR_RX    0x8000
+#define EP_DTOG_RX   0x4000
+#define EP_STAT_RX   0x3000
+#define EP_SETUP     0x0800
+#define EP_TYPE_KIND 0x0700
+#define EP_CTR_TX    0x0080
+#define EP_DTOG_TX   0x0040
+#define EP_STAT_TX   0x0030
+#define EP_ADDR      0x000F
+#define EP_TOGGLES   (EP_DTOG_RX | EP_STAT_RX | EP_DTOG_TX | EP_STAT_TX)
+
+#define STAT_RX(st)  ((st) << 12)
+#define STAT_TX(st)  ((st) << 4)
+enum { STAT_DISABLED, STAT_STALL, STAT_NAK, STAT_VALID };
+
+#define CNTR_FRES    0x0001
+#define CNTR_PDWN    0x0002
+#define ISTR_CTR     0x8000
+#define ISTR_ERR     0x2000
+#define ISTR_RESET   0x0400
+#define ISTR_FLAGS   0x7F00
+#define ISTR_DIR     0x0010
+#define DADDR_EF     0x0080
+
+#define USB_BIT_PS   83333ULL   // 12Mbit/s
+
+enum { ACK, NAK, STALL, NORESP, CRCERR };
+
+// Packet memory: 16 bit words at 32 bit strides (local address a at a * 2)
+static volatile uint16_t *pma(struct sim *s, uint16_t a) {
+	return (volatile uint16_t*)&s->periph[SIM_PMA_BASE - SIM_PERIPH_BASE + (a & 0x3FE) * 2];
+}
+
+static uint16_t btable(struct sim *s, unsigned ep, unsigned entry) {
+	return *pma(s, s->usb.btable + ep * 8 + entry);
+}
+
+static void pma_write(struct sim *s, uint16_t a, const uint8_t *data, unsigned len) {
+	for (unsigned i = 0; i < len; i += 2)
+		*pma(s, a + i) = data[i] | (i + 1 < len ? data[i + 1] << 8 : 0);
+}
+
+static void pma_read(struct sim *s, uint16_t a, uint8_t *data, unsigned len) {
+	for (unsigned i = 0; i < len; i++)
+		data[i] = *pma(s, a + (i & ~1U)) >> ((i & 1) * 8);
+}
+
+static unsigned rx_capacity(uint16_t count) {
+	unsigned blocks = (count >> 10) & 0x1F;
+	return (count & 0x8000) ? (blocks + 1) * 32 : blocks * 2;
+}
+
+static void set_stat(struct sim_usb *u, unsigned ep, uint16_t mask, uint16_t stat) {
+	u->ep[ep] = (u->ep[ep] & ~mask) | stat;
+}
+
+int sim_usb_connected(const struct sim *s) {
+	return s->usb.attached && s->state == SIM_RUNNING;
+}
+
+void usb_reset(struct sim *s) {
+	memset(s->usb.ep, 0, sizeof(s->usb.ep));
+	s->usb.cntr = CNTR_PDWN | CNTR_FRES;
+	s->usb.istr = s->usb.daddr = s->usb.btable = 0;
+	if (s->usb.attached)
+		sim_log(s, "usb: disconnected");
+	s->usb.attached = 0;
+	s->usb.addr = 0;
+}
+
+static uint16_t usb_istr(struct sim *s) {
+	uint16_t istr = s->usb.istr;
+	for (unsigned ep = 0; ep < 8; ep++) {
+		if (s->usb.ep[ep] & (EP_CTR_RX | EP_CTR_TX)) {
+			istr |= ISTR_CTR | ep | ((s->usb.ep[ep] & EP_CTR_RX) ? ISTR_DIR : 0);
+			break;
+		}
+	}
+	return istr;
+}
+
+uint32_t usb_reg_read(struct sim *s, uint32_t off, int peek) {
+	if (off < 0x20)
+		return (off & 3) ? 0 : s->usb.ep[off / 4];
+	switch (off) {
+	case 0x40:
+		return s->usb.cntr;
+	case 0x44: {
+		// Nothing to do: the device is idle until the host does something.
+		// Flags masked in CNTR are never looked at by the bootloader.
+		uint16_t istr = usb_istr(s);
+		if (!peek && !(istr & (ISTR_CTR | (ISTR_FLAGS & s->usb.cntr)))) {
+			sim_device_yield(s);
+			istr = usb_istr(s);
+		}
+		return istr;
+		}
+	case 0x48:
+		return (s->now / (SIM_USB_FRAME_NS * SIM_NS)) & 0x7FF;
+	case 0x4C:
+		return s->usb.daddr;
+	case 0x50:
+		return s->usb.btable;
+	}
+	return 0;
+}
+
+void usb_reg_write(struct sim *s, uint32_t off, uint32_t val) {
+	struct sim_usb *u = &s->usb;
+	if (off < 0x20) {
+		if (off & 3)
+			return;
+		// CTR bits: 0 clears, 1 keeps. Toggle bits: 1 toggles. SETUP is read only
+		uint16_t ep = u->ep[off / 4];
+		ep &= (val | ~(EP_CTR_RX | EP_CTR_TX));
+		ep ^= val & EP_TOGGLES;
+		ep = (ep & ~(EP_TYPE_KIND | EP_ADDR)) | (val & (EP_TYPE_KIND | EP_ADDR));
+		u->ep[off / 4] = ep;
+		return;
+	}
+	switch (off) {
+	case 0x40: {
+		u->cntr = val;
+		int attached = !(val & (CNTR_PDWN | CNTR_FRES));
+		if (attached != u->attached)
+			sim_log(s, "usb: %s", attached ? "connected" : "disconnected");
+		if (!attached)
+			u->addr = 0;
+		u->attached = attached;
+		break;
+		}
+	case 0x44:
+		u->istr &= val | ~ISTR_FLAGS;
+		break;
+	case 0x4C:
+		u->daddr = val & 0xFF;
+		break;
+	case 0x50:
+		u->btable = val & 0xFFF8;
+		break;
+	}
+}
+
+// Bus time of a transaction with a data packet of len bytes (token, data
+// and handshake packets, bit stuffing and turnaround included)
+static void bus_time(struct sim *s, unsigned len) {
+	sim_advance(s, ((len + 10) * 8 * 7 / 6 + 50) * USB_BIT_PS);
+}
+
+// Error injection (marginal cable): the receiver of a corrupted data packet
+// drops it, the device flags ERR and the host retries the transaction
+static int corrupted(struct sim *s) {
+	if (!s->usb_error_every || ++s->usb.packets % s->usb_error_every)
+		return 0;
+	s->usb.istr |= ISTR_ERR;
+	s->stats.usb_errors++;
+	sim_run(s);
+	return 1;
+}
+
+// Endpoint register the device uses for endpoint number 0
+static int find_ep0(struct sim *s) {
+	if (!sim_usb_connected(s) || !(s->usb.daddr & DADDR_EF) || (s->usb.daddr & 0x7F) != s->usb.addr)
+		return -1;
+	for (unsigned i = 0; i < 8; i++)
+		if ((s->usb.ep[i] & EP_ADDR) == 0)
+			return i;
+	return -1;
+}
+
+static int tok_setup(struct sim *s, const uint8_t *req) {
+	int ep = find_ep0(s);
+	bus_time(s, 8);
+	if (ep < 0 || (s->usb.ep[ep] & EP_STAT_RX) == STAT_RX(STAT_DISABLED))
+		return NORESP;
+
+	// SETUP is always accepted, and NAKs both directions
+	pma_write(s, btable(s, ep, 4), req, 8);
+	volatile uint16_t *count = pma(s, s->usb.btable + ep * 8 + 6);
+	*count = (*count & 0xFC00) | 8;
+	s->usb.ep[ep] |= EP_CTR_RX | EP_SETUP;
+	set_stat(&s->usb, ep, EP_STAT_RX | EP_STAT_TX, STAT_RX(STAT_NAK) | STAT_TX(STAT_NAK));
+	s->stats.usb_setups++;
+	sim_run(s);
+	return ACK;
+}
+
+static int tok_out(struct sim *s, const uint8_t *data, unsigned len) {
+	int ep = find_ep0(s);
+	bus_time(s, len);
+	if (ep < 0)
+		return NORESP;
+	switch ((s->usb.ep[ep] & EP_STAT_RX) >> 12) {
+	case STAT_DISABLED: return NORESP;
+	case STAT_STALL:    return STALL;
+	case STAT_NAK:      s->stats.usb_naks++; return NAK;
+	}
+	if (corrupted(s))
+		return CRCERR;
+
+	volatile uint16_t *count = pma(s, s->usb.btable + ep * 8 + 6);
+	if (len > rx_capacity(*count))
+		return STALL;   // Babble, the transfer fails anyway
+	pma_write(s, btable(s, ep, 4), data, len);
+	*count = (*count & 0xFC00) | len;
+	s->usb.ep[ep] = (s->usb.ep[ep] | EP_CTR_RX) & ~EP_SETUP;
+	set_stat(&s->usb, ep, EP_STAT_RX, STAT_RX(STAT_NAK));
+	s->usb.ep[ep] ^= EP_DTOG_RX;
+	s->stats.usb_out++;
+	s->stats.usb_bytes_out += len;
+	sim_run(s);
+	return ACK;
+}
+
+static int tok_in(struct sim *s, uint8_t *data, unsigned maxlen, unsigned *len) {
+	int ep = find_ep0(s);
+	if (ep < 0) {
+		bus_time(s, 0);
+		return NORESP;
+	}
+	switch ((s->usb.ep[ep] & EP_STAT_TX) >> 4) {
+	case STAT_DISABLED: bus_time(s, 0); return NORESP;
+	case STAT_STALL:    bus_time(s, 0); return STALL;
+	case STAT_NAK:      bus_time(s, 0); s->stats.usb_naks++; return NAK;
+	}
+
+	*len = btable(s, ep, 2) & 0x3FF;
+	bus_time(s, *len);
+	if (corrupted(s))
+		return CRCERR;
+	if (*len > maxlen)
+		*len = maxlen;   // Babble, truncated
+	pma_read(s, btable(s, ep, 0), data, *len);
+	s->usb.ep[ep] |= EP_CTR_TX;
+	set_stat(&s->usb, ep, EP_STAT_TX, STAT_TX(STAT_NAK));
+	s->usb.ep[ep] ^= EP_DTOG_TX;
+	s->stats.usb_in++;
+	s->stats.usb_bytes_in += *len;
+	sim_run(s);
+	return ACK;
+}
+
+// NAKed transactions are retried once per frame until the timeout, errors
+// right away
+static int retry_wait(struct sim *s, int res, uint64_t start) {
+	if (res == CRCERR)
+		return 1;
+	if (res != NAK)
+		return res == ACK ? 0 : res == STALL ? -SIM_USB_STALL : sim_usb_connected(s) ? -SIM_USB_TIMEOUT : -SIM_USB_NODEV;
+	if (s->now - start > SIM_USB_TIMEOUT_NS * SIM_NS)
+		return -SIM_USB_TIMEOUT;
+	uint64_t frame = SIM_USB_FRAME_NS * SIM_NS;
+	sim_advance(s, frame - s->now % frame);
+	sim_run(s);
+	return 1;
+}
+
+int sim_usb_control(struct sim *s, uint8_t bmRequestType, uint8_t bRequest,
+                    uint16_t wValue, uint16_t wIndex, uint8_t *data, uint16_t wLength) {
+	if (!sim_usb_connected(s))
+		return -SIM_USB_NODEV;
+
+	const uint8_t req[8] = { bmRequestType, bRequest, wValue, wValue >> 8,
+	                         wIndex, wIndex >> 8, wLength, wLength >> 8 };
+	uint64_t start = s->now;
+	int ret;
+	if (tok_setup(s, req) != ACK)
+		return sim_usb_connected(s) ? -SIM_USB_TIMEOUT : -SIM_USB_NODEV;
+
+	unsigned done = 0, n;
+	uint8_t zlp[1] = { 0 };
+	if (bmRequestType & 0x80) {
+		// Data IN until a short packet or wLength, then a ZLP OUT status
+		while (done < wLength) {
+			while ((ret = retry_wait(s, tok_in(s, &data[done], wLength - done, &n), start)) > 0);
+			if (ret < 0)
+				return ret;
+			done += n;
+			if (n < s->usb.mps0)
+				break;
+		}
+		while ((ret = retry_wait(s, tok_out(s, zlp, 0), start)) > 0);
+	} else {
+		while (done < wLength) {
+			n = wLength - done < s->usb.mps0 ? wLength - done : s->usb.mps0;
+			while ((ret = retry_wait(s, tok_out(s, &data[done], n), start)) > 0);
+			if (ret < 0)
+				return ret;
+			done += n;
+		}
+		while ((ret = retry_wait(s, tok_in(s, zlp, 0, &n), start)) > 0);
+	}
+
+	sim_log(s, "usb: control %02x %02x %04x %04x %u -> %d", bmRequestType, bRequest,
+	        wValue, wIndex, wLength, ret < 0 ? ret : (int)done);
+	return ret < 0 ? ret : (int)done;
+}
+
+int sim_usb_reset(struct sim *s, uint8_t addr) {
+	if (!sim_usb_connected(s))
+		return -SIM_USB_NODEV;
+
+	// Bus reset: the peripheral clears its endpoints and address
+	memset(s->usb.ep, 0, sizeof(s->usb.ep));
+	s->usb.daddr = 0;
+	s->usb.addr = 0;
+	s->usb.istr |= ISTR_RESET;
+	sim_run(s);
+	sim_advance(s, SIM_USB_RESET_NS * SIM_NS);
+	sim_run(s);
+
+	// Device descriptor header (for bMaxPacketSize0), then SET_ADDRESS
+	uint8_t desc[64];
+	int ret;
+	s->usb.mps0 = 64;
+	if ((ret = sim_usb_control(s, 0x80, 6, 0x0100, 0, desc, 64)) < 0)
+		return ret;
+	if (ret < 8)
+		return -SIM_USB_TIMEOUT;
+	s->usb.mps0 = desc[7];
+
+	if ((ret = sim_usb_control(s, 0x00, 5, addr, 0, NULL, 0)) < 0)
+		return ret;
+	s->usb.addr = addr;
+	sim_advance(s, 2 * SIM_USB_FRAME_NS * SIM_NS);   // SET_ADDRESS recovery
+	return 0;
+}
+
+int sim_usb_enumerate(struct sim *s) {
+	if (!sim_usb_connected(s))
+		return -SIM_USB_NODEV;
+
+	sim_advance(s, SIM_USB_CONNECT_NS * SIM_NS);   // Debounce
+	int ret = sim_usb_reset(s, 1);
+	if (ret < 0)
+		return ret;
+
+	uint8_t desc[256];
+	if ((ret = sim_usb_control(s, 0x80, 6, 0x0100, 0, desc, 18)) < 0 ||
+	    (ret = sim_usb_control(s, 0x80, 6, 0x0200, 0, desc, 9)) < 0 ||
+	    (ret = sim_usb_control(s, 0x80, 6, 0x0200, 0, desc, desc[2] | desc[3] << 8)) < 0 ||
+	    (ret = sim_usb_control(s, 0x00, 9, 1, 0, NULL, 0)) < 0)
+		return ret;
+	sim_log(s, "usb: enumerated, bMaxPacketSize0 %u", s->usb.mps0);
+	return 0;
+}
@@ -0,0 +1,77 @@
+
+// Dual slot (A/B) image support //
+//
+// The payload area is split in two equally sized slots, each image must be
+// linked for the slot it is written to (they are executed in place). Both
+// use the usual header: checksum at 0x1C, size (in words) at 0x20, plus a
+// sequence number at 0x24 that tells which one is newer.
+
+#define SLOT_SIZE      (FLASH_SLOT_SIZE_KB*1024)
+#define SLOT_ADDR(n)   (APP_ADDRESS + (n) * SLOT_SIZE)
+#define slot_of(addr)  ((addr) >= SLOT_ADDR(1))
+
+// Unconfirmed boots allowed before a new image is dropped.
+#ifndef SLOT_TRIAL_MAX
+#define SLOT_TRIAL_MAX 3
+#endif
+
+bool validate_checksum(const uint32_t * const image, unsigned size);
+
+static int slot_is_valid(unsigned slot) {
+	const uint32_t *img = (uint32_t*)SLOT_ADDR(slot);
+	uint32_t size = img[0x20 / 4];
+	return (img[0] & 0x2FFE0000) == 0x20000000 &&
+	       size > 0x28 / 4 && size <= SLOT_SIZE / 4 &&
+	       validate_checksum(img, size);
+}
+
+// Returns the slot holding the newest valid image, or -1 if none.
+static int slot_newest_valid() {
+	int va = slot_is_valid(0), vb = slot_is_valid(1);
+	if (va && vb) {
+		// Sequence numbers are compared with wrap-around.
+		uint32_t seqa = ((uint32_t*)SLOT_ADDR(0))[0x24 / 4];
+		uint32_t seqb = ((uint32_t*)SLOT_ADDR(1))[0x24 / 4];
+		return (int32_t)(seqb - seqa) > 0 ? 1 : 0;
+	}
+	return va ? 0 : vb ? 1 : -1;
+}
+
+// Picks the slot to boot and accounts for trial boots of a new image, that
+// is dropped (first page erased) if it was never confirmed by the app.
+// Returns the slot address or 0 if there's nothing to boot.
+static uint32_t slot_boot_select() {
+	int slot = slot_newest_valid();
+	uint16_t trial = boot_slot_trial_read();
+
+	if (trial & BOOT_SLOT_TRIAL_PENDING) {
+		if (slot < 0 || !!(trial & BOOT_SLOT_TRIAL_SLOT_B) != slot) {
+			// The image on trial is not the one booted (invalid, or its
+			// sequence number is not the newest), so the trial is over.
+			boot_slot_trial_write(0);
+		} else if ((trial & BOOT_SLOT_TRIAL_COUNT) >= SLOT_TRIAL_MAX) {
+			_flash_unlock();
+			_flash_erase_page(SLOT_ADDR(slot));
+			_flash_lock();
+			boot_slot_trial_write(0);
+			slot = slot_newest_valid();
+		} else
+			boot_slot_trial_write(trial + 1);
+	}
+
+	return slot < 0 ? 0 : SLOT_ADDR(slot);
+}
+
+#ifdef ENABLE_WATCHDOG
+// Whether a new image is on trial. A watchdog reset then counts as a failed
+// trial boot instead of sending the bootloader into DFU mode.
+static int slot_trial_pending() {
+	return boot_slot_trial_read() & BOOT_SLOT_TRIAL_PENDING;
+}
+#endif
+
+// Marks a freshly downloaded slot for trial boots.
+static void slot_start_trial(unsigned slot) {
+	boot_slot_trial_write(BOOT_SLOT_TRIAL_PENDING | (slot ? BOOT_SLOT_TRIAL_SLOT_B : 0));
+}
+
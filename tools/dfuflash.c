@@ -0,0 +1,176 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Flashes, verifies and reads back apps through the DFU bootloader.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "program.h"
+#include "../vendor.h"
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [options] [file.elf|file.hex|file.bin]\n", prog);
+	fprintf(stderr, "  -d vid:pid  Device to open (default %04x:%04x)\n", DFU_VENDOR_ID, DFU_PRODUCT_ID);
+	fprintf(stderr, "  -s serial   Only open the device with this serial number\n");
+	fprintf(stderr, "  -a alt      DFU alt setting (default 0, internal flash)\n");
+	fprintf(stderr, "  -A addr     Load address for .bin files and uploads (default: start of the writable area)\n");
+	fprintf(stderr, "  -e          Erase every page the image spans first (by default the bootloader\n");
+	fprintf(stderr, "              erases pages as blocks are written)\n");
+	fprintf(stderr, "  -V          Verify the image by reading it back (needs ENABLE_DFU_UPLOAD)\n");
+	fprintf(stderr, "  -U file     Upload (read) flash into a file\n");
+	fprintf(stderr, "  -L len      Upload length in bytes (default: the whole writable area)\n");
+	fprintf(stderr, "  -R          Leave DFU mode when done (reset, or DfuSe leave on the SRAM alt)\n");
+	fprintf(stderr, "  -S          Strict polling: sleep bwPollTimeout before every poll, like dfu-util\n");
+}
+
+static void fatal(struct dfu_dev *d, const char *what) {
+	fprintf(stderr, "ERROR! %s: %s\n", what, d->err);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	unsigned vid = DFU_VENDOR_ID, pid = DFU_PRODUCT_ID;
+	const char *serial = NULL, *upload_fn = NULL;
+	int alt = 0, erase = 0, verify = 0, leave = 0, strict = 0, opt;
+	uint32_t addr = 0, upload_len = 0;
+
+	while ((opt = getopt(argc, argv, "hd:s:a:A:eVU:L:RS")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (sscanf(optarg, "%x:%x", &vid, &pid) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 's': serial = optarg; break;
+		case 'a': alt = atoi(optarg); break;
+		case 'A': addr = strtoul(optarg, NULL, 0); break;
+		case 'e': erase = 1; break;
+		case 'V': verify = 1; break;
+		case 'U': upload_fn = optarg; break;
+		case 'L': upload_len = strtoul(optarg, NULL, 0); break;
+		case 'R': leave = 1; break;
+		case 'S': strict = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	const char *fn = optind < argc ? argv[optind] : NULL;
+	if (!fn && !upload_fn && !leave) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	libusb_context *ctx;
+	int result = libusb_init(&ctx);
+	if (result < 0) {
+		fprintf(stderr, "ERROR! libusb_init failed: %s\n", libusb_error_name(result));
+		return 1;
+	}
+
+	struct dfu_dev dev, *d = &dev;
+	if (dfu_open_vid_pid(d, ctx, vid, pid, serial, alt) < 0)
+		fatal(d, "Cannot open DFU device");
+	d->strict = strict;
+	printf("Device %s, alt %d: %s (transfer size %u)\n", d->serial, alt, d->layout, d->xfer_size);
+
+	struct dfu_region region;
+	if (dfu_layout_region(d->layout, &region) < 0) {
+		fprintf(stderr, "ERROR! Cannot find a writable area in the memory layout\n");
+		return 1;
+	}
+	if (!addr)
+		addr = region.addr;
+
+	if (dfu_recover(d) < 0)
+		fatal(d, "Cannot bring the device to dfuIDLE");
+
+	// Builds with ENABLE_CAPS describe themselves (others stall the request),
+	// which avoids flash work that is bound to fail or is redundant.
+	struct vendor_caps caps;
+	int r = dfu_vendor_request(d, VENDOR_REQ_GET_CAPS, 0, &caps, sizeof(caps));
+	if (r >= (int)sizeof(caps) && caps.version >= VENDOR_CAPS_VERSION && alt == 0) {
+		if ((verify || upload_fn) && !(caps.features & CAPS_DFU_UPLOAD)) {
+			fprintf(stderr, "ERROR! The bootloader was built without upload support, cannot %s\n",
+			        verify ? "verify" : "upload");
+			return 1;
+		}
+		if (erase && (caps.features & CAPS_SAFEWRITE)) {
+			printf("Skipping the erase, the bootloader wipes the payload on the first write\n");
+			erase = 0;
+		}
+	}
+
+	struct image img = { 0 };
+	if (fn) {
+		char err[128];
+		if (image_load(&img, fn, addr, err, sizeof(err)) < 0) {
+			fprintf(stderr, "ERROR! %s\n", err);
+			return 1;
+		}
+		if (!image_fits(d, &img, &region))
+			fatal(d, "Cannot flash");
+		printf("Image %s: %u bytes at 0x%08x, crc32 %08x\n", fn, img.size, img.base, program_crc(d, &img));
+
+		if (erase && program_erase(d, &img, &region) < 0)
+			fatal(d, "Erase failed");
+		if (program_image(d, &img, &region) < 0)
+			fatal(d, "Download failed");
+
+		if (verify) {
+			uint32_t crc;
+			if (verify_image(d, &img, &crc) < 0)
+				fatal(d, "Verify failed");
+			printf("Verified %u bytes, crc32 %08x\n", img.size, crc);
+		}
+	}
+
+	if (upload_fn) {
+		double t0 = dfu_now();
+		if (!upload_len)
+			upload_len = region.addr + region.size - addr;
+		upload_len = (upload_len + d->xfer_size - 1) / d->xfer_size * d->xfer_size;
+		uint8_t *buf = malloc(upload_len);
+		if (dfu_upload(d, addr, buf, upload_len) < 0)
+			fatal(d, "Upload failed");
+		FILE *fd = fopen(upload_fn, "wb");
+		if (!fd || fwrite(buf, 1, upload_len, fd) != upload_len) {
+			fprintf(stderr, "ERROR! Cannot write %s\n", upload_fn);
+			return 1;
+		}
+		fclose(fd);
+		free(buf);
+		d->stats.t_upload = dfu_now() - t0;
+		printf("Uploaded %u bytes from 0x%08x to %s\n", upload_len, addr, upload_fn);
+	}
+
+	if (leave) {
+		double t0 = dfu_now();
+		// SRAM images start at the last SETADDR address
+		if (fn && dfu_set_address(d, img.base) < 0)
+			fatal(d, "Set address failed");
+		if (dfu_leave(d) < 0)
+			fatal(d, "Leave/manifest failed");
+		d->stats.t_manifest = dfu_now() - t0;
+	}
+
+	const struct dfu_stats *s = &d->stats;
+	printf("Timing: open %.3fs, erase %.3fs (%u pages), download %.3fs (%u blocks), "
+	       "verify %.3fs, upload %.3fs (%u blocks), leave %.3fs\n",
+	       s->t_open, s->t_erase, s->pages_erased, s->t_download, s->blocks_written,
+	       s->t_verify, s->t_upload, s->blocks_read, s->t_manifest);
+	printf("Requests: %u GETSTATUS, %u poll sleeps%s\n", s->getstatus, s->polls_slept,
+	       strict ? " (strict)" : "");
+	if (s->t_download > 0)
+		printf("Download rate: %.1f KB/s\n", s->blocks_written * d->xfer_size / 1024.0 / s->t_download);
+
+	image_free(&img);
+	dfu_close(d);
+	libusb_exit(ctx);
+	return 0;
+}
@@ -0,0 +1,296 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Reads the bootloader diagnostics exposed through vendor requests (see
+ * vendor.h). Each report needs its feature enabled in the bootloader build.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dfuse.h"
+#include "../vendor.h"
+#include "../trace.h"
+
+static const char *perf_names[PERF_NUM] = {
+	"erase", "program", "blank_check", "checksum", "pma_copy", "poll_gap",
+};
+
+static const char *trace_names[] = {
+	"-", "boot", "app_start", "dfu_mode", "usb_reset", "usb_setup", "usb_fsm",
+	"usb_stall", "dfu_state", "flash_begin", "flash_end",
+};
+
+static const char *usb_fsm_names[] = {
+	"IDLE", "STALLED", "DATA_IN", "LAST_DATA_IN", "STATUS_IN",
+	"DATA_OUT", "LAST_DATA_OUT", "STATUS_OUT",
+};
+
+static const char *dfu_state_names[] = {
+	"appIDLE", "appDETACH", "dfuIDLE", "dfuDNLOAD-SYNC", "dfuDNBUSY", "dfuDNLOAD-IDLE",
+	"dfuMANIFEST-SYNC", "dfuMANIFEST", "dfuMANIFEST-WAIT-RESET", "dfuUPLOAD-IDLE", "dfuERROR",
+};
+
+static const char *link_names[LINK_NUM] = {
+	"bus_errors", "pma_overruns", "missed_sofs", "stalls", "short_reads", "bus_resets", "setups",
+};
+
+#define NAME(tbl, i) ((i) < sizeof(tbl) / sizeof(tbl[0]) ? tbl[i] : "?")
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [options]\n", prog);
+	fprintf(stderr, "  -d vid:pid  Device to open (default %04x:%04x)\n", DFU_VENDOR_ID, DFU_PRODUCT_ID);
+	fprintf(stderr, "  -s serial   Only open the device with this serial number\n");
+	fprintf(stderr, "  -p          Print the cycle counters (ENABLE_PERF_COUNTERS)\n");
+	fprintf(stderr, "  -t          Print the event trace (ENABLE_TRACE)\n");
+	fprintf(stderr, "  -l          Print the USB link counters (ENABLE_LINK_STATS)\n");
+	fprintf(stderr, "  -c          Print the build capabilities (ENABLE_CAPS)\n");
+	fprintf(stderr, "  -b          Run the self benchmark (ENABLE_SELF_BENCH, uses the last flash page)\n");
+	fprintf(stderr, "  -C          Clear the counters and the trace after reading them\n");
+}
+
+static int print_perf(struct dfu_dev *d, int clear) {
+	struct vendor_perf p;
+	int r = dfu_vendor_request(d, VENDOR_REQ_GET_PERF, clear ? VENDOR_PERF_CLEAR : 0, &p, sizeof(p));
+	if (r < 0) {
+		fprintf(stderr, "ERROR! %s\n", d->err);
+		return -1;
+	}
+	if (r < 4 || p.version != VENDOR_PERF_VERSION) {
+		fprintf(stderr, "ERROR! Unexpected perf reply (%d bytes, version %d)\n", r, r ? p.version : 0);
+		return -1;
+	}
+	unsigned n = p.count < PERF_NUM ? p.count : PERF_NUM;
+	printf("Cycle counters (core at %u MHz):\n", p.core_mhz);
+	printf("  %-12s %10s %12s %12s %10s\n", "counter", "calls", "cycles", "cycles/call", "us/call");
+	for (unsigned i = 0; i < n && 4 + 8 * (i + 1) <= (unsigned)r; i++) {
+		uint32_t calls = p.counter[i].calls, cycles = p.counter[i].cycles;
+		double per = calls ? (double)cycles / calls : 0;
+		printf("  %-12s %10u %12u %12.0f %10.1f\n", perf_names[i], calls, cycles, per,
+		       p.core_mhz ? per / p.core_mhz : 0);
+	}
+	return 0;
+}
+
+static int print_link_stats(struct dfu_dev *d, int clear) {
+	struct vendor_link_stats l;
+	int r = dfu_vendor_request(d, VENDOR_REQ_GET_LINK_STATS, clear ? VENDOR_LINK_CLEAR : 0, &l, sizeof(l));
+	if (r < 0) {
+		fprintf(stderr, "ERROR! %s\n", d->err);
+		return -1;
+	}
+	if (r < 4 || l.version != VENDOR_LINK_VERSION) {
+		fprintf(stderr, "ERROR! Unexpected link stats reply (%d bytes, version %d)\n", r, r ? l.version : 0);
+		return -1;
+	}
+	unsigned n = l.count < LINK_NUM ? l.count : LINK_NUM;
+	printf("USB link counters:\n");
+	for (unsigned i = 0; i < n && 4 + 4 * (i + 1) <= (unsigned)r; i++)
+		printf("  %-12s %10u\n", link_names[i], l.counter[i]);
+	return 0;
+}
+
+static double rate_kbs(uint32_t bytes, uint32_t us) {
+	return us ? bytes * 1000000.0 / 1024 / us : 0;
+}
+
+static int print_self_bench(struct dfu_dev *d) {
+	struct vendor_self_bench b;
+	int r = dfu_vendor_request(d, VENDOR_REQ_SELF_BENCH, VENDOR_BENCH_START, &b, sizeof(b));
+	// The flash part runs on the GETSTATUS polls
+	if (r == sizeof(b) && b.pending) {
+		if (dfu_wait_idle(d) < 0) {
+			fprintf(stderr, "ERROR! %s\n", d->err);
+			return -1;
+		}
+		r = dfu_vendor_request(d, VENDOR_REQ_SELF_BENCH, 0, &b, sizeof(b));
+	}
+	if (r < 0) {
+		fprintf(stderr, "ERROR! %s\n", d->err);
+		return -1;
+	}
+	if (r != sizeof(b) || b.version != VENDOR_BENCH_VERSION) {
+		fprintf(stderr, "ERROR! Unexpected self benchmark reply (%d bytes, version %d)\n", r, r ? b.version : 0);
+		return -1;
+	}
+	printf("Self benchmark (core at %u MHz, page 0x%08x, %u bytes):\n", b.core_mhz, b.page_addr, b.page_size);
+	printf("  %-12s %10u us %10.1f KB/s\n", "blank_check", b.blank_check_us, rate_kbs(b.page_size, b.blank_check_us));
+	if (b.status == 0) {
+		printf("  %-12s %10u us %10.1f KB/s\n", "program", b.program_us, rate_kbs(b.page_size, b.program_us));
+		printf("  %-12s %10u us\n", "erase", b.erase_us);
+	} else
+		printf("  flash timings skipped: DFU status %u%s\n", b.status,
+		       b.status == 5 ? " (errCHECK_ERASED, page not blank)" : "");
+	printf("  %-12s %10u us %10.1f KB/s\n", "crc", b.crc_us, rate_kbs(b.crc_bytes, b.crc_us));
+	printf("  %-12s %10u us %10.1f KB/s\n", "pma_copy", b.pma_us, rate_kbs(b.pma_bytes, b.pma_us));
+	return b.status ? -1 : 0;
+}
+
+static const char *caps_names[] = {
+	"dfu_upload", "safewrite", "writeprot", "protections", "checksum", "dual_slot", "xl_dual_bank",
+	"short_poll", "optbytes_alt", "sram_exec", "watchdog", "boot_handoff", "boot_services", "winusb",
+	"verify",
+};
+
+static const char *vendor_req_names[] = {
+	"get_perf", "get_trace", "get_link_stats", "self_bench", "get_caps",
+};
+
+static int print_caps(struct dfu_dev *d) {
+	struct vendor_caps c;
+	int r = dfu_vendor_request(d, VENDOR_REQ_GET_CAPS, 0, &c, sizeof(c));
+	if (r < 0) {
+		fprintf(stderr, "ERROR! %s\n", d->err);
+		return -1;
+	}
+	// Newer versions only append fields
+	if (r < (int)sizeof(c) || c.version < VENDOR_CAPS_VERSION) {
+		fprintf(stderr, "ERROR! Unexpected capabilities reply (%d bytes, version %d)\n", r, r ? c.version : 0);
+		return -1;
+	}
+	printf("Capabilities (version %u):\n", c.version);
+	printf("  flash        0x%08x, payload 0x%08x-0x%08x, %u byte pages\n",
+	       c.flash_base, c.app_start, c.app_end, c.page_size);
+	printf("  programming  %s, %u byte alignment, %u byte blocks, %u ms polls\n",
+	       c.flash_class == CAPS_FLASH_CH32 ? "CH32F103 page" : "STM32 halfword",
+	       c.program_align, c.transfer_size, c.poll_ms);
+	printf("  checksum     %s\n", c.checksum_kind == CAPS_CHECKSUM_XOR ? "xor" : "none");
+	printf("  dfuse       %s%s%s\n", (c.dfuse_cmds & CAPS_CMD_GET) ? " get" : "",
+	       (c.dfuse_cmds & CAPS_CMD_SETADDR) ? " set_address" : "", (c.dfuse_cmds & CAPS_CMD_ERASE) ? " erase" : "");
+	printf("  features    ");
+	for (unsigned i = 0; i < 32; i++)
+		if (c.features & (1U << i))
+			printf(" %s", NAME(caps_names, i));
+	printf("\n  vendor      ");
+	for (unsigned i = 0; i < 32; i++)
+		if (c.vendor_reqs & (1U << i))
+			printf(" %s", NAME(vendor_req_names, i));
+	printf("\n");
+	return 0;
+}
+
+static void print_trace_arg(unsigned ev, uint32_t arg) {
+	switch (ev) {
+	case TRACE_BOOT: {
+		static const char *flags[] = { "PIN", "POR", "SFT", "IWDG", "WWDG", "LPWR" };
+		printf("reset");
+		for (unsigned i = 0; i < 6; i++)
+			if (arg & (4 << i))
+				printf(" %s", flags[i]);
+		break;
+		}
+	case TRACE_APP_START:
+		printf("0x%08x", 0x08000000 | arg);
+		break;
+	case TRACE_DFU_MODE:
+		printf("%u MHz", arg);
+		break;
+	case TRACE_USB_SETUP:
+		printf("bmRequestType 0x%02x bRequest 0x%02x wValue 0x..%02x", arg & 0xFF, (arg >> 8) & 0xFF, arg >> 16);
+		break;
+	case TRACE_USB_FSM:
+	case TRACE_USB_STALL:
+		printf("%s", NAME(usb_fsm_names, arg));
+		break;
+	case TRACE_DFU_STATE:
+		printf("%s status %u", NAME(dfu_state_names, arg & 0xFF), arg >> 8);
+		break;
+	case TRACE_FLASH_BEGIN:
+		printf("block %u", arg);
+		break;
+	case TRACE_FLASH_END:
+		printf("status %u", arg);
+		break;
+	}
+}
+
+static int print_trace(struct dfu_dev *d, int clear) {
+	struct trace_ring t;
+	int r = dfu_vendor_request(d, VENDOR_REQ_GET_TRACE, clear ? VENDOR_TRACE_CLEAR : 0, &t, sizeof(t));
+	if (r < 0) {
+		fprintf(stderr, "ERROR! %s\n", d->err);
+		return -1;
+	}
+	if (r != sizeof(t) || t.magic != TRACE_MAGIC || t.version != TRACE_VERSION ||
+	    t.entries != TRACE_ENTRIES) {
+		fprintf(stderr, "ERROR! Unexpected trace reply (%d bytes)\n", r);
+		return -1;
+	}
+	// Oldest first. Times restart from 0 on every boot.
+	unsigned n = t.head < TRACE_ENTRIES ? t.head : TRACE_ENTRIES, mhz = 72;
+	printf("Event trace (%u logged since power up):\n", t.head);
+	for (unsigned i = t.head - n; i != t.head; i++) {
+		const struct trace_entry *e = &t.e[i % TRACE_ENTRIES];
+		unsigned ev = e->data & 0xFF, arg = e->data >> 8;
+		if (ev == TRACE_DFU_MODE && arg)
+			mhz = arg;
+		printf("  %5u %12.1fus %-12s ", i, (double)e->time / mhz, NAME(trace_names, ev));
+		print_trace_arg(ev, arg);
+		printf("\n");
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	unsigned vid = DFU_VENDOR_ID, pid = DFU_PRODUCT_ID;
+	const char *serial = NULL;
+	int perf = 0, trace = 0, link = 0, bench = 0, caps = 0, clear = 0, opt;
+
+	while ((opt = getopt(argc, argv, "hd:s:ptlbcC")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (sscanf(optarg, "%x:%x", &vid, &pid) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 's': serial = optarg; break;
+		case 'p': perf = 1; break;
+		case 't': trace = 1; break;
+		case 'l': link = 1; break;
+		case 'b': bench = 1; break;
+		case 'c': caps = 1; break;
+		case 'C': clear = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!perf && !trace && !link && !bench && !caps) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	libusb_context *ctx;
+	int result = libusb_init(&ctx);
+	if (result < 0) {
+		fprintf(stderr, "ERROR! libusb_init failed: %s\n", libusb_error_name(result));
+		return 1;
+	}
+
+	struct dfu_dev dev, *d = &dev;
+	if (dfu_open_vid_pid(d, ctx, vid, pid, serial, 0) < 0) {
+		fprintf(stderr, "ERROR! Cannot open DFU device: %s\n", d->err);
+		return 1;
+	}
+	printf("Device %s\n", d->serial);
+
+	int ret = 0;
+	if (caps && print_caps(d) < 0)
+		ret = 1;
+	// First, so the counters and the trace include it
+	if (bench && print_self_bench(d) < 0)
+		ret = 1;
+	if (perf && print_perf(d, clear) < 0)
+		ret = 1;
+	if (link && print_link_stats(d, clear) < 0)
+		ret = 1;
+	if (trace && print_trace(d, clear) < 0)
+		ret = 1;
+
+	dfu_close(d);
+	libusb_exit(ctx);
+	return ret;
+}
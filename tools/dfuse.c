@@ -0,0 +1,502 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * DfuSe host side engine for the DFU bootloader.
+ *
+ * The bootloader performs downloaded commands (erase, write, ...) right
+ * after it answers the first GETSTATUS, and it holds the next GETSTATUS
+ * (NAKs it) until that work is done. So instead of sleeping bwPollTimeout
+ * like dfu-util does, every download is queued together with two GETSTATUS
+ * requests: the second one completes as soon as the block is programmed.
+ * Uploads keep a few requests in flight. Strict mode sleeps the reported
+ * bwPollTimeout before polling, as the DFU spec says.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "dfuse.h"
+
+#define DFU_REQ_OUT (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE)
+#define DFU_REQ_IN  (LIBUSB_ENDPOINT_IN  | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE)
+#define DFU_FUNCTIONAL_DESC      0x21
+
+static const char *dfu_status_names[] = {
+	"OK", "errTARGET", "errFILE", "errWRITE", "errERASE", "errCHECK_ERASED",
+	"errPROG", "errVERIFY", "errADDRESS", "errNOTDONE", "errFIRMWARE",
+	"errVENDOR", "errUSBR", "errPOR", "errUNKNOWN", "errSTALLEDPKT",
+};
+
+double dfu_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_ms(unsigned ms) {
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+	nanosleep(&ts, NULL);
+}
+
+static int fail(struct dfu_dev *d, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(d->err, sizeof(d->err), fmt, args);
+	va_end(args);
+	return -1;
+}
+
+static void LIBUSB_CALL xfer_cb(struct libusb_transfer *t) {
+	((struct dfu_xfer*)t->user_data)->done = 1;
+}
+
+// Queues a class request, data is copied for OUT requests
+static int xfer_submit(struct dfu_dev *d, struct dfu_xfer *x, int in, uint8_t req,
+                       uint16_t wValue, const void *data, uint16_t len) {
+	libusb_fill_control_setup(x->buf, in ? DFU_REQ_IN : DFU_REQ_OUT, req, wValue, d->iface, len);
+	if (!in && len)
+		memcpy(&x->buf[LIBUSB_CONTROL_SETUP_SIZE], data, len);
+	libusb_fill_control_transfer(x->t, d->h, x->buf, xfer_cb, x, DFU_TIMEOUT_MS);
+	x->done = 0;
+	int r = libusb_submit_transfer(x->t);
+	if (r < 0) {
+		x->done = 1;
+		return fail(d, "cannot submit request %d: %s", req, libusb_error_name(r));
+	}
+	return 0;
+}
+
+// Waits for a queued request, returns the transferred length
+static int xfer_wait(struct dfu_dev *d, struct dfu_xfer *x) {
+	while (!x->done) {
+		int r = libusb_handle_events_completed(d->ctx, &x->done);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			libusb_cancel_transfer(x->t);
+			while (!x->done)
+				libusb_handle_events_completed(d->ctx, &x->done);
+			return fail(d, "event handling failed: %s", libusb_error_name(r));
+		}
+	}
+	switch (x->t->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return x->t->actual_length;
+	case LIBUSB_TRANSFER_STALL:
+		return fail(d, "request %d stalled", x->buf[1]);
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return fail(d, "request %d timed out", x->buf[1]);
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return fail(d, "device disconnected");
+	default:
+		return fail(d, "request %d failed (%d)", x->buf[1], x->t->status);
+	}
+}
+
+// Waits for a list of queued requests, returns the first error (if any)
+static int xfer_wait_all(struct dfu_dev *d, struct dfu_xfer **xs, unsigned n) {
+	int ret = 0;
+	char err[sizeof(d->err)];
+	for (unsigned i = 0; i < n; i++)
+		if (xfer_wait(d, xs[i]) < 0 && !ret) {
+			ret = -1;
+			memcpy(err, d->err, sizeof(err));
+		}
+	if (ret)
+		memcpy(d->err, err, sizeof(err));
+	return ret;
+}
+
+static void parse_status(struct dfu_dev *d, const struct dfu_xfer *x, struct dfu_status *st) {
+	const unsigned char *p = &x->buf[LIBUSB_CONTROL_SETUP_SIZE];
+	st->status = p[0];
+	st->poll_ms = p[1] | (p[2] << 8) | (p[3] << 16);
+	st->state = p[4];
+	st->istring = p[5];
+	d->last = *st;
+	d->stats.getstatus++;
+}
+
+static int status_error(struct dfu_dev *d, const struct dfu_status *st) {
+	const char *name = st->status < sizeof(dfu_status_names) / sizeof(dfu_status_names[0]) ?
+	                   dfu_status_names[st->status] : "unknown";
+	// XL builds point iString at a description when the error belongs to
+	// the block held back, not the last one sent
+	unsigned char desc[64] = "";
+	if (st->istring)
+		libusb_get_string_descriptor_ascii(d->h, st->istring, desc, sizeof(desc));
+	return fail(d, "device reported %s (status %d, state %d)%s%s", name, st->status, st->state,
+	            desc[0] ? ": " : "", (char*)desc);
+}
+
+int dfu_get_status(struct dfu_dev *d, struct dfu_status *st) {
+	struct dfu_xfer *x = &d->x[0];
+	if (xfer_submit(d, x, 1, DFU_GETSTATUS, 0, NULL, 6) < 0)
+		return -1;
+	int r = xfer_wait(d, x);
+	if (r < 0)
+		return -1;
+	if (r != 6)
+		return fail(d, "short GETSTATUS response (%d bytes)", r);
+	parse_status(d, x, st);
+	return 0;
+}
+
+static int simple_request(struct dfu_dev *d, uint8_t req) {
+	if (xfer_submit(d, &d->x[0], 0, req, 0, NULL, 0) < 0)
+		return -1;
+	return xfer_wait(d, &d->x[0]) < 0 ? -1 : 0;
+}
+
+int dfu_clear_status(struct dfu_dev *d) {
+	return simple_request(d, DFU_CLRSTATUS);
+}
+
+// XL builds hold the last downloaded block back until ABORT (or manifest),
+// its program/verify errors only show up in the status read after it.
+int dfu_abort(struct dfu_dev *d) {
+	struct dfu_status st;
+	if (simple_request(d, DFU_ABORT) < 0 || dfu_get_status(d, &st) < 0)
+		return -1;
+	if (st.state == DFU_STATE_ERROR || st.status)
+		return status_error(d, &st);
+	return 0;
+}
+
+int dfu_recover(struct dfu_dev *d) {
+	struct dfu_status st;
+	if (dfu_get_status(d, &st) < 0)
+		return -1;
+	if (st.state == DFU_STATE_ERROR && dfu_clear_status(d) < 0)
+		return -1;
+	if (st.state != DFU_STATE_IDLE && st.state != DFU_STATE_ERROR && dfu_abort(d) < 0)
+		return -1;
+	if (dfu_get_status(d, &st) < 0)
+		return -1;
+	if (st.state != DFU_STATE_IDLE)
+		return status_error(d, &st);
+	return 0;
+}
+
+int dfu_wait_idle(struct dfu_dev *d) {
+	struct dfu_status st;
+	do {
+		if (dfu_get_status(d, &st) < 0)
+			return -1;
+		if (st.status)
+			return status_error(d, &st);
+		if (st.state == DFU_STATE_DNBUSY)
+			sleep_ms(st.poll_ms);
+	} while (st.state == DFU_STATE_DNBUSY || st.state == DFU_STATE_DNLOAD_SYNC);
+	if (st.state != DFU_STATE_IDLE)
+		return status_error(d, &st);
+	return 0;
+}
+
+// Downloads a block and waits for the device to process it
+static int dnload_sync(struct dfu_dev *d, uint16_t block, const uint8_t *data, unsigned len) {
+	struct dfu_status st;
+	struct dfu_xfer *xs[3] = { &d->x[0], &d->x[1], &d->x[2] };
+	unsigned n = d->strict ? 2 : 3;
+
+	// DNLOAD, GETSTATUS (starts the work) and GETSTATUS (done), back to back
+	if (xfer_submit(d, xs[0], 0, DFU_DNLOAD, block, data, len) < 0)
+		return -1;
+	for (unsigned i = 1; i < n; i++)
+		if (xfer_submit(d, xs[i], 1, DFU_GETSTATUS, 0, NULL, 6) < 0) {
+			xfer_wait_all(d, xs, i);
+			return -1;
+		}
+	if (xfer_wait_all(d, xs, n) < 0)
+		return -1;
+
+	for (unsigned i = 1; i < n; i++) {
+		parse_status(d, xs[i], &st);
+		if (st.status)
+			return status_error(d, &st);
+	}
+
+	// Still busy (ie. a SAFEWRITE wipe step), keep polling
+	while (st.state == DFU_STATE_DNBUSY || st.state == DFU_STATE_DNLOAD_SYNC) {
+		if (d->strict && st.state == DFU_STATE_DNBUSY) {
+			sleep_ms(st.poll_ms);
+			d->stats.polls_slept++;
+		}
+		if (dfu_get_status(d, &st) < 0)
+			return -1;
+		if (st.status)
+			return status_error(d, &st);
+	}
+	if (st.state != DFU_STATE_DNLOAD_IDLE)
+		return status_error(d, &st);
+	return 0;
+}
+
+static int dfuse_command(struct dfu_dev *d, uint8_t cmd, uint32_t addr) {
+	const uint8_t buf[5] = { cmd, addr, addr >> 8, addr >> 16, addr >> 24 };
+	return dnload_sync(d, 0, buf, sizeof(buf));
+}
+
+int dfu_set_address(struct dfu_dev *d, uint32_t addr) {
+	if (dfuse_command(d, DFUSE_CMD_SETADDR, addr) < 0)
+		return -1;
+	d->addr = addr;
+	return 0;
+}
+
+int dfu_erase_page(struct dfu_dev *d, uint32_t addr) {
+	if (dfuse_command(d, DFUSE_CMD_ERASE, addr) < 0)
+		return -1;
+	d->stats.pages_erased++;
+	return 0;
+}
+
+int dfu_download(struct dfu_dev *d, uint32_t addr, const uint8_t *data, unsigned len) {
+	if (!len || len > d->xfer_size)
+		return fail(d, "bad download length %u", len);
+
+	// Reuse the current address pointer whenever the block number can reach
+	uint32_t off = addr - d->addr;
+	if (addr < d->addr || off % d->xfer_size || off / d->xfer_size + 2 > 0xFFFF) {
+		if (dfu_set_address(d, addr) < 0)
+			return -1;
+		off = 0;
+	}
+
+	if (dnload_sync(d, 2 + off / d->xfer_size, data, len) < 0)
+		return -1;
+	d->stats.blocks_written++;
+	return 0;
+}
+
+int dfu_upload(struct dfu_dev *d, uint32_t addr, uint8_t *buf, unsigned len) {
+	unsigned nblocks = len / d->xfer_size;
+	if (len % d->xfer_size)
+		return fail(d, "upload length must be a multiple of %u", d->xfer_size);
+	if (dfu_set_address(d, addr) < 0)
+		return -1;
+
+	// Keep a few UPLOAD requests in flight, consume them in order
+	int ret = 0;
+	unsigned sent = 0;
+	for (unsigned i = 0; i < nblocks; i++) {
+		while (!ret && sent < nblocks && sent < i + DFU_MAX_INFLIGHT) {
+			if (xfer_submit(d, &d->x[sent % DFU_MAX_INFLIGHT], 1, DFU_UPLOAD,
+			                2 + sent, NULL, d->xfer_size) < 0)
+				ret = -1;
+			else
+				sent++;
+		}
+		if (i >= sent)
+			break;
+
+		struct dfu_xfer *x = &d->x[i % DFU_MAX_INFLIGHT];
+		int r = xfer_wait(d, x);
+		if (ret)
+			continue;   // Just drain the queue
+		if (r < 0)
+			ret = -1;
+		else if ((unsigned)r != d->xfer_size) {
+			// The device moves to dfuERROR when it refuses the read
+			struct dfu_status st;
+			ret = dfu_get_status(d, &st) < 0 ? -1 : status_error(d, &st);
+		} else {
+			memcpy(&buf[i * d->xfer_size], &x->buf[LIBUSB_CONTROL_SETUP_SIZE], d->xfer_size);
+			d->stats.blocks_read++;
+		}
+	}
+
+	// Back to dfuIDLE (clears the error too)
+	char err[sizeof(d->err)];
+	memcpy(err, d->err, sizeof(err));
+	if (dfu_recover(d) < 0 && !ret)
+		return -1;
+	memcpy(d->err, err, sizeof(err));
+	return ret;
+}
+
+int dfu_leave(struct dfu_dev *d) {
+	struct dfu_status st;
+	if (xfer_submit(d, &d->x[0], 0, DFU_DNLOAD, 0, NULL, 0) < 0)
+		return -1;
+	if (xfer_wait(d, &d->x[0]) < 0)
+		return -1;
+	// The device resets (or jumps) once this status is read
+	if (dfu_get_status(d, &st) < 0)
+		return -1;
+	if (st.status)
+		return status_error(d, &st);
+	return 0;
+}
+
+int dfu_vendor_request(struct dfu_dev *d, uint8_t req, uint16_t wValue, void *buf, uint16_t len) {
+	int r = libusb_control_transfer(d->h, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR |
+	                                LIBUSB_RECIPIENT_DEVICE, req, wValue, 0, buf, len, DFU_TIMEOUT_MS);
+	if (r == LIBUSB_ERROR_PIPE)
+		return fail(d, "vendor request 0x%02x not supported by this build", req);
+	if (r < 0)
+		return fail(d, "vendor request 0x%02x failed: %s", req, libusb_error_name(r));
+	return r;
+}
+
+int dfu_layout_region(const char *layout, struct dfu_region *r) {
+	// "@Name /0xADDR/NN*SSSKf,NN*SSSKf,..." (f is a DfuSe sector type)
+	const char *p = strchr(layout, '/');
+	if (!p)
+		return -1;
+	char *end;
+	uint32_t addr = strtoul(p + 1, &end, 16);
+	if (*end != '/')
+		return -1;
+	p = end + 1;
+
+	memset(r, 0, sizeof(*r));
+	while (*p) {
+		unsigned count = strtoul(p, &end, 10);
+		if (*end != '*')
+			return -1;
+		unsigned size = strtoul(end + 1, &end, 10);
+		switch (*end) {
+		case 'K': size *= 1024; end++; break;
+		case 'M': size *= 1024 * 1024; end++; break;
+		case 'B': case ' ': end++; break;
+		}
+		char type = *end++;
+		// Types d-g are writable
+		if (type >= 'd' && type <= 'g') {
+			if (!r->size) {
+				r->addr = addr;
+				r->page_size = size;
+				r->size = count * size;
+			} else if (r->page_size == size && r->addr + r->size == addr)
+				r->size += count * size;
+			else
+				break;
+		} else if (r->size)
+			break;
+		addr += count * size;
+		if (*end != ',')
+			break;
+		p = end + 1;
+	}
+	return r->size ? 0 : -1;
+}
+
+// Finds the DFU interface for an alt setting and its functional descriptor
+static int find_dfu_iface(struct dfu_dev *d, libusb_device *dev, int alt, uint8_t *istr) {
+	struct libusb_config_descriptor *cfg;
+	int found = 0;
+	if (libusb_get_active_config_descriptor(dev, &cfg) < 0)
+		return fail(d, "cannot read config descriptor");
+
+	for (int i = 0; i < cfg->bNumInterfaces; i++) {
+		const struct libusb_interface *itf = &cfg->interface[i];
+		for (int a = 0; a < itf->num_altsetting; a++) {
+			const struct libusb_interface_descriptor *id = &itf->altsetting[a];
+			if (id->bInterfaceClass != 0xFE || id->bInterfaceSubClass != 1)
+				continue;
+			// The functional descriptor follows any of the alt settings
+			const unsigned char *ex = id->extra;
+			for (int o = 0; o + 7 <= id->extra_length && ex[o]; o += ex[o])
+				if (ex[o + 1] == DFU_FUNCTIONAL_DESC) {
+					d->attributes = ex[o + 2];
+					d->xfer_size = ex[o + 5] | (ex[o + 6] << 8);
+				}
+			if (id->bAlternateSetting == alt) {
+				d->iface = id->bInterfaceNumber;
+				*istr = id->iInterface;
+				found = 1;
+			}
+		}
+	}
+	libusb_free_config_descriptor(cfg);
+
+	if (!found)
+		return fail(d, "no DFU interface with alt setting %d", alt);
+	if (!d->xfer_size || d->xfer_size > DFU_MAX_XFER_SIZE)
+		return fail(d, "unsupported transfer size %u", d->xfer_size);
+	return 0;
+}
+
+int dfu_open(struct dfu_dev *d, libusb_context *ctx, libusb_device *dev, int alt) {
+	double t0 = dfu_now();
+	uint8_t istr = 0;
+	struct libusb_device_descriptor desc;
+
+	memset(d, 0, sizeof(*d));
+	d->ctx = ctx;
+	d->alt = alt;
+	if (find_dfu_iface(d, dev, alt, &istr) < 0)
+		return -1;
+
+	int r = libusb_open(dev, &d->h);
+	if (r < 0)
+		return fail(d, "cannot open device: %s", libusb_error_name(r));
+	libusb_detach_kernel_driver(d->h, d->iface);
+	r = libusb_claim_interface(d->h, d->iface);
+	if (r < 0) {
+		dfu_close(d);
+		return fail(d, "cannot claim interface: %s", libusb_error_name(r));
+	}
+	r = libusb_set_interface_alt_setting(d->h, d->iface, alt);
+	if (r < 0) {
+		dfu_close(d);
+		return fail(d, "cannot select alt setting %d: %s", alt, libusb_error_name(r));
+	}
+
+	if (!libusb_get_device_descriptor(dev, &desc) && desc.iSerialNumber)
+		libusb_get_string_descriptor_ascii(d->h, desc.iSerialNumber,
+			(unsigned char*)d->serial, sizeof(d->serial));
+	if (istr)
+		libusb_get_string_descriptor_ascii(d->h, istr,
+			(unsigned char*)d->layout, sizeof(d->layout));
+
+	for (unsigned i = 0; i < DFU_MAX_INFLIGHT; i++) {
+		d->x[i].t = libusb_alloc_transfer(0);
+		d->x[i].done = 1;
+		if (!d->x[i].t) {
+			dfu_close(d);
+			return fail(d, "out of memory");
+		}
+	}
+
+	d->stats.t_open = dfu_now() - t0;
+	return 0;
+}
+
+int dfu_open_vid_pid(struct dfu_dev *d, libusb_context *ctx, uint16_t vid, uint16_t pid,
+                     const char *serial, int alt) {
+	libusb_device **list;
+	ssize_t cnt = libusb_get_device_list(ctx, &list);
+	int ret = fail(d, "no matching device found");
+
+	for (ssize_t i = 0; i < cnt; i++) {
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor(list[i], &desc) < 0 ||
+		    desc.idVendor != vid || desc.idProduct != pid)
+			continue;
+		ret = dfu_open(d, ctx, list[i], alt);
+		if (!ret && serial && strcmp(serial, d->serial)) {
+			dfu_close(d);
+			ret = fail(d, "no device with serial %s", serial);
+			continue;
+		}
+		if (!ret)
+			break;
+	}
+	libusb_free_device_list(list, 1);
+	return ret;
+}
+
+void dfu_close(struct dfu_dev *d) {
+	for (unsigned i = 0; i < DFU_MAX_INFLIGHT; i++)
+		if (d->x[i].t) {
+			libusb_free_transfer(d->x[i].t);
+			d->x[i].t = NULL;
+		}
+	if (d->h) {
+		libusb_release_interface(d->h, d->iface);
+		libusb_close(d->h);
+		d->h = NULL;
+	}
+}
@@ -0,0 +1,120 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * DfuSe host side engine for the DFU bootloader, based on libusb's
+ * asynchronous API.
+ *
+ */
+
+#ifndef __DFUSE__HH__
+#define __DFUSE__HH__
+
+#include <stdint.h>
+#include <libusb-1.0/libusb.h>
+
+#define DFU_VENDOR_ID          0xdead
+#define DFU_PRODUCT_ID         0xca5d
+#define DFU_MAX_XFER_SIZE        2048
+// Transfers kept in flight while uploading
+#define DFU_MAX_INFLIGHT            4
+#define DFU_TIMEOUT_MS           5000
+
+// DFU class requests
+#define DFU_DETACH                  0
+#define DFU_DNLOAD                  1
+#define DFU_UPLOAD                  2
+#define DFU_GETSTATUS               3
+#define DFU_CLRSTATUS               4
+#define DFU_GETSTATE                5
+#define DFU_ABORT                   6
+
+// DfuSe commands (block 0 downloads)
+#define DFUSE_CMD_SETADDR        0x21
+#define DFUSE_CMD_ERASE          0x41
+
+// bState values
+#define DFU_STATE_IDLE              2
+#define DFU_STATE_DNLOAD_SYNC       3
+#define DFU_STATE_DNBUSY            4
+#define DFU_STATE_DNLOAD_IDLE       5
+#define DFU_STATE_MANIFEST_SYNC     6
+#define DFU_STATE_MANIFEST          7
+#define DFU_STATE_UPLOAD_IDLE       9
+#define DFU_STATE_ERROR            10
+
+struct dfu_status {
+	uint8_t status;     // bStatus (0 is OK)
+	uint32_t poll_ms;   // bwPollTimeout
+	uint8_t state;      // bState
+	uint8_t istring;    // iString, status description (0 if none)
+};
+
+// Time spent in each phase (seconds) plus some request counters
+struct dfu_stats {
+	double t_open, t_erase, t_download, t_verify, t_upload, t_manifest;
+	unsigned getstatus, polls_slept;
+	unsigned blocks_written, blocks_read, pages_erased;
+};
+
+struct dfu_xfer {
+	struct libusb_transfer *t;
+	int done;
+	unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE + DFU_MAX_XFER_SIZE];
+};
+
+struct dfu_dev {
+	libusb_context *ctx;
+	libusb_device_handle *h;
+	int iface, alt;
+	unsigned xfer_size;      // wTransferSize from the DFU functional descriptor
+	uint8_t attributes;      // bmAttributes from the DFU functional descriptor
+	char serial[64];
+	char layout[256];        // Alt setting string (DfuSe memory layout)
+	int strict;              // Sleep bwPollTimeout before every GETSTATUS poll
+	uint32_t addr;           // Last SETADDR address
+	struct dfu_status last;  // Last GETSTATUS response
+	struct dfu_stats stats;
+	char err[128];
+	struct dfu_xfer x[DFU_MAX_INFLIGHT];
+};
+
+// One writable region from the DfuSe memory layout string
+struct dfu_region {
+	uint32_t addr, size;
+	unsigned page_size;
+};
+
+// Opens the DFU interface of a device and selects the alt setting
+int dfu_open(struct dfu_dev *d, libusb_context *ctx, libusb_device *dev, int alt);
+// Same, picks the first device matching VID/PID (and serial, if not NULL)
+int dfu_open_vid_pid(struct dfu_dev *d, libusb_context *ctx, uint16_t vid, uint16_t pid,
+                     const char *serial, int alt);
+void dfu_close(struct dfu_dev *d);
+
+// Finds the first writable region in the memory layout string
+int dfu_layout_region(const char *layout, struct dfu_region *r);
+
+int dfu_get_status(struct dfu_dev *d, struct dfu_status *st);
+int dfu_clear_status(struct dfu_dev *d);
+// Back to dfuIDLE, fails if the status read after the ABORT reports an error
+int dfu_abort(struct dfu_dev *d);
+// Brings the device back to dfuIDLE from any state
+int dfu_recover(struct dfu_dev *d);
+// Polls GETSTATUS until the device is done with work started by a vendor
+// request (ie. the self benchmark), fails unless it ends in dfuIDLE
+int dfu_wait_idle(struct dfu_dev *d);
+
+int dfu_set_address(struct dfu_dev *d, uint32_t addr);
+int dfu_erase_page(struct dfu_dev *d, uint32_t addr);
+// Downloads data at addr, which must be the SETADDR address plus a multiple
+// of the transfer size (no SETADDR is needed to write out of order).
+int dfu_download(struct dfu_dev *d, uint32_t addr, const uint8_t *data, unsigned len);
+// Reads len bytes from addr (multiple of the transfer size), pipelined
+int dfu_upload(struct dfu_dev *d, uint32_t addr, uint8_t *buf, unsigned len);
+// Zero length download: manifest (and reset) or DfuSe leave
+int dfu_leave(struct dfu_dev *d);
+// Vendor IN request (see vendor.h), returns the reply length
+int dfu_vendor_request(struct dfu_dev *d, uint8_t req, uint16_t wValue, void *buf, uint16_t len);
+
+double dfu_now();
+
+#endif
@@ -0,0 +1,399 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Flashes every bootloader device that shows up, in parallel.
+ *
+ * Devices are discovered through libusb hotplug (or by polling the device
+ * list where hotplug is not available) and each one gets its own worker
+ * thread, identified by its serial number (the chip unique ID). Failed
+ * devices are retried on their own, and again if they are plugged back.
+ * Every attempt is logged with its timings and CRCs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "program.h"
+
+enum dev_state { DEV_ACTIVE, DEV_DONE, DEV_FAILED };
+
+struct worker {
+	pthread_t th;
+	libusb_device *dev;
+	uint8_t bus, addr;
+	int running;
+	struct worker *next;
+};
+
+struct serial_entry {
+	char serial[64];
+	enum dev_state state;
+	struct serial_entry *next;
+};
+
+static struct {
+	libusb_context *ctx;
+	uint16_t vid, pid;
+	int alt, erase, verify, leave, strict, retries;
+	struct image img;
+	FILE *log;
+
+	pthread_mutex_t lock;
+	struct worker *workers;
+	struct serial_entry *serials;
+	unsigned ok, failed, running;
+	uint64_t bytes;
+} fleet = {
+	.vid = DFU_VENDOR_ID, .pid = DFU_PRODUCT_ID, .retries = 3,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_sigint(int sig) {
+	(void)sig;
+	stop = 1;
+}
+
+static void sleep_ms(unsigned ms) {
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+	nanosleep(&ts, NULL);
+}
+
+// Claims a serial for a worker, fails if it is being flashed or is done
+static int claim_serial(const char *serial) {
+	struct serial_entry *e;
+	int ret = 1;
+	pthread_mutex_lock(&fleet.lock);
+	for (e = fleet.serials; e && strcmp(e->serial, serial); e = e->next);
+	if (!e) {
+		e = calloc(1, sizeof(*e));
+		snprintf(e->serial, sizeof(e->serial), "%s", serial);
+		e->next = fleet.serials;
+		fleet.serials = e;
+	} else if (e->state != DEV_FAILED)
+		ret = 0;
+	if (ret)
+		e->state = DEV_ACTIVE;
+	pthread_mutex_unlock(&fleet.lock);
+	return ret;
+}
+
+static void release_serial(const char *serial, enum dev_state state, uint64_t bytes) {
+	pthread_mutex_lock(&fleet.lock);
+	for (struct serial_entry *e = fleet.serials; e; e = e->next)
+		if (!strcmp(e->serial, serial))
+			e->state = state;
+	if (state == DEV_DONE) {
+		fleet.ok++;
+		fleet.bytes += bytes;
+	} else
+		fleet.failed++;
+	pthread_mutex_unlock(&fleet.lock);
+}
+
+static void log_attempt(const struct dfu_dev *d, const char *serial, unsigned attempt, int ok,
+                        double total, uint32_t img_crc, uint32_t flash_crc, int have_flash_crc) {
+	char ts[32], crcbuf[16] = "-";
+	time_t now = time(NULL);
+	strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+	if (have_flash_crc)
+		snprintf(crcbuf, sizeof(crcbuf), "%08x", flash_crc);
+
+	pthread_mutex_lock(&fleet.lock);
+	fprintf(fleet.log, "%s serial=%s attempt=%u result=%s open=%.3f erase=%.3f download=%.3f "
+	        "verify=%.3f total=%.3f image_crc=%08x flash_crc=%s",
+	        ts, serial, attempt, ok ? "ok" : "fail", d->stats.t_open, d->stats.t_erase,
+	        d->stats.t_download, d->stats.t_verify, total, img_crc, crcbuf);
+	if (!ok)
+		fprintf(fleet.log, " error=\"%s\"", d->err);
+	fprintf(fleet.log, "\n");
+	fflush(fleet.log);
+	pthread_mutex_unlock(&fleet.lock);
+}
+
+// One flashing attempt on an open device
+static int flash_device(struct dfu_dev *d, uint32_t *flash_crc, int *have_flash_crc) {
+	struct dfu_region region;
+	if (dfu_layout_region(d->layout, &region) < 0) {
+		snprintf(d->err, sizeof(d->err), "no writable area in the memory layout");
+		return -1;
+	}
+	if (!image_fits(d, &fleet.img, &region) || dfu_recover(d) < 0)
+		return -1;
+	if (fleet.erase && program_erase(d, &fleet.img, &region) < 0)
+		return -1;
+	if (program_image(d, &fleet.img, &region) < 0)
+		return -1;
+	if (fleet.verify) {
+		if (verify_image(d, &fleet.img, flash_crc) < 0)
+			return -1;
+		*have_flash_crc = 1;
+	}
+	if (fleet.leave && dfu_leave(d) < 0)
+		return -1;
+	return 0;
+}
+
+static void *worker_main(void *arg) {
+	struct worker *w = arg;
+	struct dfu_dev *d = calloc(1, sizeof(*d));
+	char serial[64] = "";
+	int claimed = 0, ok = 0;
+
+	for (int attempt = 1; attempt <= fleet.retries && !stop; attempt++) {
+		double t0 = dfu_now();
+		uint32_t flash_crc = 0;
+		int have_flash_crc = 0;
+
+		if (dfu_open(d, fleet.ctx, w->dev, fleet.alt) < 0) {
+			// Gone (or not ready yet), try again in a bit
+			log_attempt(d, serial[0] ? serial : "?", attempt, 0, dfu_now() - t0, 0, 0, 0);
+			sleep_ms(200 * attempt);
+			continue;
+		}
+		if (!claimed) {
+			snprintf(serial, sizeof(serial), "%s", d->serial);
+			// Already flashed (ie. came back after a reset) or being flashed
+			if (!claim_serial(serial)) {
+				dfu_close(d);
+				break;
+			}
+			claimed = 1;
+		}
+		d->strict = fleet.strict;
+
+		ok = !flash_device(d, &flash_crc, &have_flash_crc);
+		log_attempt(d, serial, attempt, ok, dfu_now() - t0, program_crc(d, &fleet.img),
+		            flash_crc, have_flash_crc);
+		dfu_close(d);
+		if (ok)
+			break;
+		sleep_ms(200 * attempt);
+	}
+
+	if (claimed)
+		release_serial(serial, ok ? DEV_DONE : DEV_FAILED, fleet.img.size);
+	free(d);
+
+	pthread_mutex_lock(&fleet.lock);
+	w->running = 0;
+	fleet.running--;
+	pthread_mutex_unlock(&fleet.lock);
+	return NULL;
+}
+
+// Starts a worker for a device, unless one is already running for it
+static void device_arrived(libusb_device *dev) {
+	uint8_t bus = libusb_get_bus_number(dev), addr = libusb_get_device_address(dev);
+	pthread_mutex_lock(&fleet.lock);
+	for (struct worker *w = fleet.workers; w; w = w->next)
+		if (w->running && w->bus == bus && w->addr == addr) {
+			pthread_mutex_unlock(&fleet.lock);
+			return;
+		}
+
+	struct worker *w = calloc(1, sizeof(*w));
+	w->dev = libusb_ref_device(dev);
+	w->bus = bus;
+	w->addr = addr;
+	w->running = 1;
+	if (pthread_create(&w->th, NULL, worker_main, w)) {
+		libusb_unref_device(w->dev);
+		free(w);
+	} else {
+		w->next = fleet.workers;
+		fleet.workers = w;
+		fleet.running++;
+	}
+	pthread_mutex_unlock(&fleet.lock);
+}
+
+// Hotplug callbacks can't do I/O, devices are queued for the main loop
+#define MAX_ARRIVALS 64
+static libusb_device *arrivals[MAX_ARRIVALS];
+static unsigned narrivals;
+
+static int LIBUSB_CALL hotplug_cb(libusb_context *ctx, libusb_device *dev,
+                                  libusb_hotplug_event event, void *user_data) {
+	(void)ctx;
+	(void)event;
+	(void)user_data;
+	pthread_mutex_lock(&fleet.lock);
+	if (narrivals < MAX_ARRIVALS)
+		arrivals[narrivals++] = libusb_ref_device(dev);
+	pthread_mutex_unlock(&fleet.lock);
+	return 0;
+}
+
+// Bus/address of the devices found by the last poll. Only the ones that
+// were not there before (plugged in or re-enumerated) are dispatched, like
+// hotplug arrivals, so done or failed boards are not flashed again.
+#define MAX_POLLED 128
+static uint16_t polled[MAX_POLLED];
+static unsigned npolled;
+
+static void poll_devices() {
+	libusb_device **list;
+	ssize_t cnt = libusb_get_device_list(fleet.ctx, &list);
+	if (cnt < 0)
+		return;
+
+	uint16_t present[MAX_POLLED];
+	unsigned npresent = 0;
+	for (ssize_t i = 0; i < cnt; i++) {
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor(list[i], &desc) ||
+		    desc.idVendor != fleet.vid || desc.idProduct != fleet.pid)
+			continue;
+		uint16_t id = libusb_get_bus_number(list[i]) << 8 | libusb_get_device_address(list[i]);
+		int known = 0;
+		for (unsigned j = 0; j < npolled && !known; j++)
+			known = polled[j] == id;
+		if (npresent < MAX_POLLED)
+			present[npresent++] = id;
+		if (!known)
+			device_arrived(list[i]);
+	}
+	memcpy(polled, present, npresent * sizeof(present[0]));
+	npolled = npresent;
+	libusb_free_device_list(list, 1);
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [options] file.elf|file.hex|file.bin\n", prog);
+	fprintf(stderr, "  -d vid:pid  Devices to flash (default %04x:%04x)\n", DFU_VENDOR_ID, DFU_PRODUCT_ID);
+	fprintf(stderr, "  -a alt      DFU alt setting (default 0, internal flash)\n");
+	fprintf(stderr, "  -A addr     Load address for .bin files (default 0x08001000)\n");
+	fprintf(stderr, "  -n count    Exit after this many devices are done (default: run until Ctrl+C)\n");
+	fprintf(stderr, "  -r retries  Attempts per device (default 3)\n");
+	fprintf(stderr, "  -l file     Log file (default: stdout)\n");
+	fprintf(stderr, "  -e -V -R -S Erase first, verify, leave DFU and strict polling (see dfuflash)\n");
+}
+
+int main(int argc, char **argv) {
+	unsigned vid = DFU_VENDOR_ID, pid = DFU_PRODUCT_ID, count = 0;
+	uint32_t bin_addr = 0x08001000;
+	const char *log_fn = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "hd:a:A:n:r:l:eVRS")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (sscanf(optarg, "%x:%x", &vid, &pid) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'a': fleet.alt = atoi(optarg); break;
+		case 'A': bin_addr = strtoul(optarg, NULL, 0); break;
+		case 'n': count = atoi(optarg); break;
+		case 'r': fleet.retries = atoi(optarg); break;
+		case 'l': log_fn = optarg; break;
+		case 'e': fleet.erase = 1; break;
+		case 'V': fleet.verify = 1; break;
+		case 'R': fleet.leave = 1; break;
+		case 'S': fleet.strict = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	fleet.vid = vid;
+	fleet.pid = pid;
+
+	char err[128];
+	if (image_load(&fleet.img, argv[optind], bin_addr, err, sizeof(err)) < 0) {
+		fprintf(stderr, "ERROR! %s\n", err);
+		return 1;
+	}
+	fleet.log = log_fn ? fopen(log_fn, "a") : stdout;
+	if (!fleet.log) {
+		fprintf(stderr, "ERROR! Cannot open log file %s\n", log_fn);
+		return 1;
+	}
+
+	int result = libusb_init(&fleet.ctx);
+	if (result < 0) {
+		fprintf(stderr, "ERROR! libusb_init failed: %s\n", libusb_error_name(result));
+		return 1;
+	}
+	signal(SIGINT, on_sigint);
+
+	libusb_hotplug_callback_handle hp;
+	int hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+		!libusb_hotplug_register_callback(fleet.ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+			LIBUSB_HOTPLUG_ENUMERATE, vid, pid, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_cb, NULL, &hp);
+	fprintf(stderr, "Waiting for %04x:%04x devices (%s), image %s: %u bytes at 0x%08x\n",
+	        vid, pid, hotplug ? "hotplug" : "polling", argv[optind], fleet.img.size, fleet.img.base);
+
+	double t0 = dfu_now(), last_poll = 0;
+	while (!stop) {
+		struct timeval tv = { 0, 100000 };
+		libusb_handle_events_timeout_completed(fleet.ctx, &tv, NULL);
+
+		if (hotplug) {
+			libusb_device *devs[MAX_ARRIVALS];
+			pthread_mutex_lock(&fleet.lock);
+			unsigned n = narrivals;
+			memcpy(devs, arrivals, n * sizeof(devs[0]));
+			narrivals = 0;
+			pthread_mutex_unlock(&fleet.lock);
+			for (unsigned i = 0; i < n; i++) {
+				device_arrived(devs[i]);
+				libusb_unref_device(devs[i]);
+			}
+		} else if (dfu_now() - last_poll > 1.0) {
+			poll_devices();
+			last_poll = dfu_now();
+		}
+
+		pthread_mutex_lock(&fleet.lock);
+		int finished = count && fleet.ok + fleet.failed >= count && !fleet.running;
+		pthread_mutex_unlock(&fleet.lock);
+		if (finished)
+			break;
+	}
+
+	// Let the workers finish (they stop retrying on Ctrl+C)
+	for (;;) {
+		pthread_mutex_lock(&fleet.lock);
+		unsigned running = fleet.running;
+		pthread_mutex_unlock(&fleet.lock);
+		if (!running)
+			break;
+		struct timeval tv = { 0, 100000 };
+		libusb_handle_events_timeout_completed(fleet.ctx, &tv, NULL);
+	}
+	double elapsed = dfu_now() - t0;
+
+	for (struct worker *w = fleet.workers, *next; w; w = next) {
+		next = w->next;
+		pthread_join(w->th, NULL);
+		libusb_unref_device(w->dev);
+		free(w);
+	}
+	for (struct serial_entry *e = fleet.serials, *next; e; e = next) {
+		next = e->next;
+		free(e);
+	}
+	if (hotplug)
+		libusb_hotplug_deregister_callback(fleet.ctx, hp);
+
+	fprintf(stderr, "Done: %u ok, %u failed in %.1fs (%.1f KB/s aggregate)\n", fleet.ok, fleet.failed,
+	        elapsed, elapsed > 0 ? fleet.bytes / 1024.0 / elapsed : 0);
+
+	image_free(&fleet.img);
+	if (fleet.log != stdout)
+		fclose(fleet.log);
+	libusb_exit(fleet.ctx);
+	return fleet.failed ? 1 : 0;
+}
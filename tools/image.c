@@ -0,0 +1,213 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Firmware image loader (ELF, Intel HEX or raw binary).
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+
+#include "image.h"
+
+struct segment {
+	uint32_t addr, len;
+	const uint8_t *data;
+};
+
+struct seglist {
+	struct segment *s;
+	unsigned n, cap;
+};
+
+static int seg_add(struct seglist *l, uint32_t addr, const uint8_t *data, uint32_t len) {
+	if (!len)
+		return 0;
+	if (l->n == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 16;
+		l->s = realloc(l->s, l->cap * sizeof(*l->s));
+		if (!l->s)
+			return -1;
+	}
+	l->s[l->n++] = (struct segment){ addr, len, data };
+	return 0;
+}
+
+static int errorf(char *err, size_t errlen, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(err, errlen, fmt, args);
+	va_end(args);
+	return -1;
+}
+
+static uint32_t rd16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t rd32(const uint8_t *p) { return rd16(p) | (rd16(p + 2) << 16); }
+
+// 32 bit little endian ELF, PT_LOAD segments at their physical (load) address
+static int parse_elf(struct seglist *l, const uint8_t *f, size_t flen, char *err, size_t errlen) {
+	if (flen < 0x34 || f[4] != 1 || f[5] != 1)
+		return errorf(err, errlen, "only 32 bit little endian ELF files are supported");
+
+	uint32_t phoff = rd32(&f[0x1C]);
+	unsigned phentsize = rd16(&f[0x2A]), phnum = rd16(&f[0x2C]);
+	if (phentsize < 0x20 || phoff + (uint64_t)phnum * phentsize > flen)
+		return errorf(err, errlen, "bad ELF program headers");
+
+	for (unsigned i = 0; i < phnum; i++) {
+		const uint8_t *ph = &f[phoff + i * phentsize];
+		uint32_t offset = rd32(&ph[4]), paddr = rd32(&ph[12]), filesz = rd32(&ph[16]);
+		if (rd32(&ph[0]) != 1 /* PT_LOAD */ || !filesz)
+			continue;
+		if ((uint64_t)offset + filesz > flen)
+			return errorf(err, errlen, "ELF segment %u out of file bounds", i);
+		if (seg_add(l, paddr, &f[offset], filesz) < 0)
+			return errorf(err, errlen, "out of memory");
+	}
+	return 0;
+}
+
+static int hexbyte(const char *p) {
+	if (!isxdigit((unsigned char)p[0]) || !isxdigit((unsigned char)p[1]))
+		return -1;
+	char tmp[3] = { p[0], p[1], 0 };
+	return strtoul(tmp, NULL, 16);
+}
+
+// Intel HEX, decoded in place (the record data is stored over its text)
+static int parse_hex(struct seglist *l, uint8_t *f, size_t flen, char *err, size_t errlen) {
+	uint32_t upper = 0;
+	unsigned line = 0;
+	char *p = (char*)f, *end = (char*)f + flen;
+
+	while (p < end) {
+		while (p < end && isspace((unsigned char)*p))
+			p++;
+		if (p >= end)
+			break;
+		line++;
+		if (*p != ':')
+			return errorf(err, errlen, "line %u: not a HEX record", line);
+
+		// Decode the record into the text buffer itself
+		uint8_t *rec = (uint8_t*)p++;
+		unsigned n = 0;
+		int b;
+		while (p + 1 < end && (b = hexbyte(p)) >= 0) {
+			rec[n++] = b;
+			p += 2;
+		}
+		if (n < 5 || n != rec[0] + 5u)
+			return errorf(err, errlen, "line %u: bad record length", line);
+		uint8_t sum = 0;
+		for (unsigned i = 0; i < n; i++)
+			sum += rec[i];
+		if (sum)
+			return errorf(err, errlen, "line %u: bad checksum", line);
+
+		uint32_t addr = (rec[1] << 8) | rec[2];
+		switch (rec[3]) {
+		case 0x00:
+			if (seg_add(l, upper + addr, &rec[4], rec[0]) < 0)
+				return errorf(err, errlen, "out of memory");
+			break;
+		case 0x01:
+			return 0;
+		case 0x02:
+			upper = ((rec[4] << 8) | rec[5]) << 4;
+			break;
+		case 0x04:
+			upper = ((rec[4] << 8) | rec[5]) << 16;
+			break;
+		case 0x03:
+		case 0x05:
+			break;  // Start address, not needed
+		default:
+			return errorf(err, errlen, "line %u: unknown record type %02x", line, rec[3]);
+		}
+	}
+	return 0;
+}
+
+int image_load(struct image *img, const char *fn, uint32_t bin_addr, char *err, size_t errlen) {
+	memset(img, 0, sizeof(*img));
+
+	FILE *fd = fopen(fn, "rb");
+	if (!fd)
+		return errorf(err, errlen, "cannot open %s", fn);
+	fseek(fd, 0, SEEK_END);
+	long flen = ftell(fd);
+	fseek(fd, 0, SEEK_SET);
+	uint8_t *f = malloc(flen > 0 ? flen : 1);
+	if (!f || flen <= 0 || fread(f, 1, flen, fd) != (size_t)flen) {
+		fclose(fd);
+		free(f);
+		return errorf(err, errlen, "cannot read %s", fn);
+	}
+	fclose(fd);
+
+	struct seglist l = { 0 };
+	int ret;
+	if (flen >= 4 && !memcmp(f, "\x7f" "ELF", 4))
+		ret = parse_elf(&l, f, flen, err, errlen);
+	else if (f[0] == ':')
+		ret = parse_hex(&l, f, flen, err, errlen);
+	else
+		ret = seg_add(&l, bin_addr, f, flen) < 0 ? errorf(err, errlen, "out of memory") : 0;
+
+	if (!ret && !l.n)
+		ret = errorf(err, errlen, "%s has no data to load", fn);
+
+	if (!ret) {
+		uint64_t lo = UINT32_MAX, hi = 0;
+		for (unsigned i = 0; i < l.n; i++) {
+			if (l.s[i].addr < lo)
+				lo = l.s[i].addr;
+			if ((uint64_t)l.s[i].addr + l.s[i].len > hi)
+				hi = (uint64_t)l.s[i].addr + l.s[i].len;
+		}
+		if (hi - lo > IMAGE_MAX_SPAN)
+			ret = errorf(err, errlen, "image spans %llu bytes (RAM sections in the file?)",
+			             (unsigned long long)(hi - lo));
+		else {
+			img->base = lo;
+			img->size = hi - lo;
+			img->data = malloc(img->size);
+			img->used = calloc(img->size, 1);
+			if (!img->data || !img->used)
+				ret = errorf(err, errlen, "out of memory");
+		}
+	}
+
+	if (!ret) {
+		memset(img->data, 0xff, img->size);
+		for (unsigned i = 0; i < l.n; i++) {
+			memcpy(&img->data[l.s[i].addr - img->base], l.s[i].data, l.s[i].len);
+			memset(&img->used[l.s[i].addr - img->base], 1, l.s[i].len);
+		}
+	}
+
+	free(l.s);
+	free(f);
+	if (ret)
+		image_free(img);
+	return ret;
+}
+
+void image_free(struct image *img) {
+	free(img->data);
+	free(img->used);
+	img->data = img->used = NULL;
+	img->size = 0;
+}
+
+int image_range_used(const struct image *img, uint32_t addr, unsigned len) {
+	for (unsigned i = 0; i < len; i++) {
+		uint64_t a = (uint64_t)addr + i;
+		if (a >= img->base && a < (uint64_t)img->base + img->size && img->used[a - img->base])
+			return 1;
+	}
+	return 0;
+}
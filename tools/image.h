@@ -0,0 +1,30 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Firmware image loader (ELF, Intel HEX or raw binary).
+ *
+ */
+
+#ifndef __IMAGE__HH__
+#define __IMAGE__HH__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Largest span (first to last byte) an image can cover
+#define IMAGE_MAX_SPAN   (16*1024*1024)
+
+// Flat image: bytes not covered by the file read as 0xff (erased flash)
+struct image {
+	uint32_t base;     // Address of data[0]
+	uint32_t size;
+	uint8_t *data;
+	uint8_t *used;     // Non zero for every byte present in the file
+};
+
+// Loads a file, bin_addr is the load address for raw binaries
+int image_load(struct image *img, const char *fn, uint32_t bin_addr, char *err, size_t errlen);
+void image_free(struct image *img);
+// Whether any byte of the range comes from the file
+int image_range_used(const struct image *img, uint32_t addr, unsigned len);
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Image programming/verification on top of the DfuSe engine.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "program.h"
+
+// XL-density parts: blocks for both banks are interleaved, so that the
+// bootloader can program them in parallel (see ENABLE_XL_DUAL_BANK)
+#define FLASH_BANK2_ADDR 0x08080000
+
+uint32_t crc32_words(uint32_t crc, const uint8_t *buf, unsigned len) {
+	for (unsigned i = 0; i + 3 < len; i += 4) {
+		crc ^= buf[i] | (buf[i+1] << 8) | (buf[i+2] << 16) | ((uint32_t)buf[i+3] << 24);
+		for (unsigned b = 0; b < 32; b++)
+			crc = (crc & 0x80000000U) ? (crc << 1) ^ 0x04C11DB7U : (crc << 1);
+	}
+	return crc;
+}
+
+// Block aligned span of the image
+static void image_blocks(struct dfu_dev *d, const struct image *img, uint32_t *start, uint32_t *len) {
+	*start = img->base - img->base % d->xfer_size;
+	*len = (img->base + img->size - *start + d->xfer_size - 1) / d->xfer_size * d->xfer_size;
+}
+
+// Copies one block of the image, padded with erased flash
+static void image_block(struct dfu_dev *d, const struct image *img, uint32_t addr, uint8_t *block) {
+	memset(block, 0xff, d->xfer_size);
+	for (unsigned j = 0; j < d->xfer_size; j++) {
+		uint32_t a = addr + j;
+		if (a >= img->base && a < img->base + img->size)
+			block[j] = img->data[a - img->base];
+	}
+}
+
+// Block addresses to write, low and high bank interleaved when possible
+static unsigned plan_blocks(const struct image *img, unsigned bsize, uint32_t *list) {
+	unsigned n[2] = { 0 }, nlow = 0, total = 0;
+	uint32_t start = img->base - img->base % bsize;
+
+	// First pass counts low bank blocks, so that high bank ones go after them
+	for (uint32_t a = start; a < img->base + img->size; a += bsize)
+		if (image_range_used(img, a, bsize) && a < FLASH_BANK2_ADDR)
+			nlow++;
+	uint32_t *bank[2] = { list, &list[nlow] };
+	for (uint32_t a = start; a < img->base + img->size; a += bsize)
+		if (image_range_used(img, a, bsize)) {
+			unsigned b = a >= FLASH_BANK2_ADDR;
+			bank[b][n[b]++] = a;
+			total++;
+		}
+
+	// Interleave in place through a copy
+	if (n[0] && n[1]) {
+		uint32_t *tmp = malloc(total * sizeof(uint32_t));
+		unsigned i = 0, j = 0, k = 0;
+		while (i < n[0] || j < n[1]) {
+			if (i < n[0])
+				tmp[k++] = bank[0][i++];
+			if (j < n[1])
+				tmp[k++] = bank[1][j++];
+		}
+		memcpy(list, tmp, total * sizeof(uint32_t));
+		free(tmp);
+	}
+	return total;
+}
+
+int image_fits(struct dfu_dev *d, const struct image *img, const struct dfu_region *r) {
+	if (img->base < r->addr || (uint64_t)img->base + img->size > (uint64_t)r->addr + r->size) {
+		snprintf(d->err, sizeof(d->err), "image (0x%08x-0x%08x) does not fit the writable area (0x%08x-0x%08x)",
+		         img->base, img->base + img->size, r->addr, r->addr + r->size);
+		return 0;
+	}
+	return 1;
+}
+
+int program_erase(struct dfu_dev *d, const struct image *img, const struct dfu_region *r) {
+	double t0 = dfu_now();
+	uint32_t page = img->base - (img->base - r->addr) % r->page_size;
+	for (; page < img->base + img->size; page += r->page_size)
+		if (dfu_erase_page(d, page) < 0)
+			return -1;
+	d->stats.t_erase += dfu_now() - t0;
+	return 0;
+}
+
+int program_image(struct dfu_dev *d, const struct image *img, const struct dfu_region *r) {
+	double t0 = dfu_now();
+	uint32_t *blocks = malloc((img->size / d->xfer_size + 2) * sizeof(uint32_t));
+	unsigned nblocks = plan_blocks(img, d->xfer_size, blocks);
+	int ret = dfu_set_address(d, r->addr);
+
+	for (unsigned i = 0; !ret && i < nblocks; i++) {
+		uint8_t block[DFU_MAX_XFER_SIZE];
+		image_block(d, img, blocks[i], block);
+		ret = dfu_download(d, blocks[i], block, d->xfer_size);
+	}
+	free(blocks);
+	if (!ret)
+		ret = dfu_abort(d);
+	d->stats.t_download += dfu_now() - t0;
+	return ret;
+}
+
+int verify_image(struct dfu_dev *d, const struct image *img, uint32_t *crc) {
+	double t0 = dfu_now();
+	uint32_t start, len;
+	image_blocks(d, img, &start, &len);
+	uint8_t *rb = malloc(len);
+	int ret = dfu_upload(d, start, rb, len);
+
+	if (!ret) {
+		if (crc)
+			*crc = crc32_words(0xffffffffU, rb, len);
+		for (uint32_t i = 0; i < img->size; i++)
+			if (img->used[i] && rb[img->base - start + i] != img->data[i]) {
+				snprintf(d->err, sizeof(d->err), "verify mismatch at 0x%08x", img->base + i);
+				ret = -1;
+				break;
+			}
+	}
+	free(rb);
+	d->stats.t_verify += dfu_now() - t0;
+	return ret;
+}
+
+uint32_t program_crc(struct dfu_dev *d, const struct image *img) {
+	uint32_t start, len, crc = 0xffffffffU;
+	image_blocks(d, img, &start, &len);
+	for (uint32_t a = start; a < start + len; a += d->xfer_size) {
+		uint8_t block[DFU_MAX_XFER_SIZE];
+		image_block(d, img, a, block);
+		crc = crc32_words(crc, block, d->xfer_size);
+	}
+	return crc;
+}
@@ -0,0 +1,28 @@
+/*
+ * Author: David Guillen Fandos (2023) <david@davidgf.net>
+ * Image programming/verification on top of the DfuSe engine.
+ *
+ */
+
+#ifndef __PROGRAM__HH__
+#define __PROGRAM__HH__
+
+#include "dfuse.h"
+#include "image.h"
+
+// Same as the STM32 CRC unit fed with little endian words (CRC-32/MPEG-2)
+uint32_t crc32_words(uint32_t crc, const uint8_t *buf, unsigned len);
+
+// Checks that the image fits in the region
+int image_fits(struct dfu_dev *d, const struct image *img, const struct dfu_region *r);
+// Erases every page the image spans
+int program_erase(struct dfu_dev *d, const struct image *img, const struct dfu_region *r);
+// Downloads all the blocks that hold image data (leaves the device idle)
+int program_image(struct dfu_dev *d, const struct image *img, const struct dfu_region *r);
+// Reads the image area back and compares it, crc gets the CRC of the
+// readback (whole blocks, see program_crc)
+int verify_image(struct dfu_dev *d, const struct image *img, uint32_t *crc);
+// CRC of the image padded to whole blocks with 0xff
+uint32_t program_crc(struct dfu_dev *d, const struct image *img);
+
+#endif
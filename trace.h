@@ -0,0 +1,58 @@
+
+#ifndef __TRACE__HH__
+#define __TRACE__HH__
+
+#include <stdint.h>
+
+// Event trace ring, built with ENABLE_TRACE.
+// The bootloader logs boots, USB and DFU state changes, stalls and flash
+// work into a ring kept right below the handoff block (see boot_handoff.h).
+// RAM is not cleared on warm resets, so the ring keeps the history of the
+// previous sessions until a power cycle. Apps that want to forward it
+// should reserve the last 560 bytes of RAM (or copy it before their stack
+// grows into it). The host reads it with VENDOR_REQ_GET_TRACE (vendor.h).
+
+#define TRACE_ADDR      (0x20005000U - 8 - 32 - 520)
+#define TRACE_MAGIC     0x45435254U   // "TRCE" in memory
+#define TRACE_VERSION   1
+#define TRACE_ENTRIES   64            // Power of two
+
+enum trace_event {
+	TRACE_NONE,
+	TRACE_BOOT,          // Reset (arg: RCC_CSR reset flags, bits 31:24)
+	TRACE_APP_START,     // Jump to an image (arg: address, low 24 bits)
+	TRACE_DFU_MODE,      // DFU mode entered (arg: core MHz)
+	TRACE_USB_RESET,     // USB bus reset
+	TRACE_USB_SETUP,     // SETUP received (arg: bmRequestType | bRequest << 8 | wValue << 16, low byte)
+	TRACE_USB_FSM,       // Control transfer state after an endpoint 0 event (arg: state)
+	TRACE_USB_STALL,     // Endpoint 0 stalled (arg: control transfer state)
+	TRACE_DFU_STATE,     // DFU state change (arg: bState | bStatus << 8)
+	TRACE_FLASH_BEGIN,   // Flash work for a block starts (arg: block number, 0 for commands)
+	TRACE_FLASH_END,     // Flash work done (arg: DFU status)
+};
+
+struct trace_entry {
+	uint32_t time;       // Core cycles since DFU mode was entered (0 before that)
+	uint32_t data;       // enum trace_event | arg << 8
+};
+
+struct trace_ring {
+	uint32_t magic;
+	uint16_t head;       // Events logged since power up, head % TRACE_ENTRIES is the next slot
+	uint8_t  version;
+	uint8_t  entries;    // TRACE_ENTRIES
+	struct trace_entry e[TRACE_ENTRIES];
+};
+
+_Static_assert(sizeof(struct trace_ring) == 520, "Trace ring must be 520 bytes");
+
+// Returns the ring left by the bootloader, or NULL if there is none
+static inline const struct trace_ring *trace_ring_get() {
+	const struct trace_ring *r = (const struct trace_ring*)TRACE_ADDR;
+	if (r->magic != TRACE_MAGIC || r->version != TRACE_VERSION)
+		return 0;
+	return r;
+}
+
+#endif
+
@@ -11,13 +11,20 @@
 
 #define CMD_ACCESS_OPTB        0x01
 #define CMD_ACCESS_FLASH_WRPR  0x02
+#define CMD_READ_FLASH         0x03
+#define CMD_WRITE_FLASH        0x04
 #define CMD_REBOOT             0xff
-#define CMD_GO_UPGRADE         0x55
+#define CMD_WRITE_CHUNK        0x56
+#define CMD_COMMIT             0x57
 #define VENDOR_ID            0xdead
 #define PRODUCT_ID           0x10ad
 #define IFACE_NUMBER            0x0
 #define TIMEOUT_MS             5000
-#define BOOTLOADER_FW_SIZE (4*1024)
+#define BOOTLOADER_MAX_SIZE  (8*1024)
+#define FLASH_BLOCK_SIZE       1024
+#define DEF_BOOTLOADER_KB         4
+#define BUNDLE_MAGIC     0x42554644
+#define BUNDLE_VERSION            1
 
 #define RDPRT_UNPROTECTED   0xA5
 #define RDPRT_UNPROTECTED_N 0x5A
@@ -33,6 +40,14 @@ typedef struct {
 	uint8_t WRP2, nWRP2, WRP3, nWRP3;
 } t_optbytes;
 
+// Bundle header (see mkbundle.py), followed by both images
+typedef struct {
+	uint32_t magic, version;
+	uint32_t bl_size, app_size;
+	uint32_t bl_crc32, app_crc32;
+	uint32_t reserved[2];
+} t_bundle_hdr;
+
 const t_optbytes def_opts = {
 	.RDP = 0xa5, .nRDP = 0x5a, .USER = 0xff, .nUSER = 0x00,   // Level 0
 	.Data0 = 0xff, .nData0 = 0x00, .Data1 = 0xff, .nData1 = 0x00,
@@ -42,19 +57,99 @@ const t_optbytes def_opts = {
 	.WRP2 = 0xff, .nWRP2 = 0x00, .WRP3 = 0xff, .nWRP3 = 0x00,
 };
 
+// Same as the STM32 CRC unit fed with little endian words (CRC-32/MPEG-2)
+uint32_t crc32_words(uint32_t crc, const unsigned char *buf, unsigned len) {
+	for (unsigned i = 0; i < len; i += 4) {
+		crc ^= buf[i] | (buf[i+1] << 8) | (buf[i+2] << 16) | ((uint32_t)buf[i+3] << 24);
+		for (unsigned b = 0; b < 32; b++)
+			crc = (crc & 0x80000000U) ? (crc << 1) ^ 0x04C11DB7U : (crc << 1);
+	}
+	return crc;
+}
+
 void fatal_error(const char * errmsg, int code) {
 	fprintf(stderr, "ERROR! %d %s\n", code, errmsg);
 	exit(1);
 }
 
+// Aborts unless the bootloader area is unprotected
+void check_bootloader_writable(struct libusb_device_handle *devh) {
+	// Read option bytes and check if we can actually write the bootloader
+	t_optbytes copts;
+	if (libusb_control_transfer(devh, CTRL_REQ_TYPE_IN, CMD_ACCESS_OPTB, 0, IFACE_NUMBER,
+	                            (unsigned char*)&copts, sizeof(copts), TIMEOUT_MS) < 0)
+		fatal_error("Cannot read option bytes!", 0);
+
+	uint8_t fwrp[4];
+	if (libusb_control_transfer(devh, CTRL_REQ_TYPE_IN, CMD_ACCESS_FLASH_WRPR, 0,
+	                            IFACE_NUMBER, &fwrp[0], sizeof(fwrp), TIMEOUT_MS) < 0)
+		fatal_error("Cannot read flash protection bits (FLASH_WRPR)!", 0);
+
+	// Check if they deviate from the default
+	if (copts.RDP != RDPRT_UNPROTECTED || copts.nRDP != RDPRT_UNPROTECTED_N)
+		fatal_error("Device seems locked, cannot update. Check '-u' option.", 0);
+
+	if (!(fwrp[0] & 1))
+		fatal_error("Bootloader flash is write-protected, the update cannot proceed. Check '-u' option.\n", 0);
+}
+
+// Flash page size of the device: parts above 128KB have 2KB pages, which is
+// told by whether the block after the first 128KB can be read
+unsigned flash_page_size(struct libusb_device_handle *devh) {
+	unsigned char block[FLASH_BLOCK_SIZE];
+	return libusb_control_transfer(devh, CTRL_REQ_TYPE_IN, CMD_READ_FLASH, 128, IFACE_NUMBER,
+	                               block, sizeof(block), TIMEOUT_MS) == sizeof(block) ? 2048 : 1024;
+}
+
+// Streams a (page padded) bootloader image and commits it
+void flash_bootloader(struct libusb_device_handle *devh, const unsigned char *img, unsigned size) {
+	struct {
+		uint32_t size, crc32;
+	} cmt = { size, crc32_words(0xffffffffU, img, size) };
+
+	for (unsigned i = 0; i < size / FLASH_BLOCK_SIZE; i++)
+		if (libusb_control_transfer(devh, CTRL_REQ_TYPE_OUT, CMD_WRITE_CHUNK, i, IFACE_NUMBER,
+		                            (unsigned char*)&img[i * FLASH_BLOCK_SIZE], FLASH_BLOCK_SIZE, TIMEOUT_MS) < 0)
+			fatal_error("Chunk write/verify failed!", i);
+
+	if (libusb_control_transfer(devh, CTRL_REQ_TYPE_OUT, CMD_COMMIT, 0, IFACE_NUMBER,
+	                            (unsigned char*)&cmt, sizeof(cmt), TIMEOUT_MS) < 0)
+		fatal_error("Firmware commit failed (CRC mismatch?)!", 0);
+}
+
+// Writes (1KB padded) data to the app area, the device verifies every block
+void write_app(struct libusb_device_handle *devh, const unsigned char *img, unsigned size, unsigned first_block) {
+	for (unsigned i = 0; i < size / FLASH_BLOCK_SIZE; i++)
+		if (libusb_control_transfer(devh, CTRL_REQ_TYPE_OUT, CMD_WRITE_FLASH, first_block + i, IFACE_NUMBER,
+		                            (unsigned char*)&img[i * FLASH_BLOCK_SIZE], FLASH_BLOCK_SIZE, TIMEOUT_MS) < 0)
+			fatal_error("Flash write/verify failed!", first_block + i);
+}
+
+// Writes an app so that it is only bootable once complete: its first page
+// is blanked, the rest written, and the first page (vector table) last.
+// Blocks within a page still go in order (the first one erases the page).
+void write_app_first_page_last(struct libusb_device_handle *devh, const unsigned char *img,
+                               unsigned size, unsigned first_block, unsigned page_size) {
+	unsigned char blank[FLASH_BLOCK_SIZE];
+	memset(blank, 0xff, sizeof(blank));
+	write_app(devh, blank, sizeof(blank), first_block);
+	if (size > page_size)
+		write_app(devh, &img[page_size], size - page_size, first_block + page_size / FLASH_BLOCK_SIZE);
+	write_app(devh, img, size < page_size ? size : page_size, first_block);
+}
+
 int main(int argc, char ** argv) {
 	if (argc < 2 || !strcmp(argv[1], "-h")) {
-		fprintf(stderr, "Usage: %s (-h|-r|fw.bin)\n", argv[0]);
+		fprintf(stderr, "Usage: %s (-h|-r|-b|-i|-u|-d file [kb]|-w file [kb]|-B bundle|fw.bin)\n", argv[0]);
 		fprintf(stderr, "  -h       Prints this help message\n");
 		fprintf(stderr, "  -r       Reboots (regular reset)\n");
 		fprintf(stderr, "  -b       Reboots to bootloader DFU mode\n");
 		fprintf(stderr, "  -i       Prints some info\n");
 		fprintf(stderr, "  -u [-f]  Unprotect device (switch to RDP level 0)\n");
+		fprintf(stderr, "  -d file  Dumps the app area (everything after the bootloader) to a file\n");
+		fprintf(stderr, "  -w file  Writes a file (ie. an app dump) back to the app area\n");
+		fprintf(stderr, "           [kb] is the bootloader size in KB (defaults to 4)\n");
+		fprintf(stderr, "  -B file  Flashes a bootloader+app bundle (see mkbundle.py) and reboots\n");
 		fprintf(stderr, "  fw.bin   Uploads and flashes a new bootloader using the specified file\n");
 		return 1;
 	}
@@ -116,6 +211,44 @@ int main(int argc, char ** argv) {
 			printf(" > %s: %04x %04x\n", names[i/4], a, b);
 		}
 	}
+	else if (!strcmp(argv[1], "-d") && argc > 2) {
+		unsigned app_first_block = argc > 3 ? atoi(argv[3]) : DEF_BOOTLOADER_KB;
+		FILE *fd = fopen(argv[2], "wb");
+		if (!fd)
+			fatal_error("Cannot open output file!", 0);
+
+		// Read until the device refuses (end of flash)
+		unsigned char block[FLASH_BLOCK_SIZE];
+		unsigned nblocks = 0;
+		while (libusb_control_transfer(devh, CTRL_REQ_TYPE_IN, CMD_READ_FLASH, app_first_block + nblocks,
+		                               IFACE_NUMBER, block, sizeof(block), TIMEOUT_MS) == sizeof(block)) {
+			if (fwrite(block, 1, sizeof(block), fd) != sizeof(block))
+				fatal_error("Cannot write output file!", 0);
+			nblocks++;
+		}
+		fclose(fd);
+		if (!nblocks)
+			fatal_error("Cannot read flash!", 0);
+		printf("Dumped %u KB of app area\n", nblocks * FLASH_BLOCK_SIZE / 1024);
+	}
+	else if (!strcmp(argv[1], "-w") && argc > 2) {
+		unsigned app_first_block = argc > 3 ? atoi(argv[3]) : DEF_BOOTLOADER_KB;
+		FILE *fd = fopen(argv[2], "rb");
+		if (!fd)
+			fatal_error("Cannot open input file!", 0);
+
+		unsigned char block[FLASH_BLOCK_SIZE];
+		unsigned nblocks = 0;
+		int rd;
+		while ((rd = fread(block, 1, sizeof(block), fd)) > 0) {
+			// Pad partial blocks with erased flash
+			memset(&block[rd], 0xff, sizeof(block) - rd);
+			write_app(devh, block, sizeof(block), app_first_block + nblocks);
+			nblocks++;
+		}
+		fclose(fd);
+		printf("Restored %u KB of app area\n", nblocks * FLASH_BLOCK_SIZE / 1024);
+	}
 	else if (!strcmp(argv[1], "-u")) {
 		t_optbytes copts;
 		if (libusb_control_transfer(devh, CTRL_REQ_TYPE_IN, CMD_ACCESS_OPTB, 0, IFACE_NUMBER,
@@ -149,41 +282,81 @@ int main(int argc, char ** argv) {
 		printf("Updated Option bytes, device should be unlocked now!\n");
 		printf("If you want to flash a new bootloader, perform an updater reboot using '-r'\n");
 	}
-	else {
-		// Read option bytes and check if we can actually write the bootloader
-		t_optbytes copts;
-		if (libusb_control_transfer(devh, CTRL_REQ_TYPE_IN, CMD_ACCESS_OPTB, 0, IFACE_NUMBER,
-		                            (unsigned char*)&copts, sizeof(copts), TIMEOUT_MS) < 0)
-			fatal_error("Cannot read option bytes!", 0);
+	else if (!strcmp(argv[1], "-B") && argc > 2) {
+		FILE *fd = fopen(argv[2], "rb");
+		if (!fd)
+			fatal_error("Cannot open bundle file!", 0);
+		fseek(fd, 0, SEEK_END);
+		long flen = ftell(fd);
+		fseek(fd, 0, SEEK_SET);
+		unsigned char *bundle = malloc(flen > 0 ? flen : 1);
+		if (flen < (long)sizeof(t_bundle_hdr) || fread(bundle, 1, flen, fd) != (size_t)flen)
+			fatal_error("Cannot read bundle file!", 0);
+		fclose(fd);
 
-		uint8_t fwrp[4];
-		if (libusb_control_transfer(devh, CTRL_REQ_TYPE_IN, CMD_ACCESS_FLASH_WRPR, 0,
-		                            IFACE_NUMBER, &fwrp[0], sizeof(fwrp), TIMEOUT_MS) < 0)
-			fatal_error("Cannot read flash protection bits (FLASH_WRPR)!", 0);
+		t_bundle_hdr hdr;
+		memcpy(&hdr, bundle, sizeof(hdr));
+		const unsigned char *blimg = &bundle[sizeof(hdr)];
+		const unsigned char *appimg = &blimg[hdr.bl_size];
+		if (hdr.magic != BUNDLE_MAGIC || hdr.version != BUNDLE_VERSION)
+			fatal_error("Not an upgrade bundle (see mkbundle.py)!", 0);
+		if (!hdr.bl_size || hdr.bl_size > BOOTLOADER_MAX_SIZE || hdr.bl_size % FLASH_BLOCK_SIZE ||
+		    hdr.app_size % FLASH_BLOCK_SIZE || sizeof(hdr) + hdr.bl_size + hdr.app_size != (unsigned long)flen)
+			fatal_error("Bundle sizes are not valid!", 0);
+		if (crc32_words(0xffffffffU, blimg, hdr.bl_size) != hdr.bl_crc32 ||
+		    crc32_words(0xffffffffU, appimg, hdr.app_size) != hdr.app_crc32)
+			fatal_error("Bundle is corrupted (CRC mismatch)!", 0);
 
-		// Check if they deviate from the default
-		if (copts.RDP != RDPRT_UNPROTECTED || copts.nRDP != RDPRT_UNPROTECTED_N)
-			fatal_error("Device seems locked, cannot update. Check '-u' option.", 0);
+		check_bootloader_writable(devh);
+		// The device only commits whole pages, and the app must start on one
+		const unsigned page_size = flash_page_size(devh);
+		if (hdr.bl_size % page_size)
+			fatal_error("Bootloader size is not a multiple of the flash page size!", hdr.bl_size);
 
-		if (!(fwrp[0] & 1))
-			fatal_error("Bootloader flash is write-protected, the update cannot proceed. Check '-u' option.\n", 0);
+		// Bootloader goes first: should the app write fail, the device still
+		// comes up in DFU mode with the new bootloader.
+		printf("Flashing new bootloader: %u KB, crc32 %08x\n", hdr.bl_size / 1024, hdr.bl_crc32);
+		flash_bootloader(devh, blimg, hdr.bl_size);
+		printf("Flashing new app: %u KB at %u KB, crc32 %08x\n", hdr.app_size / 1024,
+		       hdr.bl_size / 1024, hdr.app_crc32);
+		// If the session dies midway the new bootloader finds no valid app
+		// and stays in DFU mode, instead of booting half of one
+		if (hdr.app_size)
+			write_app_first_page_last(devh, appimg, hdr.app_size, hdr.bl_size / FLASH_BLOCK_SIZE, page_size);
+		free(bundle);
 
-		unsigned char buffer[4*1024] = {0};
+		if (libusb_control_transfer(devh, CTRL_REQ_TYPE_OUT, CMD_REBOOT, 0, IFACE_NUMBER, 0, 0, TIMEOUT_MS) < 0)
+			fatal_error("Reboot command failed!", 0);
+		printf("Bootloader and app updated and verified, device rebooted!\n");
+	}
+	else {
+		check_bootloader_writable(devh);
+
+		const unsigned page_size = flash_page_size(devh);
+		unsigned char buffer[BOOTLOADER_MAX_SIZE];
+		memset(buffer, 0xff, sizeof(buffer));
 		FILE *fd = fopen(argv[1], "rb");
+		if (!fd)
+			fatal_error("Cannot open input file!", 0);
 		int plen = fread(buffer, 1, sizeof(buffer), fd);
+		if (fgetc(fd) != EOF)
+			fatal_error("Bootloader image is too big!", BOOTLOADER_MAX_SIZE);
 		fclose(fd);
+		if (plen <= 0)
+			fatal_error("Empty bootloader image!", 0);
 
-		uint16_t checksum = 0xf153;
-		uint16_t *p16 = (uint16_t*)(buffer);
-		for (unsigned i = 0; i < BOOTLOADER_FW_SIZE / sizeof(uint16_t); i++)
-			checksum ^= p16[i];
-
-		printf("Flashing new bootloader: %d bytes, checksum %04x\n", plen, checksum);
+		// The image is sent in whole pages, padded with erased flash (the
+		// device only commits whole pages)
+		unsigned nchunks = (plen + page_size - 1) / page_size * (page_size / FLASH_BLOCK_SIZE);
+		if (nchunks * FLASH_BLOCK_SIZE > sizeof(buffer))
+			fatal_error("Bootloader image is too big!", BOOTLOADER_MAX_SIZE);
+		printf("Flashing new bootloader: %d bytes (%u KB), crc32 %08x\n", plen, nchunks,
+		       crc32_words(0xffffffffU, buffer, nchunks * FLASH_BLOCK_SIZE));
+		flash_bootloader(devh, buffer, nchunks * FLASH_BLOCK_SIZE);
 
-		if (libusb_control_transfer(devh, CTRL_REQ_TYPE_OUT, CMD_GO_UPGRADE, checksum,
-		                            IFACE_NUMBER, buffer, sizeof(buffer), TIMEOUT_MS) < 0)
-			fatal_error("Firmware flash failed!", 0);
-		printf("Device bootloader updated, it should reset itself\n");
+		printf("Device bootloader updated and verified, the app area was left untouched\n");
+		if (nchunks != DEF_BOOTLOADER_KB)
+			printf("Note: the app area now starts at %u KB, use it for -d/-w\n", nchunks);
 	}
 
 	libusb_release_interface(devh, 0);
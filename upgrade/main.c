@@ -20,35 +20,70 @@
 // Upgrader APP. Allows for bootloader upgrades.
 //
 // This app runs in RAM and exposes a very simple interface to allow for
-// bootloader upgrades. It takes a 4KB payload and flashes it into the
-// first 4KB of ROM (where the bootloader lives).
+// bootloader upgrades. The new bootloader is streamed in 1KB chunks and
+// flashed into the start of ROM (where the bootloader lives), leaving the
+// rest of the flash alone. The whole image is staged in RAM and only written
+// once it passes a CRC32 check. The app area can be read and written in 1KB
+// blocks, so that the host can snapshot and restore it within the same
+// session.
 // It is capable of exposing some information related to Option Bytes,
 // since the bootloader might be protected.
 
 
 #include <stdlib.h>
+#include <string.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/scb.h>
 #include <libopencm3/stm32/iwdg.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/f0/flash.h>
+#include <libopencm3/stm32/desig.h>
+#include <libopencm3/stm32/crc.h>
 #include <libopencm3/usb/usbd.h>
 
 #include "reboot.h"
 
 #define CMD_ACCESS_OPTB           0x01
 #define CMD_ACCESS_FLASH_WRPR     0x02
+#define CMD_READ_FLASH            0x03
+#define CMD_WRITE_FLASH           0x04
 #define CMD_REBOOT                0xff
-#define CMD_UPGRADE               0x55
-
-#define BOOTLOADER_FW_SIZE      (4*1024)
+#define CMD_WRITE_CHUNK           0x56
+#define CMD_COMMIT                0x57
+
+// Largest bootloader image that can be installed, staged in RAM until the
+// commit (upgrader-sram has less RAM, see the Makefile)
+#ifndef BOOTLOADER_MAX_SIZE
+#define BOOTLOADER_MAX_SIZE    (8*1024)
+#endif
 #define BOOTLOADER_BASE_ADDR 0x08000000
+#define FLASH_BLOCK_SIZE         1024
+#define BOOTLOADER_MAX_CHUNKS  (BOOTLOADER_MAX_SIZE / FLASH_BLOCK_SIZE)
+
+// Word at offset 0x28 of upgrader.bin (see bundle.S), tells whether the app
+// area holds the upgrader bundle rather than a real app.
+#define UPGRADER_BUNDLE_MAGIC   0x52475055
 
 #define OPTION_BYTES_ADDR    0x1FFFF800
 
-/* Must be able to fit at least 4KiB. */
-uint8_t usbd_control_buffer[BOOTLOADER_FW_SIZE];
+/* Must be able to fit a whole chunk/block. */
+uint8_t usbd_control_buffer[FLASH_BLOCK_SIZE];
+
+// New bootloader image, held back until it is committed
+static uint32_t staged[BOOTLOADER_MAX_SIZE / sizeof(uint32_t)];
+// Chunks received in the current upgrade session (bit N = chunk N)
+static uint32_t chunks_written;
+// Whether the app area held the upgrader bundle when we started
+static int bundle_in_flash;
+// Start of the app area, moves if a bootloader of a different size is installed
+static uint32_t app_start = USR_ADDRESS;
+
+// CMD_COMMIT payload
+struct upgrade_commit {
+	uint32_t size;   // Image size in bytes (multiple of the chunk size)
+	uint32_t crc32;  // STM32 CRC unit (CRC-32/MPEG-2) over the image words
+};
 
 static usbd_device *usbd_dev;
 
@@ -130,29 +165,110 @@ void reboot_info_upd() {
 	scb_reset_system();
 }
 
-static int process_upgrade(const uint8_t *buf, unsigned len, uint16_t refcheck) {
-	if (len != BOOTLOADER_FW_SIZE)
-		return 0;
+static int flash_is_blank(uint32_t addr, unsigned len) {
+	for (unsigned i = 0; i < len; i += 4)
+		if (*(volatile uint32_t*)(addr + i) != 0xffffffffU)
+			return 0;
+	return 1;
+}
 
-	// wValue must hold a valid xor-checksum
-	uint16_t checksum = 0xf153;
-	uint16_t *p16 = (uint16_t*)(buf);
-	for (unsigned i = 0; i < BOOTLOADER_FW_SIZE / sizeof(uint16_t); i++)
-		checksum ^= p16[i];
+// Parts above 128KB have 2KB pages
+static unsigned flash_page_size() {
+	return desig_get_flash_size() > 128 ? 2048 : 1024;
+}
 
-	if (checksum != refcheck)
-		return 0;
+// Writes a flash block and verifies it. Pages might be 1KB or 2KB: only the
+// block at the start of a page erases it (if not blank), so blocks sharing
+// a page must be written starting with that one. Otherwise the other block
+// would be wiped, or left unprogrammed if it went first.
+static int flash_write_verify(uint32_t addr, const uint8_t *buf, unsigned len) {
+	const uint16_t *p16 = (const uint16_t*)buf;
+	const unsigned page_size = flash_page_size();
 
-	// Proceed with a mass-erase so that we can flash the first pages too!
 	flash_unlock();
-	flash_erase_all_pages();
-	for (unsigned i = 0; i < BOOTLOADER_FW_SIZE / sizeof(uint16_t); i++)
-		flash_program_half_word(BOOTLOADER_BASE_ADDR + i*2, p16[i]);
+	if (!(addr & (page_size - 1)) && !flash_is_blank(addr, page_size))
+		flash_erase_page(addr);
+	for (unsigned i = 0; i < len / sizeof(uint16_t); i++)
+		flash_program_half_word(addr + i*2, p16[i]);
 	flash_lock();
 
+	return !memcmp((void*)addr, buf, len);
+}
+
+static unsigned flash_blocks() {
+	return desig_get_flash_size() * 1024 / FLASH_BLOCK_SIZE;
+}
+
+// Stages one chunk of the new bootloader in RAM, the flash is not touched
+// until the whole image is verified.
+static int process_write_chunk(const uint8_t *buf, unsigned len, uint16_t chunk) {
+	if (len != FLASH_BLOCK_SIZE || chunk >= BOOTLOADER_MAX_CHUNKS)
+		return 0;
+
+	// A new session starts with the first chunk
+	if (!chunk)
+		chunks_written = 0;
+	// Chunks must come in order
+	if (chunks_written != (1U << chunk) - 1)
+		return 0;
+
+	memcpy((uint8_t*)staged + chunk * FLASH_BLOCK_SIZE, buf, len);
+	chunks_written |= 1U << chunk;
 	return 1;
 }
 
+// Checks the CRC32 of the staged image and writes it. The first page (vector
+// table) goes last, to keep the window where the device can't boot short.
+static int process_commit(const uint8_t *buf, unsigned len) {
+	struct upgrade_commit cmt;
+	if (len != sizeof(cmt))
+		return 0;
+	memcpy(&cmt, buf, sizeof(cmt));
+
+	// Whole pages only, the app area must start on a page of its own
+	const unsigned page_size = flash_page_size();
+	unsigned nchunks = cmt.size / FLASH_BLOCK_SIZE;
+	if (!nchunks || nchunks > BOOTLOADER_MAX_CHUNKS || cmt.size % page_size)
+		return 0;
+	if (chunks_written != (1U << nchunks) - 1)
+		return 0;
+
+	crc_reset();
+	if (crc_calculate_block(staged, cmt.size / sizeof(uint32_t)) != cmt.crc32)
+		return 0;
+
+	// Chunks in page order, so the one at the start of a page erases it and
+	// the second one (2KB pages) lands on blank flash
+	chunks_written = 0;
+	for (unsigned off = page_size; off < cmt.size; off += FLASH_BLOCK_SIZE)
+		if (!flash_write_verify(BOOTLOADER_BASE_ADDR + off, (uint8_t*)staged + off, FLASH_BLOCK_SIZE))
+			return 0;
+	for (unsigned off = 0; off < page_size; off += FLASH_BLOCK_SIZE)
+		if (!flash_write_verify(BOOTLOADER_BASE_ADDR + off, (uint8_t*)staged + off, FLASH_BLOCK_SIZE))
+			return 0;
+
+	// If we were flashed as the app (upgrader.bin), drop whatever is left of
+	// it at the new app start, so that the new bootloader stays in DFU mode
+	// instead of booting a partially overwritten upgrader.
+	if (bundle_in_flash) {
+		flash_unlock();
+		flash_erase_page(BOOTLOADER_BASE_ADDR + cmt.size);
+		flash_lock();
+	}
+	app_start = BOOTLOADER_BASE_ADDR + cmt.size;
+
+	return 1;
+}
+
+// Restores a block of the app area (the bootloader can only be written
+// via CMD_WRITE_CHUNK/CMD_COMMIT).
+static int process_write_flash(const uint8_t *buf, unsigned len, uint16_t block) {
+	uint32_t addr = BOOTLOADER_BASE_ADDR + block * FLASH_BLOCK_SIZE;
+	if (len != FLASH_BLOCK_SIZE || addr < app_start || block >= flash_blocks())
+		return 0;
+	return flash_write_verify(addr, buf, len);
+}
+
 static enum usbd_request_return_codes usr_control_request_out(
 	usbd_device *dev, struct usb_setup_data *req, uint8_t **buf, uint16_t *len,
 	void (**complete)(usbd_device *, struct usb_setup_data *))
@@ -168,9 +284,19 @@ static enum usbd_request_return_codes usr_control_request_out(
 		else
 			*complete = reboot_info_upd;
 		return USBD_REQ_HANDLED;
-	case CMD_UPGRADE:
-		// Take the received payload, which must be exactly 4KiB, and flash it
-		if (process_upgrade(*buf, *len, req->wValue))
+	case CMD_WRITE_CHUNK:
+		// wValue is the 1KB chunk number within the bootloader image
+		if (process_write_chunk(*buf, *len, req->wValue))
+			return USBD_REQ_HANDLED;
+		return USBD_REQ_NOTSUPP;
+	case CMD_COMMIT:
+		// Payload is a struct upgrade_commit
+		if (process_commit(*buf, *len))
+			return USBD_REQ_HANDLED;
+		return USBD_REQ_NOTSUPP;
+	case CMD_WRITE_FLASH:
+		// wValue is the 1KB block number (from the flash start)
+		if (process_write_flash(*buf, *len, req->wValue))
 			return USBD_REQ_HANDLED;
 		return USBD_REQ_NOTSUPP;
 	case CMD_ACCESS_OPTB:
@@ -203,6 +329,13 @@ static enum usbd_request_return_codes usr_control_request_in(
 		*buf = (uint8_t*)&FLASH_WRPR;
 		*len = 4;
 		return USBD_REQ_HANDLED;
+	case CMD_READ_FLASH:
+		// wValue is the 1KB block number, the whole flash can be read
+		if (req->wValue >= flash_blocks())
+			return USBD_REQ_NOTSUPP;
+		*buf = (uint8_t*)(BOOTLOADER_BASE_ADDR + req->wValue * FLASH_BLOCK_SIZE);
+		*len = FLASH_BLOCK_SIZE;
+		return USBD_REQ_HANDLED;
 	default:
 		return USBD_REQ_NOTSUPP;
 	};
@@ -229,6 +362,10 @@ static void usr_set_config(usbd_device *dev, uint16_t wValue) {
 int main(void) {
 	rcc_clock_setup_pll(&rcc_hse_configs[RCC_CLOCK_HSE8_72MHZ]);
 	get_dev_unique_id(serial_no);
+	rcc_periph_clock_enable(RCC_CRC);
+
+	// Must be sampled before any chunk lands on top of it
+	bundle_in_flash = *(volatile uint32_t*)(USR_ADDRESS + 0x28) == UPGRADER_BUNDLE_MAGIC;
 
 	rcc_periph_clock_enable(RCC_GPIOA);
 	gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_2_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, GPIO12);
@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+# Packs a bootloader and an app image into a single upgrade bundle
+# for client.exe (-B option). Both images are padded to 1KB with 0xFF.
+# Header (little endian words): magic, version, bootloader size,
+# app size, bootloader CRC32, app CRC32, two reserved words.
+# CRCs match the STM32 CRC unit (CRC-32/MPEG-2 over words).
+# Usage: mkbundle.py bootloader.bin app.bin bundle.bin
+
+import sys, struct
+
+BUNDLE_MAGIC = 0x42554644   # "DFUB"
+BUNDLE_VERSION = 1
+BLOCK_SIZE = 1024
+BOOTLOADER_MAX_SIZE = 16*1024
+
+def pad(data):
+	while len(data) % BLOCK_SIZE != 0:
+		data += b"\xff"
+	return data
+
+def crc32_words(data):
+	crc = 0xFFFFFFFF
+	for i in range(0, len(data), 4):
+		crc ^= struct.unpack("<I", data[i:i+4])[0]
+		for _ in range(32):
+			crc = ((crc << 1) ^ 0x04C11DB7) if crc & 0x80000000 else (crc << 1)
+			crc &= 0xFFFFFFFF
+	return crc
+
+blbin = pad(open(sys.argv[1], "rb").read())
+appbin = pad(open(sys.argv[2], "rb").read())
+assert 0 < len(blbin) <= BOOTLOADER_MAX_SIZE
+
+print("Bootloader size", len(blbin))
+print("App size", len(appbin), "at offset", hex(len(blbin)))
+
+hdr = struct.pack("<8I", BUNDLE_MAGIC, BUNDLE_VERSION, len(blbin), len(appbin),
+                  crc32_words(blbin), crc32_words(appbin), 0, 0)
+
+open(sys.argv[3], "wb").write(hdr + blbin + appbin)
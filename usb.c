@@ -5,13 +5,22 @@
 #include <string.h>
 
 #include "usb.h"
+#include "vendor.h"
+#include "perf.h"
 
 // Defined in main
 extern uint8_t usbd_control_buffer[1024];
-extern const char * const _usb_strings[5];
+extern const char * const _usb_strings[USB_NUM_STRINGS];
 extern enum usbd_request_return_codes
 usbdfu_control_request(struct usb_setup_data *req,
 		uint16_t *len, void (**complete)(struct usb_setup_data *req));
+#ifdef ENABLE_BOOT_TIMING
+extern void boot_timing_mark();
+#endif
+#ifdef ENABLE_VENDOR_REQUESTS
+extern enum usbd_request_return_codes
+usb_vendor_request(struct usb_setup_data *req, uint16_t *len);
+#endif
 
 // Simple builtin fns
 size_t strlen(const char *s) {
@@ -41,6 +50,12 @@ const struct usb_device_descriptor dev_desc = {
 const struct {
 	struct usb_config_descriptor config;
 	struct usb_interface_descriptor iface;
+	#ifdef ENABLE_OPTBYTES_ALT
+	struct usb_interface_descriptor iface_optbytes;
+	#endif
+	#ifdef ENABLE_SRAM_EXEC
+	struct usb_interface_descriptor iface_sram;
+	#endif
 	struct usb_dfu_descriptor dfu_function;
 } config_desc = {
 	.config = {
@@ -64,11 +79,37 @@ const struct {
 		.bInterfaceProtocol = 2,
 		.iInterface = 4,
 	},
+	#ifdef ENABLE_OPTBYTES_ALT
+	.iface_optbytes = {
+		.bLength = USB_DT_INTERFACE_SIZE,
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bInterfaceNumber = 0,
+		.bAlternateSetting = DFU_ALT_OPTBYTES,
+		.bNumEndpoints = 0,
+		.bInterfaceClass = 0xFE, /* Device Firmware Upgrade */
+		.bInterfaceSubClass = 1,
+		.bInterfaceProtocol = 2,
+		.iInterface = DFU_ALT_ISTRING(DFU_ALT_OPTBYTES),
+	},
+	#endif
+	#ifdef ENABLE_SRAM_EXEC
+	.iface_sram = {
+		.bLength = USB_DT_INTERFACE_SIZE,
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bInterfaceNumber = 0,
+		.bAlternateSetting = DFU_ALT_SRAM,
+		.bNumEndpoints = 0,
+		.bInterfaceClass = 0xFE, /* Device Firmware Upgrade */
+		.bInterfaceSubClass = 1,
+		.bInterfaceProtocol = 2,
+		.iInterface = DFU_ALT_ISTRING(DFU_ALT_SRAM),
+	},
+	#endif
 	.dfu_function = {
 		.bLength = sizeof(struct usb_dfu_descriptor),
 		.bDescriptorType = DFU_FUNCTIONAL,
 		.bmAttributes =
-			#ifdef ENABLE_DFU_UPLOAD
+			#if defined(ENABLE_DFU_UPLOAD) || defined(ENABLE_OPTBYTES_ALT)
 			USB_DFU_CAN_UPLOAD |
 			#endif
 			USB_DFU_CAN_DOWNLOAD |
@@ -91,8 +132,16 @@ uint16_t usb_pm_top = 0;
 uint8_t  usb_needs_zlp = 0;
 struct usb_setup_data usb_req;
 uint8_t usb_force_nak[8] = {0};
+uint8_t usb_altsetting = DFU_ALT_FLASH;
 void (*usb_complete_cb)(struct usb_setup_data *req) = 0;
 
+#ifdef ENABLE_LINK_STATS
+struct vendor_link_stats link_stats;
+#define LINK_STAT(id) link_stats.counter[id]++
+#else
+#define LINK_STAT(id)
+#endif
+
 #define RCC_APB1ENR  (*(volatile uint32_t*)0x4002101CU)
 #define RCC_USB   23
 
@@ -111,8 +160,14 @@ void usb_init() {
 	SET_REG(USB_ISTR_REG, 0);
 
 	/* Enable RESET, SUSPEND, RESUME and CTR interrupts. */
+	#ifdef ENABLE_LINK_STATS
+	SET_REG(USB_CNTR_REG, USB_CNTR_RESETM | USB_CNTR_CTRM |
+		USB_CNTR_SUSPM | USB_CNTR_WKUPM |
+		USB_CNTR_ERRM | USB_CNTR_PMAOVRM | USB_CNTR_ESOFM);
+	#else
 	SET_REG(USB_CNTR_REG, USB_CNTR_RESETM | USB_CNTR_CTRM |
 		USB_CNTR_SUSPM | USB_CNTR_WKUPM);
+	#endif
 }
 
 #define MIN(a,b) (((a) < (b)) ? (a) : (b))
@@ -137,13 +192,23 @@ static void st_usbfs_copy_from_pm(void *buf, const volatile void *vPM, uint16_t
 		*(uint8_t *) lbuf = *(uint8_t *) PM;
 }
 
+#ifdef ENABLE_SELF_BENCH
+// Copies len bytes (up to 256) to the packet memory above the endpoint 0
+// buffers and back, for the self benchmark.
+void usb_pma_roundtrip(void *buf, uint16_t len) {
+	volatile void *pm = USB_PMA_BASE + (uint8_t*)(0x100 * 2);
+	st_usbfs_copy_to_pm(pm, buf, len);
+	st_usbfs_copy_from_pm(buf, pm, len);
+}
+#endif
+
 static uint16_t _usbd_ep_write_packet(uint8_t addr, const void *buf, uint16_t len) {
 	addr &= 0x7F;
 
 	if ((*USB_EP_REG(addr) & USB_EP_TX_STAT) == USB_EP_TX_STAT_VALID)
 		return 0;
 
-	st_usbfs_copy_to_pm(USB_GET_EP_TX_BUFF(addr), buf, len);
+	PERF(PERF_PMA_COPY, st_usbfs_copy_to_pm(USB_GET_EP_TX_BUFF(addr), buf, len));
 	USB_SET_EP_TX_COUNT(addr, len);
 	USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_VALID);
 
@@ -155,7 +220,7 @@ static uint16_t _usbd_ep_read_packet(uint8_t addr, void *buf, uint16_t len) {
 		return 0;
 
 	len = MIN(USB_GET_EP_RX_COUNT(addr) & 0x3ff, len);
-	st_usbfs_copy_from_pm(buf, USB_GET_EP_RX_BUFF(addr), len);
+	PERF(PERF_PMA_COPY, st_usbfs_copy_from_pm(buf, USB_GET_EP_RX_BUFF(addr), len));
 	USB_CLR_EP_RX_CTR(addr);
 
 	if (!usb_force_nak[addr]) {
@@ -209,6 +274,8 @@ uint8_t _ep_stall_get(uint8_t addr) {
 }
 
 static inline void _stall_transaction() {
+	trace(TRACE_USB_STALL, usb_fsm_state);
+	LINK_STAT(LINK_STALLS);
 	_ep_stall_set(0, 1);
 	usb_fsm_state = IDLE;
 }
@@ -238,6 +305,7 @@ static int usb_control_recv_chunk() {
 	uint16_t size = _usbd_ep_read_packet(0, &usbd_control_buffer[datasize], packetsize);
 
 	if (size != packetsize) {
+		LINK_STAT(LINK_SHORT_READS);
 		_stall_transaction();
 		return -1;
 	}
@@ -321,6 +389,10 @@ enum usbd_request_return_codes _usbd_standard_request_device() {
 				USB_SET_EP_RX_STAT(i, USB_EP_RX_STAT_DISABLED);
 			}
 			usb_pm_top = USBD_PM_TOP + (2 * dev_desc.bMaxPacketSize0);
+			usb_altsetting = DFU_ALT_FLASH;
+			#ifdef ENABLE_BOOT_TIMING
+			boot_timing_mark();
+			#endif
 			return USBD_REQ_HANDLED;
 		}
 		return USBD_REQ_NOTSUPP;
@@ -344,11 +416,13 @@ enum usbd_request_return_codes _usbd_standard_request_device() {
 enum usbd_request_return_codes _usbd_standard_request_interface() {
 	switch (usb_req.bRequest) {
 	case USB_REQ_GET_INTERFACE:
-		// command = usb_standard_get_interface;
-		usbd_control_buffer[0] = 1;
+		usbd_control_buffer[0] = usb_altsetting;
 		datasize = 1;
 		return USBD_REQ_HANDLED;
 	case USB_REQ_SET_INTERFACE:
+		if (usb_req.wIndex != 0 || usb_req.wValue >= DFU_NUM_ALTS)
+			return USBD_REQ_NOTSUPP;
+		usb_altsetting = usb_req.wValue;
 		datasize = 0;
 		return USBD_REQ_HANDLED;
 	case USB_REQ_GET_STATUS:
@@ -428,6 +502,14 @@ static enum usbd_request_return_codes usb_control_request_dispatch() {
 	}
 	#endif
 
+	#ifdef ENABLE_VENDOR_REQUESTS
+	const uint8_t vtype = USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE;
+	if ((usb_req.bmRequestType & mask) == vtype) {
+		datasize = usb_req.wLength;
+		return usb_vendor_request(&usb_req, &datasize);
+	}
+	#endif
+
 	/* Try standard request if not already handled. */
 	return _usbd_standard_request();
 }
@@ -489,6 +571,8 @@ static void _usbd_control_setup() {
 		_stall_transaction();
 		return;
 	}
+	trace(TRACE_USB_SETUP, usb_req.bmRequestType | (usb_req.bRequest << 8) | (usb_req.wValue << 16));
+	LINK_STAT(LINK_SETUPS);
 
 	if ((usb_req.wLength == 0) || (usb_req.bmRequestType & 0x80))
 		_usb_control_setup_read();
@@ -608,6 +692,8 @@ void do_usb_poll() {
 
 	if (istr & USB_ISTR_RESET) {
 		USB_CLR_ISTR_RESET();
+		trace(TRACE_USB_RESET, 0);
+		LINK_STAT(LINK_BUS_RESETS);
 		usb_pm_top = USBD_PM_TOP;
 
 		_usbd_ep_setup(0, USB_ENDPOINT_ATTR_CONTROL, dev_desc.bMaxPacketSize0);
@@ -628,6 +714,13 @@ void do_usb_poll() {
 			USB_CLR_EP_TX_CTR(ep);
 			_usbd_control_in();
 		}
+		#ifdef ENABLE_TRACE
+		static uint8_t traced_fsm_state;
+		if (usb_fsm_state != traced_fsm_state) {
+			trace(TRACE_USB_FSM, usb_fsm_state);
+			traced_fsm_state = usb_fsm_state;
+		}
+		#endif
 	}
 
 	if (istr & USB_ISTR_SUSP)
@@ -639,6 +732,21 @@ void do_usb_poll() {
 	if (istr & USB_ISTR_SOF)
 		USB_CLR_ISTR_SOF();
 
+	#ifdef ENABLE_LINK_STATS
+	if (istr & USB_ISTR_ERR) {
+		USB_CLR_ISTR_ERR();
+		LINK_STAT(LINK_BUS_ERRORS);
+	}
+	if (istr & USB_ISTR_PMAOVR) {
+		USB_CLR_ISTR_PMAOVR();
+		LINK_STAT(LINK_PMA_OVERRUNS);
+	}
+	if (istr & USB_ISTR_ESOF) {
+		USB_CLR_ISTR_ESOF();
+		LINK_STAT(LINK_MISSED_SOFS);
+	}
+	#endif
+
 	*USB_CNTR_REG &= ~USB_CNTR_SOFM;
 }
 
@@ -9,6 +9,12 @@
 #define USB_DEV_FS_BASE    (PERIPH_BASE_APB1 + 0x5c00)
 #define USB_PMA_BASE       (PERIPH_BASE_APB1 + 0x6000)
 
+// Vendor requests (see vendor.h) are only answered if some feature needs them
+#if defined(ENABLE_PERF_COUNTERS) || defined(ENABLE_TRACE) || defined(ENABLE_LINK_STATS) || \
+    defined(ENABLE_SELF_BENCH) || defined(ENABLE_CAPS)
+#define ENABLE_VENDOR_REQUESTS
+#endif
+
 // DFU definitions
 
 enum dfu_req {
@@ -506,6 +512,35 @@ do {									\
 #define DFU_TRANSFER_SIZE 1024
 void usb_init();
 void do_usb_poll();
+#ifdef ENABLE_SELF_BENCH
+void usb_pma_roundtrip(void *buf, uint16_t len);
+#endif
+
+// DFU alternate settings (interface 0), optional ones are numbered in order
+#define DFU_ALT_FLASH       0
+#ifdef ENABLE_OPTBYTES_ALT
+#define DFU_ALT_OPTBYTES    1
+#define DFU_ALTS_OPTBYTES   1
+#else
+#define DFU_ALTS_OPTBYTES   0
+#endif
+#ifdef ENABLE_SRAM_EXEC
+#define DFU_ALT_SRAM        (1 + DFU_ALTS_OPTBYTES)
+#define DFU_ALTS_SRAM       1
+#else
+#define DFU_ALTS_SRAM       0
+#endif
+#define DFU_NUM_ALTS        (1 + DFU_ALTS_OPTBYTES + DFU_ALTS_SRAM)
+// Extra alt settings have their interface strings after the 5 base ones
+#ifdef ENABLE_XL_DUAL_BANK
+// GETSTATUS description for errors of a held back block (see main.c)
+#define DFU_HELD_ISTRING    (5 + DFU_NUM_ALTS)
+#define USB_NUM_STRINGS     (5 + DFU_NUM_ALTS)
+#else
+#define USB_NUM_STRINGS     (5 + DFU_NUM_ALTS - 1)
+#endif
+#define DFU_ALT_ISTRING(alt) (5 + (alt))
+extern uint8_t usb_altsetting;
 
 
 
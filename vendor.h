@@ -0,0 +1,160 @@
+#ifndef __VENDOR__HH__
+#define __VENDOR__HH__
+
+#include <stdint.h>
+
+// Vendor control requests (bmRequestType 0xC0: device to host, vendor,
+// device recipient). Each one is only answered if the build includes the
+// feature behind it, otherwise the request is stalled. Replies start with a
+// version byte and are truncated to wLength. This header is shared with the
+// host tools, keep it free of firmware definitions.
+
+#define VENDOR_REQ_GET_PERF        0x50   // struct vendor_perf (ENABLE_PERF_COUNTERS)
+#define VENDOR_REQ_GET_TRACE       0x51   // struct trace_ring, see trace.h (ENABLE_TRACE)
+#define VENDOR_REQ_GET_LINK_STATS  0x52   // struct vendor_link_stats (ENABLE_LINK_STATS)
+#define VENDOR_REQ_SELF_BENCH      0x53   // struct vendor_self_bench (ENABLE_SELF_BENCH)
+#define VENDOR_REQ_GET_CAPS        0x54   // struct vendor_caps (ENABLE_CAPS)
+
+// wValue flags for VENDOR_REQ_GET_PERF
+#define VENDOR_PERF_CLEAR          0x01   // Clear the counters once read
+// wValue flags for VENDOR_REQ_GET_TRACE
+#define VENDOR_TRACE_CLEAR         0x01   // Empty the ring once read
+// wValue flags for VENDOR_REQ_GET_LINK_STATS
+#define VENDOR_LINK_CLEAR          0x01   // Clear the counters once read
+
+// Performance counters, in core cycles (DWT CYCCNT)
+#define VENDOR_PERF_VERSION        1
+
+enum vendor_perf_id {
+	PERF_ERASE,         // Page erases (XL parts and the SAFEWRITE wipe include their blank checks)
+	PERF_PROGRAM,       // Block programming, without the verify
+	PERF_BLANK_CHECK,   // Blank checks before erasing
+	PERF_CHECKSUM,      // Image checksums computed in DFU mode
+	PERF_PMA_COPY,      // Packet memory copies, both directions
+	PERF_POLL_GAP,      // From the end of a block's flash work to the next GETSTATUS
+	PERF_NUM
+};
+
+struct vendor_perf {
+	uint8_t  version;
+	uint8_t  count;        // PERF_NUM
+	uint8_t  core_mhz;     // Core clock the cycles refer to
+	uint8_t  reserved;
+	struct {
+		uint32_t cycles;   // Accumulated (wraps after 2^32 cycles, ~60s at 72MHz)
+		uint32_t calls;
+	} counter[PERF_NUM];
+};
+
+_Static_assert(sizeof(struct vendor_perf) == 4 + 8 * PERF_NUM, "vendor_perf must be packed");
+
+// USB link health, event counts since the bootloader started
+#define VENDOR_LINK_VERSION        1
+
+enum vendor_link_id {
+	LINK_BUS_ERRORS,    // ISTR ERR: CRC, bit stuffing or framing errors, missing handshakes
+	LINK_PMA_OVERRUNS,  // ISTR PMAOVR: packet memory not served in time
+	LINK_MISSED_SOFS,   // ISTR ESOF: 3 of them precede every suspend too
+	LINK_STALLS,        // Control transfers stalled (unsupported requests included)
+	LINK_SHORT_READS,   // OUT data packets shorter than expected
+	LINK_BUS_RESETS,    // USB resets, one per (re)enumeration
+	LINK_SETUPS,        // SETUP packets, to put the others in proportion
+	LINK_NUM
+};
+
+struct vendor_link_stats {
+	uint8_t  version;
+	uint8_t  count;        // LINK_NUM
+	uint16_t reserved;
+	uint32_t counter[LINK_NUM];
+};
+
+_Static_assert(sizeof(struct vendor_link_stats) == 4 + 4 * LINK_NUM, "vendor_link_stats must be packed");
+
+// Self benchmark. With VENDOR_BENCH_START in wValue (dfuIDLE only) it
+// starts a run, the reply has pending set: the last flash page is then
+// programmed with a fixed pattern and erased again on the next DFU polls,
+// the host polls GETSTATUS (dfuDNBUSY) until dfuIDLE and reads the results
+// with wValue 0. The page must be blank, otherwise the flash timings are
+// skipped and status is errCHECK_ERASED. The page is left blank. Timings
+// are in microseconds, measured with the DWT.
+#define VENDOR_BENCH_VERSION       2
+#define VENDOR_BENCH_START         0x0001
+
+struct vendor_self_bench {
+	uint8_t  version;
+	uint8_t  status;         // DFU status of the flash part, 0 if OK
+	uint8_t  core_mhz;
+	uint8_t  pending;        // Flash steps not run yet, poll and read again
+	uint32_t page_addr;      // Scratch page
+	uint32_t page_size;
+	uint32_t blank_check_us; // Reading the whole (blank) page
+	uint32_t program_us;     // Programming the whole page, without the verify
+	uint32_t erase_us;       // Erasing it again
+	uint32_t crc_bytes;      // Flash bytes fed to the CRC unit
+	uint32_t crc_us;
+	uint32_t pma_bytes;      // Bytes copied to the USB packet memory and back
+	uint32_t pma_us;
+};
+
+_Static_assert(sizeof(struct vendor_self_bench) == 40, "vendor_self_bench must be packed");
+
+// Build capabilities, so hosts can pick a flashing strategy without being
+// told how the bootloader was configured. Later versions only append
+// fields, hosts should accept longer replies.
+#define VENDOR_CAPS_VERSION        1
+
+// Features (bits of vendor_caps.features)
+#define CAPS_DFU_UPLOAD            (1 << 0)   // Flash can be read back (ENABLE_DFU_UPLOAD)
+#define CAPS_SAFEWRITE             (1 << 1)   // First write/erase wipes the whole payload, pre-erasing is redundant
+#define CAPS_WRITEPROT             (1 << 2)   // Bootloader pages write protected
+#define CAPS_PROTECTIONS           (1 << 3)   // Read protection and debug disabled
+#define CAPS_CHECKSUM              (1 << 4)   // Images are only booted with a valid checksum (see checksum_kind)
+#define CAPS_DUAL_SLOT             (1 << 5)   // A/B slots, only the inactive one is writable
+#define CAPS_XL_DUAL_BANK          (1 << 6)   // Blocks alternating between banks are programmed concurrently
+#define CAPS_SHORT_POLL            (1 << 7)   // 10ms poll timeout while busy (poll_ms)
+#define CAPS_OPTBYTES_ALT          (1 << 8)   // Option bytes alt setting
+#define CAPS_SRAM_EXEC             (1 << 9)   // SRAM alt setting, images run with DfuSe leave
+#define CAPS_WATCHDOG              (1 << 10)  // IWDG started before jumping to the app
+#define CAPS_BOOT_HANDOFF          (1 << 11)  // Handoff block for the app (boot_handoff.h)
+#define CAPS_BOOT_SERVICES         (1 << 12)  // Flash services for the app (boot_services.h)
+#define CAPS_WINUSB                (1 << 13)  // WinUSB descriptors, no driver needed on Windows
+#define CAPS_VERIFY                (1 << 14)  // Programmed blocks are read back (errVERIFY)
+
+// DfuSe commands (bits of vendor_caps.dfuse_cmds)
+#define CAPS_CMD_GET               (1 << 0)   // Get commands, an upload of block 0
+#define CAPS_CMD_SETADDR           (1 << 1)   // 0x21
+#define CAPS_CMD_ERASE             (1 << 2)   // 0x41, single pages only (no mass erase)
+
+// Flash timing classes
+enum vendor_caps_flash {
+	CAPS_FLASH_STM32,   // Halfword programming (tPROG up to 70us), tERASE up to 40ms per page
+	CAPS_FLASH_CH32,    // CH32F103 128 byte page programming, blocks must be 128 byte aligned
+};
+
+// Image checksum kinds (vendor_caps.checksum_kind)
+enum vendor_caps_checksum {
+	CAPS_CHECKSUM_NONE,
+	CAPS_CHECKSUM_XOR,  // Words xor to 0xB4DC0FEE, size in words at 0x20 (see checksum.py)
+};
+
+struct vendor_caps {
+	uint8_t  version;
+	uint8_t  size;           // sizeof(struct vendor_caps)
+	uint16_t transfer_size;  // wTransferSize
+	uint32_t features;       // CAPS_* bits
+	uint32_t flash_base;
+	uint32_t app_start;      // Payload area, all slots included
+	uint32_t app_end;
+	uint16_t page_size;      // Erase granularity
+	uint8_t  program_align;  // Block address alignment needed, in bytes
+	uint8_t  flash_class;    // enum vendor_caps_flash
+	uint16_t poll_ms;        // bwPollTimeout reported for a block (longer during a SAFEWRITE wipe)
+	uint8_t  checksum_kind;  // enum vendor_caps_checksum
+	uint8_t  dfuse_cmds;     // CAPS_CMD_* bits
+	uint32_t vendor_reqs;    // Bit n set if vendor request 0x50 + n is answered
+};
+
+_Static_assert(sizeof(struct vendor_caps) == 32, "vendor_caps must be packed");
+
+#endif